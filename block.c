@@ -0,0 +1,245 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "block.h"
+#include "callback.h"
+#include "jit.h"
+
+void block_init(struct cpu_state *cpu)
+{
+	cpu->blocks = calloc(1, sizeof(struct block_cache));
+	cpu->blocks->arena = malloc(BLOCK_ARENA_SIZE);
+}
+
+void block_flush(struct cpu_state *cpu)
+{
+	struct block_cache *bc = cpu->blocks;
+
+	if(!bc)
+		return;
+	memset(bc->hash, 0, sizeof(bc->hash));
+	memset(bc->pages, 0, sizeof(bc->pages));
+	bc->used = 0;
+	bc->flushes++;
+	jit_flush(cpu);
+}
+
+static inline uint32_t block_hash(uint32_t pc)
+{
+	return (pc >> 2) & (BLOCK_HASH_SIZE - 1);
+}
+
+static struct block *block_build(struct cpu_state *cpu, uint32_t pc)
+{
+	struct block_cache *bc = cpu->blocks;
+	const struct insn *insn;
+	struct block *b;
+	uint32_t next;
+	uint32_t n = 0;
+	uint8_t flags = 0;
+
+	if(bc->used + sizeof(struct block) + BLOCK_MAX_INSNS * sizeof(struct insn) > BLOCK_ARENA_SIZE)
+		block_flush(cpu);
+	b = (struct block *)(bc->arena + bc->used);
+	b->pc = pc;
+
+	for(;;)
+	{
+		insn = fetch_insn(cpu, pc + n * 4);
+		b->insn[n++] = *insn;
+		flags |= insn->flags;
+		next = pc + n * 4;
+		if(insn->flags & INSN_BRANCH)
+		{
+			b->insn[n++] = *fetch_insn(cpu, next);
+			flags |= b->insn[n - 1].flags;
+			break;
+		}
+		if(insn->flags & INSN_END)
+			break;
+		if(n >= BLOCK_MAX_INSNS - 1 || next == RAM_END || next == FLASH_END)
+			break;
+		if(has_callback(cpu, next))
+			break;
+	}
+
+	b->count = n;
+	b->valid = true;
+	b->idle = n >= 2 && n <= BLOCK_IDLE_INSNS && (b->insn[n - 2].flags & INSN_BRANCH) &&
+		!(flags & (INSN_STORE | INSN_END));
+	b->link[0] = NULL;
+	b->link[1] = NULL;
+	b->runs = 0;
+	b->code = NULL;
+	b->page[0] = icache_page(pc);
+	b->page[1] = icache_page(pc + (n - 1) * 4);
+
+	b->hash_next = bc->hash[block_hash(pc)];
+	bc->hash[block_hash(pc)] = b;
+	b->page_next[0] = bc->pages[b->page[0]];
+	bc->pages[b->page[0]] = b;
+	if(b->page[1] != b->page[0])
+	{
+		b->page_next[1] = bc->pages[b->page[1]];
+		bc->pages[b->page[1]] = b;
+	}
+
+	bc->used += (sizeof(struct block) + n * sizeof(struct insn) + 7) & ~7;
+	return b;
+}
+
+struct block *block_lookup(struct cpu_state *cpu, uint32_t pc)
+{
+	struct block *b;
+
+	for(b = cpu->blocks->hash[block_hash(pc)]; b; b = b->hash_next)
+	{
+		if(b->pc == pc)
+			return b;
+	}
+	return block_build(cpu, pc);
+}
+
+/*
+ * Find the block to run after prev, following prev's chain links before
+ * falling back to the hash table. New successors are linked most recent
+ * first so both sides of a conditional branch stay chained.
+ */
+struct block *block_next(struct cpu_state *cpu, struct block *prev)
+{
+	uint32_t pc = cpu->pc;
+	uint32_t flushes = cpu->blocks->flushes;
+	struct block *b;
+
+	if(prev)
+	{
+		b = prev->link[0];
+		if(b && b->pc == pc && b->valid)
+			return b;
+		b = prev->link[1];
+		if(b && b->pc == pc && b->valid)
+			return b;
+	}
+
+	b = block_lookup(cpu, pc);
+	if(prev && flushes == cpu->blocks->flushes)
+	{
+		prev->link[1] = prev->link[0];
+		prev->link[0] = b;
+	}
+	return b;
+}
+
+static void block_unhash(struct block_cache *bc, struct block *b)
+{
+	struct block **pb;
+
+	for(pb = &bc->hash[block_hash(b->pc)]; *pb; pb = &(*pb)->hash_next)
+	{
+		if(*pb == b)
+		{
+			*pb = b->hash_next;
+			return;
+		}
+	}
+}
+
+/*
+ * Called when a store hits a decoded instruction word. Blocks covering it
+ * are marked invalid and dropped from the lookup structures; their memory
+ * stays until the next flush so chain links and a block that is still
+ * running remain safe to dereference.
+ */
+void block_invalidate(struct cpu_state *cpu, uint32_t address)
+{
+	struct block_cache *bc = cpu->blocks;
+	uint32_t page = icache_page(address);
+	struct block **pb;
+	struct block *b;
+	int32_t which;
+
+	if(!bc)
+		return;
+
+	pb = &bc->pages[page];
+	while((b = *pb))
+	{
+		which = b->page[0] == page ? 0 : 1;
+		if(b->valid && address >= b->pc && address < b->pc + b->count * 4)
+		{
+			b->valid = false;
+			block_unhash(bc, b);
+		}
+		if(!b->valid)
+			*pb = b->page_next[which];
+		else
+			pb = &b->page_next[which];
+	}
+}
+
+#ifndef THREADED_DISPATCH
+static uint32_t block_interpret(struct cpu_state *cpu, struct block *b)
+{
+	const struct insn *insn = b->insn;
+	const struct insn *end = insn + b->count;
+
+	for(; insn < end; insn++)
+	{
+		if(cpu->delayed_jump)
+		{
+			cpu->pc = cpu->jump_pc;
+			cpu->delayed_jump = 0;
+			cpu->jump_pc = 0;
+		}
+		else
+			cpu->pc += 4;
+
+		insn->handler(cpu, insn);
+
+		if(insn->flags & (INSN_LIKELY | INSN_STORE | INSN_LOAD))
+		{
+			if((insn->flags & INSN_LIKELY) && !cpu->delayed_jump)
+			{
+				insn++;
+				break;
+			}
+			if(!b->valid)
+			{
+				insn++;
+				break;
+			}
+		}
+	}
+	return insn - b->insn;
+}
+#endif
+
+/*
+ * Run a block with the same pc/delay slot bookkeeping execute() does per
+ * instruction. Returns the number of instructions executed, which is less
+ * than b->count when a likely branch nullified its delay slot or a store
+ * invalidated the block itself.
+ */
+uint32_t block_run(struct cpu_state *cpu, struct block *b)
+{
+	uint32_t n;
+	uint32_t i;
+
+#ifdef THREADED_DISPATCH
+	n = block_dispatch(cpu, b);
+#else
+	n = block_interpret(cpu, b);
+#endif
+	for(i = n > 3 ? n - 3 : 0; i < n; i++)
+	{
+		cpu->prev_pc[0] = cpu->prev_pc[1];
+		cpu->prev_pc[1] = cpu->prev_pc[2];
+		cpu->prev_pc[2] = b->pc + i * 4;
+	}
+	return n;
+}
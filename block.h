@@ -0,0 +1,51 @@
+#ifndef _BLOCK_H_
+#define _BLOCK_H_
+
+#define BLOCK_MAX_INSNS   64
+#define BLOCK_CHAIN_MAX   256	/* blocks per execute_block() call */
+#define BLOCK_HASH_SIZE   (1 << 16)
+#define BLOCK_ARENA_SIZE  (16 << 20)
+#define BLOCK_IDLE_INSNS  16	/* longest block checked for spinning */
+
+/*
+ * A basic block: straight-line guest code starting at pc and ending after
+ * the delay slot of the first branch or jump, or at the first instruction
+ * that has to be followed by an interrupt check (COP0 access, eret).
+ * Blocks stop before any address with a registered callback so callbacks
+ * only need to be checked at block boundaries.
+ */
+struct block
+{
+	uint32_t pc;
+	uint32_t count;
+	bool valid;
+	bool idle;			/* may be a spin loop, see execute_block() */
+	uint32_t page[2];		/* icache pages covered by the block */
+	struct block *hash_next;
+	struct block *page_next[2];
+	struct block *link[2];		/* chained successors */
+	uint32_t runs;
+	void *code;			/* translated code, see jit_execute() */
+	struct insn insn[];
+};
+
+struct block_cache
+{
+	struct block *hash[BLOCK_HASH_SIZE];
+	struct block *pages[ICACHE_PAGES];
+	int8_t *arena;
+	uint32_t used;
+	uint32_t flushes;
+};
+
+void block_init(struct cpu_state *cpu);
+void block_flush(struct cpu_state *cpu);
+void block_invalidate(struct cpu_state *cpu, uint32_t address);
+struct block *block_lookup(struct cpu_state *cpu, uint32_t pc);
+struct block *block_next(struct cpu_state *cpu, struct block *prev);
+uint32_t block_run(struct cpu_state *cpu, struct block *b);
+#ifdef THREADED_DISPATCH
+uint32_t block_dispatch(struct cpu_state *cpu, struct block *b);
+#endif
+
+#endif /* _BLOCK_H_ */
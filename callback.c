@@ -0,0 +1,153 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "callback.h"
+#include "block.h"
+
+static inline uint32_t callback_hash(uint32_t address)
+{
+	return (address >> 2) & (CALLBACK_HASH_SIZE - 1);
+}
+
+void callback_init(struct cpu_state *cpu)
+{
+	cpu->callbacks = calloc(1, sizeof(struct callback_table));
+}
+
+void callback_clear(struct cpu_state *cpu)
+{
+	struct callback_table *ct = cpu->callbacks;
+	struct callback *cb;
+	int32_t i;
+
+	for(i = 0; i < CALLBACK_HASH_SIZE; i++)
+	{
+		while((cb = ct->hash[i]))
+		{
+			ct->hash[i] = cb->next;
+			free(cb->fn);
+			free(cb);
+		}
+	}
+	memset(ct->filter, 0, sizeof(ct->filter));
+}
+
+struct callback *callback_find(struct cpu_state *cpu, uint32_t address)
+{
+	struct callback *cb;
+
+	for(cb = cpu->callbacks->hash[callback_hash(address)]; cb; cb = cb->next)
+	{
+		if(cb->address == address)
+			return cb;
+	}
+	return NULL;
+}
+
+/* Blocks only check callbacks at their first instruction */
+static void callback_invalidate_blocks(struct cpu_state *cpu, uint32_t address)
+{
+	if((address >= RAM_START && address < RAM_END) ||
+	   (address >= FLASH_START && address < FLASH_END))
+		block_invalidate(cpu, address);
+}
+
+void register_callback(struct cpu_state *cpu, uint32_t address, void(*callback)(struct cpu_state *))
+{
+	struct callback_table *ct = cpu->callbacks;
+	struct callback *cb;
+	uint32_t bit = callback_bit(address);
+	uint32_t i;
+
+	cb = callback_find(cpu, address);
+	if(!cb)
+	{
+		cb = calloc(1, sizeof(struct callback));
+		cb->address = address;
+		cb->next = ct->hash[callback_hash(address)];
+		ct->hash[callback_hash(address)] = cb;
+		ct->filter[bit >> 6] |= 1ull << (bit & 63);
+		callback_invalidate_blocks(cpu, address);
+	}
+
+	for(i = 0; i < cb->count; i++)
+	{
+		if(cb->fn[i] == callback)
+			return;
+	}
+	if(cb->count == cb->size)
+	{
+		cb->size = cb->size ? cb->size * 2 : 2;
+		cb->fn = realloc(cb->fn, cb->size * sizeof(callback_fn));
+	}
+	cb->fn[cb->count++] = callback;
+}
+
+void unregister_callback(struct cpu_state *cpu, uint32_t address, void(*callback)(struct cpu_state *))
+{
+	struct callback_table *ct = cpu->callbacks;
+	struct callback **pcb;
+	struct callback *cb;
+	uint32_t bit = callback_bit(address);
+	uint32_t i;
+
+	cb = callback_find(cpu, address);
+	if(!cb)
+		return;
+	for(i = 0; i < cb->count; i++)
+	{
+		if(cb->fn[i] == callback)
+		{
+			memmove(&cb->fn[i], &cb->fn[i + 1], (cb->count - i - 1) * sizeof(callback_fn));
+			cb->count--;
+			break;
+		}
+	}
+	if(cb->count)
+		return;
+
+	for(pcb = &ct->hash[callback_hash(address)]; *pcb != cb; pcb = &(*pcb)->next)
+		;
+	*pcb = cb->next;
+	free(cb->fn);
+	free(cb);
+
+	/* the filter bit stays while another address in the chain shares it */
+	for(cb = ct->hash[callback_hash(address)]; cb; cb = cb->next)
+	{
+		if(callback_bit(cb->address) == bit)
+			return;
+	}
+	ct->filter[bit >> 6] &= ~(1ull << (bit & 63));
+}
+
+/*
+ * Run the callbacks registered at the current pc, newest first. A callback
+ * may unregister itself or others, so the entry is looked up again for
+ * every call, and may move pc, which leaves the older ones out.
+ */
+void process_callbacks(struct cpu_state *cpu)
+{
+	uint32_t address = cpu->pc;
+	struct callback *cb;
+	int32_t i;
+
+	cb = callback_find(cpu, address);
+	if(!cb)
+		return;
+	for(i = cb->count - 1; i >= 0; i--)
+	{
+		cb = callback_find(cpu, address);
+		if(!cb)
+			return;
+		if((uint32_t)i < cb->count)
+			cb->fn[i](cpu);
+		if((uint32_t)cpu->pc != address)
+			return;
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef _CALLBACK_H_
+#define _CALLBACK_H_
+
+#define CALLBACK_FILTER_BITS (1 << 20)
+#define CALLBACK_HASH_SIZE   1024
+
+typedef void (*callback_fn)(struct cpu_state *cpu);
+
+/* Everything registered at one address, in registration order */
+struct callback
+{
+	struct callback *next;
+	uint32_t address;
+	uint32_t count;
+	uint32_t size;
+	callback_fn *fn;
+};
+
+/*
+ * Callbacks are hashed by address. The filter has a bit set for every word
+ * address (modulo its size) that has callbacks, so instructions without one
+ * cost a single bit test. The hash size divides the filter size, so all
+ * addresses sharing a filter bit also share a hash chain.
+ */
+struct callback_table
+{
+	uint64_t filter[CALLBACK_FILTER_BITS / 64];
+	struct callback *hash[CALLBACK_HASH_SIZE];
+};
+
+void callback_init(struct cpu_state *cpu);
+void callback_clear(struct cpu_state *cpu);
+struct callback *callback_find(struct cpu_state *cpu, uint32_t address);
+
+static inline uint32_t callback_bit(uint32_t address)
+{
+	return (address >> 2) & (CALLBACK_FILTER_BITS - 1);
+}
+
+/* May report addresses without callbacks, never misses one */
+static inline bool callback_filter(struct cpu_state *cpu, uint32_t address)
+{
+	uint32_t bit = callback_bit(address);
+
+	return (cpu->callbacks->filter[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static inline bool has_callback(struct cpu_state *cpu, uint32_t address)
+{
+	return callback_filter(cpu, address) && callback_find(cpu, address);
+}
+
+#endif /* _CALLBACK_H_ */
@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -9,52 +10,41 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <pthread.h>
 
 #include "emulator.h"
+#include "mem.h"
+#include "block.h"
+#include "callback.h"
+#include "scheduler.h"
+#include "machine.h"
+#include "snapshot.h"
+#include "record.h"
+#include "reverse.h"
+#include "jit.h"
+#include "trace.h"
+#include "profile.h"
+#include "symbol.h"
+#include "hle.h"
+#include "uart.h"
 #include "opcode.h"
 
 #define AL "\033[100D\33[65C"
 
-#define dtrace(...) do { if( debug ) fprintf(stderr, __VA_ARGS__); } while(0)
+#define dtrace(...) do { if( cpu->debug ) fprintf(stderr, __VA_ARGS__); } while(0)
 
 struct cpu_state cpu;
 
-bool debug = false;
-bool run;
-bool do_step;
-int32_t count = 0;
-static int32_t timer_int = 0;
-static int32_t fakeflash_state = 0;
-static int32_t flash_auto_select = 0;
-static bool flash_log = false;
 static bool log_reg = false;
 
-static int32_t pll_control = 0;
-static int32_t blk_enables = 0;
-static int32_t perf_sys_pll = 0;
-static int32_t irq_mask = 0;
-static int32_t irq_stat = 0;
-static int32_t timer_ctl0 = 0;
-static int32_t timer_ctl1 = 0;
-static int32_t timer_ctl2 = 0;
-static int32_t uart0_ctrl = 0;
-static int32_t uart0_baud_rate = 0;
-static int32_t uart0_mctl = 0;
-static int32_t uart0_ir = (1 << 5) << 16;
-static int32_t uart1_ctrl = 0;
-static int32_t uart1_baud_rate = 0;
-static int32_t uart1_mctl = 0;
-static int32_t uart1_ir = (1 << 5) << 16;
-static int32_t mpi_csbase_0 = 0;
-static int32_t mpi_csctl_0 = 0;
-static int32_t mpi_csbase_1 = 0;
-static int32_t mpi_csctl_1 = 0;
-static int32_t pci_timers = 0;
-static int32_t sdram_cfg = 0;
-static int32_t sdram_unk1 = 0;
-static int32_t sdram_unk2 = 0;
-static int32_t sdram_mbase = 0;
-static int32_t sdram_unk3 = 0;
+/* timer_int is raised every TIMER_TICK instructions */
+#define TIMER_TICK 10000000
+
+static void irq_update(struct cpu_state *cpu);
+static void compare_update(struct cpu_state *cpu);
+static void timer_event(struct cpu_state *cpu);
 
 int8_t flash_read_byte(uint32_t vaddr)
 {
@@ -87,10 +77,10 @@ int8_t flash_read_byte(uint32_t vaddr)
 	return rv;
 }
 bool disable_flash = false;
-int16_t flash_read_short(uint32_t vaddr)
+int16_t flash_read_short(struct cpu_state *cpu, uint32_t vaddr)
 {
 	int16_t rv = 0x0;
-	if( flash_auto_select == 3 )
+	if( cpu->mach->flash_auto_select == 3 )
 	{
 		if( (vaddr & 0x3) == 0 )
 			return 0x2000; /* Manufacturer code, from ST M29W160EB datasheet */
@@ -211,333 +201,287 @@ int16_t flash_read_short(uint32_t vaddr)
 	return rv;
 }
 
-void flash_write(uint32_t vaddr, uint16_t val)
+void flash_write(struct cpu_state *cpu, uint32_t vaddr, uint16_t val)
 {
-	printf( "fakeflash write @ 0x%08x <= 0x%08x (pc:0x%08x)\n", vaddr, val, cpu.pc );
+	printf( "fakeflash write @ 0x%08x <= 0x%08x (pc:0x%08x)\n", vaddr, val, cpu->pc );
 	vaddr &= 0x1fffff;
 	if(vaddr == 0x0 && (val == 0xf0 || val == 0xf0f0))
 	{
-		fakeflash_state = 0;
-		flash_auto_select = 0;
+		cpu->mach->fakeflash_state = 0;
+		cpu->mach->flash_auto_select = 0;
 	}
 	if(vaddr == 0x0 && (val == 0xff || val == 0xffff))
 	{
-		fakeflash_state = 0;
-		flash_auto_select = 0;
+		cpu->mach->fakeflash_state = 0;
+		cpu->mach->flash_auto_select = 0;
 	}
 	if(vaddr == 0xaa && (val == 0x98 || val == 0x9898))
 	{
-		fakeflash_state = 1;
-		flash_log = 1;
+		cpu->mach->fakeflash_state = 1;
+		cpu->mach->flash_log = 1;
 	}
-	if(vaddr == 0xaaa && (val == 0xaa || val == 0xaaaa ) && fakeflash_state == 0 && flash_auto_select == 0)
+	if(vaddr == 0xaaa && (val == 0xaa || val == 0xaaaa ) && cpu->mach->fakeflash_state == 0 && cpu->mach->flash_auto_select == 0)
 	{
-		flash_auto_select = 1;
+		cpu->mach->flash_auto_select = 1;
 	}
-	if(vaddr == 0x554 && (val == 0x55 || val == 0x5555 ) && fakeflash_state == 0 && flash_auto_select == 1)
+	if(vaddr == 0x554 && (val == 0x55 || val == 0x5555 ) && cpu->mach->fakeflash_state == 0 && cpu->mach->flash_auto_select == 1)
 	{
-		flash_auto_select = 2;
+		cpu->mach->flash_auto_select = 2;
 	}
-	if(vaddr == 0xaaa && (val == 0x90 || val == 0x9090 ) && fakeflash_state == 0 && flash_auto_select == 2)
+	if(vaddr == 0xaaa && (val == 0x90 || val == 0x9090 ) && cpu->mach->fakeflash_state == 0 && cpu->mach->flash_auto_select == 2)
 	{
-		flash_auto_select = 3;
-		fakeflash_state = 1;
+		cpu->mach->flash_auto_select = 3;
+		cpu->mach->fakeflash_state = 1;
 	}
-	printf("fakeflash write state: %d\n", fakeflash_state);
+	printf("fakeflash write state: %d\n", cpu->mach->fakeflash_state);
+	mem_map_flash(cpu);
+}
 
+/*
+ * Registers in the 0xfffe0000 block. Each one is declared once in
+ * mmio_regs[]; mmio_init() indexes them by offset so an access costs one
+ * table lookup. Reads ignore the access width like the hardware reads we
+ * have seen do, writes are registered per width.
+ */
+#define MMIO_SIZE (REG_END - REG_START + 1)
+
+struct mmio_reg
+{
+	uint32_t offset;
+	uint8_t width;		/* width of the writes it takes */
+	const char *name;	/* writes are logged under this name */
+	uint32_t (*read)(struct cpu_state *cpu, const struct mmio_reg *reg);
+	void (*write)(struct cpu_state *cpu, const struct mmio_reg *reg, uint32_t vaddr, uint32_t val);
+	int32_t state;		/* offset into struct machine, or REG_NONE */
+	uint8_t shift;		/* position of the register within the state */
+	uint32_t value;		/* contents of constant registers */
+	bool polled;		/* not logged by log_reg */
+};
+
+static uint32_t reg_read_const(struct cpu_state *cpu, const struct mmio_reg *reg)
+{
+	return reg->value;
 }
 
-void reg_write_byte(uint32_t vaddr, uint8_t val)
+#define REG_STATE(var) offsetof(struct machine, var)
+#define REG_NONE       -1
+
+static inline int32_t *reg_state(struct cpu_state *cpu, const struct mmio_reg *reg)
 {
-	/* printf("Reg write b(0x%x) = 0x%02x\n", vaddr, val); */
-	if(vaddr == 0xfffe0008)
-	{
-		perf_sys_pll = (perf_sys_pll & 0xffffff00) | val;
-		printf("Set perf sys pll b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe000a)
-	{
-		printf("Reg write b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe000b)
-	{
-		printf("Reg write b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0015)
-	{
-		printf("Reg write b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0016)
-	{
-		printf("Reg write b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0017)
-	{
-		printf("Reg write b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0301)
-	{
-		uart0_ctrl = (uart0_ctrl & 0xffff00ff) | val << 8;
-		printf("Set uart0 ctrl b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0302)
-	{
-		uart0_ctrl = (uart0_ctrl & 0xff00ffff) | val << 16;
-		printf("Set uart0 ctrl b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0303)
-	{
-		uart0_ctrl = (uart0_ctrl & 0x00ffffff) | val << 24;
-		printf("Set uart0 ctrl b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe030a)
-	{
-		uart0_mctl = (uart0_mctl & 0xff00ffff) | val << 16;
-		printf("Set uart0 mctl b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0317)
-	{
-//		printf("Set uart0 txbuf '%c'\n", val);
-		printf("%c", val);
-		fflush(stdout);
-		uart0_ir |= (1 << 5) << 16;
-	}
-	else if(vaddr == 0xfffe0323)
-	{
-		uart1_ctrl = (uart1_ctrl & 0x00ffffff) | val << 24;
-		printf("Set uart0 ctrl b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0803)
-	{
-		printf("Set spi? ctrl b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0881)
-	{
-		printf("Set spi? ctrl b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe3000)
-	{
-		printf("Set docsis? ctrl b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe3068)
-	{
-		printf("Set ??? b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe31e8)
-	{
-		printf("Set ??? b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe3601)
-	{
-		printf("Set docsis? ctrl b(0x%x) = 0x%02x\n", vaddr, val);
-	}
-	else
-	{
-		printf("Reg write b(0x%x) = 0x%02x\n", vaddr, val);
-		//		exit(1);
-	}
+	return (int32_t *)((int8_t *)cpu->mach + reg->state);
 }
 
-void reg_write_short(uint32_t vaddr, uint16_t val)
+static uint32_t reg_read_state(struct cpu_state *cpu, const struct mmio_reg *reg)
 {
-	/* printf("Reg write s(0x%x) = 0x%04x\n", vaddr, val); */
-	if(vaddr == 0xfffe0006)
-	{
-		blk_enables = (blk_enables & 0x0000ffff) | val << 16;
-		printf("Set blk enables s(0x%x) = 0x%04x\n", vaddr, val);
-	}
-	else if(vaddr == 0xfffe0310)
-	{
-		uart0_ir = (uart0_ir & 0xffff0000) | val;
-		/* printf("Set uart0 ir s(0x%x) = 0x%04x @ 0x%08x\n", vaddr, val, cpu.pc); */
-	}
-	else if(vaddr == 0xfffe0316)
-	{
-//		printf("Set uart0 txbuf '%c'\n", val);
-		printf("%c", val);
-		fflush(stdout);
-		uart0_ir |= (1 << 5) << 16;
-	}
-	else
-	{
-		/* printf("Reg write s(0x%x) = 0x%04x\n", vaddr, val); */
-		/* exit(1); */
-	}
+	return *reg_state(cpu, reg) >> reg->shift;
 }
 
-void reg_write_word(uint32_t vaddr, uint32_t val)
+static void reg_write_state(struct cpu_state *cpu, const struct mmio_reg *reg, uint32_t vaddr, uint32_t val)
 {
-	/* printf("Reg write w(0x%x) = 0x%08x\n", vaddr, val); */
-	if(vaddr == 0xfffe0008)
-	{
-		printf("Set PLL_control w(0x%x) = 0x%08x\n", vaddr, val);
-		pll_control = val;
-	}
-	else if(vaddr == 0xfffe000c)
-	{
-		printf("Set irq mask w(0x%x) = 0x%08x\n", vaddr, val);
-		irq_mask = val;
-	}
-	else if(vaddr == 0xfffe0204)
-	{
-		printf("Set timer0 ctl w(0x%x) = 0x%08x\n", vaddr, val);
-		timer_ctl0 = val;
-	}
-	else if(vaddr == 0xfffe0208)
-	{
-		printf("Set timer1 ctl w(0x%x) = 0x%08x\n", vaddr, val);
-		timer_ctl1 = val;
-	}
-	else if(vaddr == 0xfffe020c)
-	{
-		printf("Set timer2 ctl w(0x%x) = 0x%08x\n", vaddr, val);
-		timer_ctl2 = val;
-	}
-	else if(vaddr == 0xfffe0304)
-	{
-		printf("Set uart0 baud w(0x%x) = 0x%08x\n", vaddr, val);
-		uart0_baud_rate = val;
-	}
-	else if(vaddr == 0xfffe2000)
-	{
-		printf("Set mpi csbase0 w(0x%x) = 0x%08x\n", vaddr, val);
-		mpi_csbase_0 = val;
-	}
-	else if(vaddr == 0xfffe2004)
-	{
-		printf("Set mpi csctl0 w(0x%x) = 0x%08x\n", vaddr, val);
-		mpi_csctl_0 = val;
-	}
-	else if(vaddr == 0xfffe2008)
-	{
-		printf("Set mpi csbase1 w(0x%x) = 0x%08x\n", vaddr, val);
-		mpi_csbase_1 = val;
-	}
-	else if(vaddr == 0xfffe200c)
-	{
-		printf("Set mpi csctl1 w(0x%x) = 0x%08x\n", vaddr, val);
-		mpi_csctl_1 = val;
-	}
-	else if(vaddr == 0xfffe2040)
-	{
-		printf("Set pci timers w(0x%x) = 0x%08x\n", vaddr, val);
-		pci_timers = val;
-	}
-	else if(vaddr == 0xfffe2300)
-	{
-		printf("Set sdram cfg w(0x%x) = 0x%08x\n", vaddr, val);
-		sdram_cfg = val;
-	}
-	else if(vaddr == 0xfffe2304)
+	uint32_t mask = reg->width == 4 ? 0xffffffff : (1 << (reg->width * 8)) - 1;
+
+	if(reg->name && !cpu->rerun)
+		printf("Set %s %c(0x%x) = 0x%0*x\n", reg->name, " bs w"[reg->width], vaddr, reg->width * 2, val);
+	if(reg->state != REG_NONE)
+		*reg_state(cpu, reg) = (*reg_state(cpu, reg) & ~(mask << reg->shift)) | (val & mask) << reg->shift;
+}
+
+/* uart0 interrupt status bits, the mask is the low half of uart0_ir */
+#define UART_TXFIFOEMT 0x0020
+#define UART_RXFIFONE  0x0800
+
+static uint32_t uart0_status_read(struct cpu_state *cpu, const struct mmio_reg *reg)
+{
+	short ret = cpu->mach->uart0_ir >> 16;
+	/* uart0_ir &= 0xffff; */
+	return ret;
+}
+
+static void uart0_ir_write(struct cpu_state *cpu, const struct mmio_reg *reg, uint32_t vaddr, uint32_t val)
+{
+	reg_write_state(cpu, reg, vaddr, val);
+	irq_update(cpu);
+}
+
+static void uart0_tx_write(struct cpu_state *cpu, const struct mmio_reg *reg, uint32_t vaddr, uint32_t val)
+{
+//	printf("Set uart0 txbuf '%c'\n", val);
+	if(!cpu->rerun)
+		uart_write(cpu, val);
+	cpu->mach->uart0_ir |= UART_TXFIFOEMT << 16;
+	irq_update(cpu);
+}
+
+static uint32_t uart0_rx_read(struct cpu_state *cpu, const struct mmio_reg *reg)
+{
+	struct machine *m = cpu->mach;
+	uint8_t c;
+
+	if(!m->uart0_rx_count)
+		return 0;
+	c = m->uart0_rx[m->uart0_rx_head];
+	m->uart0_rx_head = (m->uart0_rx_head + 1) % UART_RX_FIFO;
+	if(!--m->uart0_rx_count)
 	{
-		printf("Set sdram unk1 w(0x%x) = 0x%08x\n", vaddr, val);
-		sdram_unk1 = val;
+		m->uart0_ir &= ~(UART_RXFIFONE << 16);
+		irq_update(cpu);
 	}
-	else if(vaddr == 0xfffe2308)
+	return c;
+}
+
+/* Take what arrived on the PTY into the receive FIFO, see uart.c */
+static void uart0_rx_event(struct cpu_state *cpu)
+{
+	struct machine *m = cpu->mach;
+	uint8_t buf[UART_RX_FIFO];
+	uint64_t now = cpu->sched->now;
+	ssize_t n, i;
+
+	n = uart_read(cpu, buf, UART_RX_FIFO - m->uart0_rx_count);
+	for(i = 0; i < n; i++)
+		m->uart0_rx[(m->uart0_rx_head + m->uart0_rx_count++) % UART_RX_FIFO] = buf[i];
+	if(n > 0)
 	{
-		printf("Set sdram unk2 w(0x%x) = 0x%08x\n", vaddr, val);
-		sdram_unk2 = val;
+		m->uart0_ir |= UART_RXFIFONE << 16;
+		irq_update(cpu);
 	}
-	else if(vaddr == 0xfffe230c)
-	{
-		printf("Set sdram mbase w(0x%x) = 0x%08x\n", vaddr, val);
-		sdram_mbase = val;
+	sched_add(cpu, now - now % UART_RX_POLL + UART_RX_POLL, uart0_rx_event);
+}
+
+static uint32_t timer_status_read(struct cpu_state *cpu, const struct mmio_reg *reg)
+{
+	if(cpu->mach->timer_int)
+		cpu->io_events++;
+	if(cpu->mach->timer_int == 2) {
+		cpu->mach->timer_int = 1;
+		return 0xff;
 	}
-	else
-	{
-		/* printf("Reg write w(0x%x) = 0x%08x\n", vaddr, val); */
-		/* exit(1); */
-	}
-}
-
-int32_t get_reg_val(uint32_t vaddr)
-{
-	if( log_reg && vaddr != 0xfffe0203 && vaddr != 0xfffe0312 )
-  		printf("Reg read w(0x%x) @ 0x%08x\n", vaddr, cpu.pc);
-	if(vaddr == 0xfffe0000)
-		return 0xa0003348;
-	else if(vaddr == 0xfffe0003)
-		return 0xa0;
-	else if(vaddr == 0xfffe0006)
-		return blk_enables >> 16;
-	else if(vaddr == 0xfffe0008)
-		return pll_control;
-	else if(vaddr == 0xfffe000c)
-		return irq_mask;
-	else if(vaddr == 0xfffe0010)
-		return irq_stat;
-	else if(vaddr == 0xfffe0310)
-	{
-		/* printf("Reg read uart0 ir mask w(0x%x) = 0x%08x @ 0x%08x\n", vaddr, uart0_ir, cpu.pc); */
-		return uart0_ir;
-	}
-	else if(vaddr == 0xfffe0312)
-	{
-		short ret = uart0_ir >> 16;
-		/* printf("Reg read uart0 ir stat w(0x%x) = 0x%08x @ 0x%08x\n", vaddr, uart0_ir, cpu.pc); */
-		/* uart0_ir &= 0xffff; */
-		return ret;
-	}
-	else if(vaddr == 0xFFFE2000)
-		return 0x1F00000B;
-	else if(vaddr == 0xFFFE2008)
-		return 0x1A000008;
-	else if(vaddr == 0xFFFE2010)
-		return 0x00000000;
-	else if(vaddr == 0xFFFE2018)
-		return 0x00000000;
-	else if(vaddr == 0xFFFE2020)
-		return 0x00000000;
-	else if(vaddr == 0xFFFE2028)
-		return 0x00000000;
-	else if(vaddr == 0xFFFE2004)
-		return 0x00000019;
-	else if(vaddr == 0xFFFE200C)
-		return 0x00000019;
-	else if(vaddr == 0xFFFE2014)
-		return 0x00000000;
-	else if(vaddr == 0xFFFE201C)
-		return 0x00000000;
-	else if(vaddr == 0xFFFE2024)
-		return 0x00000000;
-	else if(vaddr == 0xFFFE202C)
-		return 0x00000000;
-	else if(vaddr == 0xFFFE0203)
-	  {
-	    if(timer_int == 2) {
-	      timer_int = 1;
-	      return 0xff;
-	    }
-	    else if(timer_int == 1) {
-	      timer_int = 0;
-	      return 0xff;
-	    }
-	    else  
-	      return 0x0;
-	  }
-	else if(vaddr == 0xFFFE2308)
-	{
-	  return sdram_unk3;
+	else if(cpu->mach->timer_int == 1) {
+		cpu->mach->timer_int = 0;
+		return 0xff;
 	}
-	else
+	return 0x0;
+}
+
+#define REG_CONST(off, val) \
+	{ .offset = off, .read = reg_read_const, .value = val }
+#define REG_READ(off, var, sh) \
+	{ .offset = off, .read = reg_read_state, .state = REG_STATE(var), .shift = sh }
+#define REG_WRITE(off, w, nm, var, sh) \
+	{ .offset = off, .width = w, .name = nm, .write = reg_write_state, .state = REG_STATE(var), .shift = sh }
+#define REG_LOG(off, w, nm) \
+	{ .offset = off, .width = w, .name = nm, .write = reg_write_state, .state = REG_NONE }
+#define REG_RW(off, w, nm, var, sh) \
+	{ .offset = off, .width = w, .name = nm, .read = reg_read_state, .write = reg_write_state, .state = REG_STATE(var), .shift = sh }
+
+static const struct mmio_reg mmio_regs[] =
+{
+	REG_CONST(0x0000, 0xa0003348),
+	REG_CONST(0x0003, 0xa0),
+	REG_RW(0x0006, 2, "blk enables", blk_enables, 16),
+	REG_WRITE(0x0008, 1, "perf sys pll", perf_sys_pll, 0),
+	REG_RW(0x0008, 4, "PLL_control", pll_control, 0),
+	REG_RW(0x000c, 4, "irq mask", irq_mask, 0),
+	REG_READ(0x0010, irq_stat, 0),
+	{ .offset = 0x0203, .read = timer_status_read, .polled = true },
+	REG_WRITE(0x0204, 4, "timer0 ctl", timer_ctl0, 0),
+	REG_WRITE(0x0208, 4, "timer1 ctl", timer_ctl1, 0),
+	REG_WRITE(0x020c, 4, "timer2 ctl", timer_ctl2, 0),
+	REG_WRITE(0x0301, 1, "uart0 ctrl", uart0_ctrl, 8),
+	REG_WRITE(0x0302, 1, "uart0 ctrl", uart0_ctrl, 16),
+	REG_WRITE(0x0303, 1, "uart0 ctrl", uart0_ctrl, 24),
+	REG_WRITE(0x0304, 4, "uart0 baud", uart0_baud_rate, 0),
+	REG_WRITE(0x030a, 1, "uart0 mctl", uart0_mctl, 16),
+	{ .offset = 0x0310, .width = 2, .read = reg_read_state, .write = uart0_ir_write, .state = REG_STATE(uart0_ir) },
+	{ .offset = 0x0312, .read = uart0_status_read, .polled = true },
+	{ .offset = 0x0316, .width = 2, .read = uart0_rx_read, .write = uart0_tx_write },
+	{ .offset = 0x0317, .width = 1, .read = uart0_rx_read, .write = uart0_tx_write },
+	REG_WRITE(0x0323, 1, "uart1 ctrl", uart1_ctrl, 24),
+	REG_LOG(0x0803, 1, "spi? ctrl"),
+	REG_LOG(0x0881, 1, "spi? ctrl"),
+	REG_WRITE(0x2000, 4, "mpi csbase0", mpi_csbase_0, 0),
+	REG_CONST(0x2000, 0x1f00000b),
+	REG_WRITE(0x2004, 4, "mpi csctl0", mpi_csctl_0, 0),
+	REG_CONST(0x2004, 0x00000019),
+	REG_WRITE(0x2008, 4, "mpi csbase1", mpi_csbase_1, 0),
+	REG_CONST(0x2008, 0x1a000008),
+	REG_WRITE(0x200c, 4, "mpi csctl1", mpi_csctl_1, 0),
+	REG_CONST(0x200c, 0x00000019),
+	REG_CONST(0x2010, 0),
+	REG_CONST(0x2014, 0),
+	REG_CONST(0x2018, 0),
+	REG_CONST(0x201c, 0),
+	REG_CONST(0x2020, 0),
+	REG_CONST(0x2024, 0),
+	REG_CONST(0x2028, 0),
+	REG_CONST(0x202c, 0),
+	REG_WRITE(0x2040, 4, "pci timers", pci_timers, 0),
+	REG_WRITE(0x2300, 4, "sdram cfg", sdram_cfg, 0),
+	REG_WRITE(0x2304, 4, "sdram unk1", sdram_unk1, 0),
+	REG_WRITE(0x2308, 4, "sdram unk2", sdram_unk2, 0),
+	REG_READ(0x2308, sdram_unk3, 0),
+	REG_WRITE(0x230c, 4, "sdram mbase", sdram_mbase, 0),
+	REG_LOG(0x3000, 1, "docsis? ctrl"),
+	REG_LOG(0x3068, 1, "???"),
+	REG_LOG(0x31e8, 1, "???"),
+	REG_LOG(0x3601, 1, "docsis? ctrl"),
+};
+
+#define MMIO_REGS (sizeof(mmio_regs) / sizeof(mmio_regs[0]))
+
+/* index + 1 into mmio_regs[] by offset, writes also by width */
+static uint8_t mmio_read_index[MMIO_SIZE];
+static uint8_t mmio_write_index[3][MMIO_SIZE];
+
+static inline int32_t mmio_width_index(int32_t width)
+{
+	return width >> 1;
+}
+
+static void mmio_index(void)
+{
+	const struct mmio_reg *reg;
+	uint32_t i;
+
+	for(i = 0; i < MMIO_REGS; i++)
 	{
-		/* printf("Reg read w(0x%x) @ 0x%08x\n", vaddr, cpu.pc); */
-		/* exit(1); */
+		reg = &mmio_regs[i];
+		if(reg->read)
+		{
+			if(mmio_read_index[reg->offset])
+			{
+				printf("mmio: register 0x%x declared twice\n", REG_START + reg->offset);
+				exit(1);
+			}
+			mmio_read_index[reg->offset] = i + 1;
+		}
+		if(reg->write)
+		{
+			if(mmio_write_index[mmio_width_index(reg->width)][reg->offset])
+			{
+				printf("mmio: register 0x%x declared twice\n", REG_START + reg->offset);
+				exit(1);
+			}
+			mmio_write_index[mmio_width_index(reg->width)][reg->offset] = i + 1;
+		}
 	}
-	return 0;
 }
 
-int32_t get_instruction(uint32_t address, int8_t *ram, int8_t *flash)
+/* The indexes are shared by all instances and built by the first one */
+static void mmio_init(void)
 {
-	int32_t instruction = 0x0;
-	if(address >= RAM_START && address < RAM_END)
-		instruction = *(int32_t *)(ram+address-RAM_START);
-	else if(address >= FLASH_START && address < FLASH_END)
-		instruction = *(int32_t *)(flash+address-FLASH_START);
-	else
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, mmio_index);
+}
+
+int32_t get_instruction(struct cpu_state *cpu, uint32_t address)
+{
+	int8_t *page = cpu->mem_host[address >> MEM_PAGE_SHIFT];
+
+	if(!page)
 		exit(1);
-	instruction = ntohl(instruction);
-	return instruction;
+	return MEM_WORD(*(int32_t *)(page + (address & MEM_PAGE_MASK)));
 }
 
 uint32_t decode_opcode(uint32_t instruction)
@@ -601,34 +545,34 @@ int32_t get_base(int32_t instruction)
 	return get_rs(instruction);
 }
 
-int32_t flash_read(uint32_t vaddr, int8_t *flash, uint8_t width)
+int32_t flash_read(struct cpu_state *cpu, uint32_t vaddr, uint8_t width)
 {
-	if( flash_log && fakeflash_state )
+	if( cpu->mach->flash_log && cpu->mach->fakeflash_state )
 	{
-		printf("flash read (%u)0x%08x (pc:0x%08x)\n", width, vaddr, cpu.pc);
+		printf("flash read (%u)0x%08x (pc:0x%08x)\n", width, vaddr, cpu->pc);
 	}
 	switch( width )
 	{
 	case 1:
-		if(fakeflash_state)
+		if(cpu->mach->fakeflash_state)
 		{
 			return flash_read_byte(vaddr);
 		}
 		else
 		{
-			return *(int8_t *)(flash+vaddr-FLASH_START);
+			return *(int8_t *)(cpu->flash+MEM_ADDR8(vaddr-FLASH_START));
 		}
 	case 2:
-		if(fakeflash_state)
+		if(cpu->mach->fakeflash_state)
 		{
-			return flash_read_short(vaddr);
+			return flash_read_short(cpu, vaddr);
 		}
 		else
 		{
-			return *(int16_t *)(flash+vaddr-FLASH_START);
+			return *(int16_t *)(cpu->flash+MEM_ADDR16(vaddr-FLASH_START));
 		}
 	case 4:
-		if(fakeflash_state)
+		if(cpu->mach->fakeflash_state)
 		{
 			/* printf("read word in cfi state\n"); */
 			/* exit(1); */
@@ -636,119 +580,442 @@ int32_t flash_read(uint32_t vaddr, int8_t *flash, uint8_t width)
 		}
 		else
 		{
-			return *(int32_t *)(flash+vaddr-FLASH_START);
+			return *(int32_t *)(cpu->flash+vaddr-FLASH_START);
 		}
 	}
 	return 0;
 }
 
-int32_t load_word(uint32_t vaddr, int8_t *ram, int8_t *flash)
+/*
+ * Drop predecoded instructions, and the blocks built from them, overlapping
+ * a store to RAM offset.
+ */
+static inline void icache_invalidate(struct cpu_state *cpu, uint32_t offset, uint32_t size)
 {
-	int32_t word = 0;
+	uint32_t last = offset + size - 1;
+	struct insn *page;
+
+	page = cpu->icache[offset >> ICACHE_PAGE_SHIFT];
+	if(page && page[(offset >> 2) & (ICACHE_PAGE_SLOTS - 1)].handler)
+	{
+		page[(offset >> 2) & (ICACHE_PAGE_SLOTS - 1)].handler = NULL;
+		block_invalidate(cpu, RAM_START + (offset & ~0x3));
+	}
+	if((last >> 2) != (offset >> 2) && last < RAM_SIZE)
+	{
+		page = cpu->icache[last >> ICACHE_PAGE_SHIFT];
+		if(page && page[(last >> 2) & (ICACHE_PAGE_SLOTS - 1)].handler)
+		{
+			page[(last >> 2) & (ICACHE_PAGE_SLOTS - 1)].handler = NULL;
+			block_invalidate(cpu, RAM_START + (last & ~0x3));
+		}
+	}
+}
 
-	if(vaddr >= REG_START && vaddr <= REG_END)
-		return (int32_t)get_reg_val(vaddr);
+static uint32_t unmapped_read(struct cpu_state *cpu, uint32_t vaddr, int32_t width)
+{
+	return 0;
+}
 
-	vaddr = vaddr & ~0x20000000;
-	if(vaddr >= FLASH_START && vaddr < FLASH_END)
-		word = flash_read( vaddr, flash, 4 );
-	else if(vaddr >= FAKEFLASH_START && vaddr < FAKEFLASH_END)
-		word = flash_read( vaddr, flash, 4 );
-	else if(vaddr >= RAM_START && vaddr < RAM_END)
-		word = *(int32_t *)(ram+vaddr-RAM_START);
-	word = ntohl(word);
-	return word;
+static void unmapped_write(struct cpu_state *cpu, uint32_t vaddr, uint32_t val, int32_t width)
+{
+	printf("can't write 0x%0*x to 0x%x\n", width * 2, val, vaddr & ~0x20000000);
 }
 
-void store_word(uint32_t vaddr, int32_t val, int8_t *ram, int8_t *flash)
+static uint32_t ram_read(struct cpu_state *cpu, uint32_t vaddr, int32_t width)
 {
-	if(vaddr >= REG_START && vaddr <= REG_END)
-		return reg_write_word(vaddr, val);
+	int8_t *page = cpu->mem_host[vaddr >> MEM_PAGE_SHIFT];
 
-	vaddr = vaddr & ~0x20000000;
-	if(vaddr >= FLASH_START && vaddr < FLASH_END)
-		return flash_write(vaddr, val);
-	else if(vaddr >= RAM_START && vaddr < RAM_END)
+	switch(width)
 	{
-		*(int32_t *)(ram+vaddr-RAM_START) = htonl(val);
-		return;
+	case 4:
+		return MEM_WORD(*(int32_t *)(page + (vaddr & MEM_PAGE_MASK)));
+	case 2:
+		return MEM_HALF(*(int16_t *)(page + MEM_ADDR16(vaddr & MEM_PAGE_MASK)));
+	default:
+		return *(uint8_t *)(page + MEM_ADDR8(vaddr & MEM_PAGE_MASK));
+	}
+}
+
+/* Stores to the page need not be seen: both kinds of tracking have it */
+static inline bool mem_page_stored(struct cpu_state *cpu, uint32_t page)
+{
+	return mem_page_dirty(cpu, page) && mem_page_delta(cpu, page);
+}
+
+static void mem_dirty_mark(struct cpu_state *cpu, uint32_t offset)
+{
+	uint32_t page = offset >> MEM_PAGE_SHIFT;
+
+	if(!mem_page_dirty(cpu, page))
+		memcpy(cpu->dirty->prev + (page << MEM_PAGE_SHIFT), cpu->ram + (page << MEM_PAGE_SHIFT), MEM_PAGE_SIZE);
+	cpu->dirty->bits[page >> 6] |= 1ull << (page & 63);
+	cpu->dirty->delta[page >> 6] |= 1ull << (page & 63);
+	mem_update_page(cpu, RAM_START + offset);
+}
+
+/* Stores to RAM pages holding predecoded instructions or not yet dirty */
+static void ram_write(struct cpu_state *cpu, uint32_t vaddr, uint32_t val, int32_t width)
+{
+	int8_t *page = cpu->mem_host[vaddr >> MEM_PAGE_SHIFT];
+	uint32_t offset = (vaddr & ~0x20000000) - RAM_START;
+
+	if(cpu->dirty && !mem_page_stored(cpu, offset >> MEM_PAGE_SHIFT))
+		mem_dirty_mark(cpu, offset);
+
+	switch(width)
+	{
+	case 4:
+		*(int32_t *)(page + (vaddr & MEM_PAGE_MASK)) = MEM_WORD(val);
+		break;
+	case 2:
+		*(int16_t *)(page + MEM_ADDR16(vaddr & MEM_PAGE_MASK)) = MEM_HALF(val);
+		break;
+	default:
+		*(page + MEM_ADDR8(vaddr & MEM_PAGE_MASK)) = val;
+		break;
+	}
+	icache_invalidate(cpu, offset, width);
+}
+
+static uint32_t flash_device_read(struct cpu_state *cpu, uint32_t vaddr, int32_t width)
+{
+	int32_t val = flash_read(cpu, vaddr & ~0x20000000, width);
+
+	switch(width)
+	{
+	case 4:
+		return MEM_WORD(val);
+	case 2:
+		/* the CFI replies are byte swapped whatever the RAM layout */
+		if(cpu->mach->fakeflash_state)
+			return ntohs((int16_t)val);
+		return MEM_HALF((int16_t)val);
+	default:
+		return (int8_t)val;
 	}
+}
+
+static void flash_device_write(struct cpu_state *cpu, uint32_t vaddr, uint32_t val, int32_t width)
+{
+	flash_write(cpu, vaddr & ~0x20000000, val);
+}
 
-	printf("can't write 0x%08x to 0x%x\n", val, vaddr);
+/* the fake flash window only ever took halfword commands */
+static void fakeflash_write(struct cpu_state *cpu, uint32_t vaddr, uint32_t val, int32_t width)
+{
+	if(width == 2)
+		flash_write(cpu, vaddr & ~0x20000000, val);
+	else
+		unmapped_write(cpu, vaddr, val, width);
 }
 
-uint16_t load_short(uint32_t vaddr, int8_t *ram, int8_t *flash)
+static uint32_t mmio_read(struct cpu_state *cpu, uint32_t vaddr, int32_t width)
 {
-	int16_t word = 0;
+	uint8_t index = mmio_read_index[vaddr - REG_START];
+	const struct mmio_reg *reg = index ? &mmio_regs[index - 1] : NULL;
+
+	if( log_reg && !(reg && reg->polled) )
+		printf("Reg read w(0x%x) @ 0x%08x\n", vaddr, cpu->pc);
+	/* polled registers only change when an event fires */
+	if(!(reg && reg->polled))
+		cpu->io_events++;
+	else
+		cpu->io_polls++;
+	if(!reg)
+		return 0;
+	return reg->read(cpu, reg);
+}
 
-	if(vaddr >= REG_START && vaddr <= REG_END)
-		return (int16_t)get_reg_val(vaddr);
+static void mmio_write(struct cpu_state *cpu, uint32_t vaddr, uint32_t val, int32_t width)
+{
+	uint8_t index = mmio_write_index[mmio_width_index(width)][vaddr - REG_START];
+	const struct mmio_reg *reg;
 
-	vaddr = vaddr & ~0x20000000;
-	if(vaddr >= FLASH_START && vaddr < FLASH_END)
-		word = (int16_t)flash_read( vaddr, flash, 2 );
-	else if(vaddr >= FAKEFLASH_START && vaddr < FAKEFLASH_END)
-		word = (int16_t)flash_read( vaddr, flash, 2 );
-	else if(vaddr >= RAM_START && vaddr < RAM_END)
-		word = *(int16_t *)(ram+vaddr-RAM_START);
-	word = ntohs(word);
-	return word;
+	if(!index)
+	{
+		if(width == 1)
+			printf("Reg write b(0x%x) = 0x%02x\n", vaddr, val);
+		return;
+	}
+	reg = &mmio_regs[index - 1];
+	reg->write(cpu, reg, vaddr, val);
 }
 
-void store_short(uint32_t vaddr, int16_t val, int8_t *ram, int8_t *flash)
+struct mem_device
+{
+	uint32_t (*read)(struct cpu_state *cpu, uint32_t vaddr, int32_t width);
+	void (*write)(struct cpu_state *cpu, uint32_t vaddr, uint32_t val, int32_t width);
+};
+
+static const struct mem_device mem_devices[MEM_TYPES] =
+{
+	[MEM_UNMAPPED]  = { unmapped_read, unmapped_write },
+	[MEM_RAM]       = { ram_read, ram_write },
+	[MEM_FLASH]     = { flash_device_read, flash_device_write },
+	[MEM_FAKEFLASH] = { flash_device_read, fakeflash_write },
+	[MEM_MMIO]      = { mmio_read, mmio_write },
+};
+
+/*
+ * An access reached the slow path while watchpoints are set. A hit stops
+ * run_until(), or drops into the CLI, after the instruction making it:
+ * the block running it is invalidated, which makes it return there like
+ * it does after a store into its own code.
+ */
+static void mem_watch_check(struct cpu_state *cpu, uint32_t vaddr, int32_t width, uint32_t type)
 {
-	if(vaddr >= REG_START && vaddr <= REG_END)
-		return reg_write_short(vaddr, val);
+	struct mem_watches *mw = cpu->watches;
+	uint32_t addr = mem_kseg0(vaddr);
+	uint32_t pc = cpu->pc - 4;
+	struct watchpoint *w = NULL;
+	bool counted = false;
+	uint32_t i;
+
+	for(i = 0; i < mw->count; i++)
+	{
+		if(!(mw->w[i].type & type) || addr > mw->w[i].last || addr + width - 1 < mw->w[i].start)
+			continue;
+		if(mw->w[i].type & WATCH_COUNT)
+			counted = true;
+		else if(!w)
+			w = &mw->w[i];
+	}
+	if(counted)
+		mw->counted++;
+	/* history being repeated was stopped at the first time round */
+	if(!w || cpu->rerun)
+		return;
 
-	vaddr = vaddr & ~0x20000000;
-	if(vaddr >= FLASH_START && vaddr < FLASH_END)
-		return flash_write(vaddr, val);
-	else if(vaddr >= FAKEFLASH_START && vaddr < FAKEFLASH_END)
-		return flash_write(vaddr, val);
-	else if(vaddr >= RAM_START && vaddr < RAM_END)
+	mw->hit = addr < w->start ? w->start : addr;
+	mw->hit_type = type;
+	if((pc >= RAM_START && pc < RAM_END) || (pc >= FLASH_START && pc < FLASH_END))
+		block_invalidate(cpu, pc);
+	if(cpu->batch)
 	{
-		*(int16_t *)(ram+vaddr-RAM_START) = htons(val);
+		cpu->stop = STOP_WATCH;
 		return;
 	}
+	printf("watch: %s of 0x%08x at pc 0x%08x\n", type == WATCH_READ ? "read" : "write", mw->hit, pc);
+	bp(cpu);
+}
+
+uint32_t mem_read_slow(struct cpu_state *cpu, uint32_t vaddr, int32_t width)
+{
+	uint8_t type = cpu->mem_type[vaddr >> MEM_PAGE_SHIFT];
+
+	if(cpu->watches)
+		mem_watch_check(cpu, vaddr, width, WATCH_READ);
+	/* RAM only comes here when watched */
+	if(type != MEM_MMIO && type != MEM_RAM)
+		cpu->io_events++;
+	return mem_devices[type].read(cpu, vaddr, width);
+}
+
+void mem_write_slow(struct cpu_state *cpu, uint32_t vaddr, uint32_t val, int32_t width)
+{
+	if(cpu->watches)
+		mem_watch_check(cpu, vaddr, width, WATCH_WRITE);
+	mem_devices[cpu->mem_type[vaddr >> MEM_PAGE_SHIFT]].write(cpu, vaddr, val, width);
+}
+
+/* Accesses of type to the page holding vaddr have to be checked */
+static bool mem_page_watchpoint(struct cpu_state *cpu, uint32_t vaddr, uint32_t type)
+{
+	struct mem_watches *mw = cpu->watches;
+	uint32_t start = mem_kseg0(vaddr) & ~MEM_PAGE_MASK;
+	uint32_t i;
+
+	if(!mw)
+		return false;
+	for(i = 0; i < mw->count; i++)
+	{
+		if((mw->w[i].type & type) && mw->w[i].start <= start + MEM_PAGE_MASK && mw->w[i].last >= start)
+			return true;
+	}
+	return false;
+}
+
+/* Recompute the direct access pointers of one guest page */
+static void mem_update(struct cpu_state *cpu, uint32_t vaddr)
+{
+	uint32_t page = vaddr >> MEM_PAGE_SHIFT;
+	int8_t *host = cpu->mem_host[page];
+
+	cpu->mem_read[page] = NULL;
+	cpu->mem_write[page] = NULL;
+	switch(cpu->mem_type[page])
+	{
+	case MEM_RAM:
+		if(!mem_page_watchpoint(cpu, vaddr, WATCH_READ))
+			cpu->mem_read[page] = host;
+		if(!cpu->icache[icache_page(vaddr & ~0x20000000)] &&
+		   (!cpu->dirty || mem_page_stored(cpu, icache_page(vaddr & ~0x20000000))) &&
+		   !mem_page_watchpoint(cpu, vaddr, WATCH_WRITE))
+			cpu->mem_write[page] = host;
+		break;
+	case MEM_FLASH:
+		if(!cpu->mach->fakeflash_state && !mem_page_watchpoint(cpu, vaddr, WATCH_READ))
+			cpu->mem_read[page] = host;
+		break;
+	}
+}
+
+/* Update both the kseg0 and the kseg1 view of the page holding vaddr */
+void mem_update_page(struct cpu_state *cpu, uint32_t vaddr)
+{
+	mem_update(cpu, vaddr & ~0x20000000);
+	mem_update(cpu, vaddr | 0x20000000);
+}
+
+/* Flash is read directly only while it is not answering CFI queries */
+void mem_map_flash(struct cpu_state *cpu)
+{
+	uint32_t vaddr;
+
+	for(vaddr = FLASH_START; vaddr < FLASH_END; vaddr += MEM_PAGE_SIZE)
+		mem_update_page(cpu, vaddr);
+}
+
+static void mem_map(struct cpu_state *cpu, uint32_t start, uint32_t size, int8_t *host, enum mem_type type)
+{
+	uint32_t page = start >> MEM_PAGE_SHIFT;
+	uint32_t i;
+
+	for(i = 0; i < size >> MEM_PAGE_SHIFT; i++)
+	{
+		cpu->mem_host[page + i] = host ? host + (i << MEM_PAGE_SHIFT) : NULL;
+		cpu->mem_type[page + i] = type;
+		mem_update(cpu, (page + i) << MEM_PAGE_SHIFT);
+	}
+}
+
+/* Convert between a big-endian image and the RAM representation, in place */
+void mem_convert(int8_t *image, uint32_t size)
+{
+#ifdef MEM_SWIZZLE
+	uint32_t i;
+
+	for(i = 0; i + 4 <= size; i += 4)
+		*(int32_t *)(image + i) = ntohl(*(int32_t *)(image + i));
+#endif
+}
+
+static void mem_watch_update(struct cpu_state *cpu, struct watchpoint *w)
+{
+	uint32_t page;
 
-	printf("can't write 0x%04x to 0x%x\n", val, vaddr);
+	for(page = w->start >> MEM_PAGE_SHIFT; page <= w->last >> MEM_PAGE_SHIFT; page++)
+		mem_update_page(cpu, page << MEM_PAGE_SHIFT);
 }
 
-uint8_t load_byte(uint32_t vaddr, int8_t *ram, int8_t *flash)
+/* Stop at reads, writes or both of start..start + size - 1, or count them */
+bool mem_watch_add(struct cpu_state *cpu, uint32_t start, uint32_t size, uint32_t type)
 {
-	int8_t byte = 0;
+	struct mem_watches *mw = cpu->watches;
+	struct watchpoint *w;
 
-	if(vaddr >= REG_START && vaddr <= REG_END)
-		return (int8_t)get_reg_val(vaddr);
+	start = mem_kseg0(start);
+	if(!size || start + (size - 1) < start || !(type & WATCH_ACCESS))
+	{
+		printf("watch: bad range 0x%08x, %u bytes\n", start, size);
+		return false;
+	}
+	if(!mw)
+		mw = cpu->watches = calloc(1, sizeof(struct mem_watches));
+	if(mw->count == WATCH_MAX)
+	{
+		printf("watch: no more than %d watchpoints\n", WATCH_MAX);
+		return false;
+	}
+	w = &mw->w[mw->count++];
+	w->start = start;
+	w->last = start + (size - 1);
+	w->type = type & (WATCH_ACCESS | WATCH_COUNT);
+	mem_watch_update(cpu, w);
+	return true;
+}
 
-	vaddr = vaddr & ~0x20000000;
-	if(vaddr >= FLASH_START && vaddr < FLASH_END)
-		byte = (int8_t)flash_read( vaddr, flash, 1 );
-	else if(vaddr >= FAKEFLASH_START && vaddr < FAKEFLASH_END)
-		byte = (int8_t)flash_read( vaddr, flash, 1 );
-	else if(vaddr >= RAM_START && vaddr < RAM_END)
-		byte = *(int8_t *)(ram+vaddr-RAM_START);
+/* Remove the watchpoints at start, of this size and type unless those are 0 */
+bool mem_watch_remove(struct cpu_state *cpu, uint32_t start, uint32_t size, uint32_t type)
+{
+	struct mem_watches *mw = cpu->watches;
+	struct watchpoint w;
+	bool found = false;
+	uint32_t i = 0;
 
-	return byte;
+	start = mem_kseg0(start);
+	while(mw && i < mw->count)
+	{
+		w = mw->w[i];
+		if(w.start != start || (size && w.last != start + (size - 1)) || (type && w.type != type))
+		{
+			i++;
+			continue;
+		}
+		mw->w[i] = mw->w[--mw->count];
+		if(!mw->count)
+		{
+			free(mw);
+			mw = cpu->watches = NULL;
+		}
+		mem_watch_update(cpu, &w);
+		found = true;
+	}
+	return found;
 }
 
-void store_byte(uint32_t vaddr, int8_t val, int8_t *ram, int8_t *flash)
+void mem_watch_list(struct cpu_state *cpu)
 {
-	if(vaddr >= REG_START && vaddr <= REG_END)
-		return reg_write_byte(vaddr, val);
+	static const char *const types[] = { "", "read", "write", "access" };
+	struct mem_watches *mw = cpu->watches;
+	uint32_t i;
 
-	vaddr = vaddr & ~0x20000000;
-	if(vaddr >= FLASH_START && vaddr < FLASH_END)
-		return flash_write(vaddr, val);
-	else if(vaddr >= FLASH_START && vaddr < FLASH_END)
-		return flash_write(vaddr, val);
-	else if(vaddr >= RAM_START && vaddr < RAM_END)
+	if(!mw)
 	{
-		*(int8_t *)(ram+vaddr-RAM_START) = val;
+		printf("no watchpoints\n");
 		return;
 	}
+	for(i = 0; i < mw->count; i++)
+		printf("watch %u: %s 0x%08x-0x%08x\n", i, types[mw->w[i].type & WATCH_ACCESS], mw->w[i].start, mw->w[i].last);
+}
+
+/*
+ * Start tracking stores, or start over: every RAM page is clean again. The
+ * pages stored to since the last snapshot are only forgotten for a new one.
+ */
+void mem_dirty_reset(struct cpu_state *cpu, bool snapshot)
+{
+	uint32_t i;
+
+	if(!cpu->dirty)
+	{
+		cpu->dirty = calloc(1, sizeof(struct mem_dirty));
+		cpu->dirty->prev = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	memset(cpu->dirty->bits, 0, sizeof(cpu->dirty->bits));
+	if(snapshot)
+		memset(cpu->dirty->delta, 0, sizeof(cpu->dirty->delta));
+	cpu->dirty->delta_prev = snapshot;
+	for(i = 0; i < MEM_RAM_PAGES; i++)
+		mem_update_page(cpu, RAM_START + (i << MEM_PAGE_SHIFT));
+}
 
-	printf("can't write 0x%02x to 0x%x\n", val, vaddr);
+void mem_init(struct cpu_state *cpu)
+{
+	cpu->mem_read = calloc(MEM_PAGES, sizeof(int8_t *));
+	cpu->mem_write = calloc(MEM_PAGES, sizeof(int8_t *));
+	cpu->mem_host = calloc(MEM_PAGES, sizeof(int8_t *));
+	cpu->mem_type = calloc(MEM_PAGES, sizeof(uint8_t));
+
+	/* everything but the registers is also seen through kseg1 */
+	mem_map(cpu, RAM_START, RAM_SIZE, cpu->ram, MEM_RAM);
+	mem_map(cpu, RAM_START | 0x20000000, RAM_SIZE, cpu->ram, MEM_RAM);
+	mem_map(cpu, FLASH_START, FLASH_SIZE, cpu->flash, MEM_FLASH);
+	mem_map(cpu, FLASH_START | 0x20000000, FLASH_SIZE, cpu->flash, MEM_FLASH);
+	mem_map(cpu, FAKEFLASH_START, FAKEFLASH_END - FAKEFLASH_START, NULL, MEM_FAKEFLASH);
+	mem_map(cpu, FAKEFLASH_START | 0x20000000, FAKEFLASH_END - FAKEFLASH_START, NULL, MEM_FAKEFLASH);
+	mem_map(cpu, REG_START, REG_END - REG_START + 1, NULL, MEM_MMIO);
 }
 
 char *r2rn(int32_t reg)
@@ -834,84 +1101,252 @@ void dump_regs(struct cpu_state *cpu)
 }
 #endif
 
-int32_t *get_address(uint32_t vaddr, int8_t *ram, int8_t *flash)
+int32_t *get_address(struct cpu_state *cpu, uint32_t vaddr)
 {
-	if(vaddr >= REG_START && vaddr <= REG_END)
+	int8_t *page = cpu->mem_host[vaddr >> MEM_PAGE_SHIFT];
+
+	if(!page)
 		return 0;
-	else
-		vaddr = vaddr & ~0x20000000;
+	return (int32_t *)(page + (vaddr & MEM_PAGE_MASK));
+}
 
-	if(vaddr >= FLASH_START && vaddr < FLASH_END)
-		return (int32_t *)(flash+(vaddr-FLASH_START));
-	else if(vaddr >= RAM_START && vaddr < RAM_END)
-		return (int32_t *)(ram+(vaddr-RAM_START));
-	return 0;
-}
 
-void process_callbacks(struct cpu_state *cpu)
+/* "next" stops once, at the following instruction */
+static void next_bp(struct cpu_state *cpu)
 {
-	struct callback *cb;
-
-	for(cb = cpu->callbacks; cb; cb = cb->next)
-	{
-	  if(cb->address == cpu->pc)
-		cb->callback(cpu);
-	}
+	unregister_callback(cpu, cpu->pc, next_bp);
+	bp(cpu);
 }
 
-
 inline static void cli( struct cpu_state *cpu )
 {
 	char buf[100] = { 0 };
-	if( debug )
+	struct mem_watches *mw = cpu->watches;
+	if( cpu->debug )
 	{
+		/* the trace reads the operands before the instruction does */
+		cpu->watches = NULL;
 		instlog(cpu);
+		cpu->watches = mw;
 	}
-	if( !run )
+	if( !cpu->run )
 	{
+		uart_flush(cpu);
 		printf("MIPS> ");
 		fflush( stdout );
-		read( 0, buf, 100 );
+		input_read( cpu, INPUT_CLI, 0, buf, sizeof(buf) - 1 );
 		if( strncmp( buf, "run", 3 ) == 0 )
 		{
-			run = true;
-			debug = false;
+			cpu->run = true;
+			cpu->debug = false;
 			return;
 		}
 		else if( strncmp( buf, "drun", 4 ) == 0 )
 		{
-			run = true;
-			debug = true;
+			cpu->run = true;
+			cpu->debug = true;
 			return;
 		}
 		else if( strncmp( buf, "step", 3 ) == 0 )
 		{
-			do_step = true;
-			debug = true;
+			cpu->do_step = true;
+			cpu->debug = true;
 			return;
 		}
 		else if( strncmp( buf, "s\n", 2 ) == 0 )
 		{
-			do_step = true;
-			debug = true;
+			cpu->do_step = true;
+			cpu->debug = true;
 			return;
 		}
 		else if( strncmp( buf, "next", 3 ) == 0 )
 		{
-			do_step = false;
-			run = true;
-			register_callback(cpu, cpu->pc+4, bp);
+			cpu->do_step = false;
+			cpu->run = true;
+			register_callback(cpu, cpu->pc+4, next_bp);
+			return;
+		}
+		else if( strncmp( buf, "jit", 3 ) == 0 )
+		{
+			jit_enable(cpu, strncmp( buf + 4, "on", 2 ) == 0);
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "idle", 4 ) == 0 )
+		{
+			if( buf[4] == ' ' )
+				cpu->idle_skip = strncmp( buf + 5, "on", 2 ) == 0;
+			printf("idle skip %s, %llu cycles skipped\n", cpu->idle_skip ? "on" : "off",
+			       (unsigned long long)cpu->sched->skipped);
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "save ", 5 ) == 0 || strncmp( buf, "load ", 5 ) == 0 )
+		{
+			buf[strcspn( buf, "\n" )] = 0;
+			if( buf[0] == 's' )
+				snapshot_save(cpu, buf + 5);
+			else
+				snapshot_load(cpu, buf + 5);
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "delta ", 6 ) == 0 )
+		{
+			buf[strcspn( buf, "\n" )] = 0;
+			snapshot_save_delta(cpu, buf + 6);
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "history", 7 ) == 0 )
+		{
+			char *end;
+			uint64_t interval, budget;
+
+			if( strncmp( buf + 8, "on", 2 ) == 0 )
+			{
+				interval = strtoull( buf + 10, &end, 0 );
+				budget = strtoull( end, NULL, 0 ) << 20;
+				reverse_enable(cpu, interval ? interval : REVERSE_INTERVAL, budget ? budget : REVERSE_BUDGET);
+			}
+			else if( strncmp( buf + 8, "off", 3 ) == 0 )
+				reverse_disable(cpu);
+			reverse_info(cpu);
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "rsi", 3 ) == 0 || strncmp( buf, "rc", 2 ) == 0 )
+		{
+			char *end;
+			uint64_t n;
+			uint32_t addr, size = 0;
+
+			if( !cpu->rev )
+				printf("history off\n");
+			else if( buf[1] == 's' )
+			{
+				n = strtoull( buf + 3, NULL, 0 );
+				reverse_stepi(cpu, n ? n : 1);
+			}
+			else
+			{
+				/* rc [addr [size]]: back to a breakpoint or a store */
+				addr = strtoul( buf + 2, &end, 0 );
+				if( end != buf + 2 )
+					size = strtoul( end, NULL, 0 );
+				if( end != buf + 2 && !size )
+					size = 4;
+				reverse_continue(cpu, addr, size);
+			}
+			printf("at %llu pc 0x%08x\n", (unsigned long long)cpu->sched->now, cpu->pc);
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "watch", 5 ) == 0 || strncmp( buf, "unwatch", 7 ) == 0 )
+		{
+			/* [un]watch [r|w|a] addr [size], a bare watch lists them */
+			char *p = buf + 5, *end;
+			uint32_t type = WATCH_WRITE, addr, size;
+
+			if( buf[0] == 'u' )
+				p = buf + 7;
+			p += strspn( p, " " );
+			if( ( p[0] == 'r' || p[0] == 'w' || p[0] == 'a' ) && p[1] == ' ' )
+			{
+				if( p[0] == 'r' )
+					type = WATCH_READ;
+				else if( p[0] == 'a' )
+					type = WATCH_ACCESS;
+				p += 2;
+			}
+			addr = strtoul( p, &end, 0 );
+			size = strtoul( end, NULL, 0 );
+			if( end == p )
+				mem_watch_list(cpu);
+			else if( buf[0] == 'u' )
+				mem_watch_remove(cpu, addr, size, 0);
+			else
+				mem_watch_add(cpu, addr, size ? size : 4, type);
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "trace", 5 ) == 0 )
+		{
+			/* trace file|off: binary record of every instruction, see tracedump */
+			buf[strcspn( buf, "\n" )] = 0;
+			if( strcmp( buf + 5, " off" ) == 0 || buf[5] == 0 )
+				trace_stop(cpu);
+			else
+				trace_start(cpu, buf + 6);
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "profile", 7 ) == 0 )
+		{
+			/* profile on [folded]|off|dump: hot list, folded stacks on off */
+			buf[strcspn( buf, "\n" )] = 0;
+			if( strncmp( buf + 8, "on", 2 ) == 0 )
+				profile_start(cpu, buf[10] == ' ' ? buf + 11 : "");
+			else if( strncmp( buf + 8, "off", 3 ) == 0 )
+				profile_stop(cpu);
+			else
+				profile_dump(cpu, NULL);
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "hle", 3 ) == 0 )
+		{
+			/* hle on|off|routine addr */
+			char routine[16];
+			uint32_t addr;
+
+			if( sscanf( buf + 4, "%15s %x", routine, &addr ) == 2 )
+				hle_add(cpu, routine, addr);
+			else if( buf[3] == ' ' )
+				cpu->hle = strncmp( buf + 4, "on", 2 ) == 0;
+			printf("hle %s\n", cpu->hle ? "on" : "off");
+			cli(cpu);
+			return;
+		}
+		else if( strncmp( buf, "sym", 3 ) == 0 )
+		{
+			/* sym scan|load file|name|addr */
+			char name[SYMBOL_NAME_MAX + 16], *end;
+			uint32_t addr;
+
+			buf[strcspn( buf, "\n" )] = 0;
+			addr = strtoul( buf + 4, &end, 0 );
+			if( strcmp( buf + 4, "scan" ) == 0 )
+				symbol_scan(cpu);
+			else if( strncmp( buf + 4, "load ", 5 ) == 0 )
+				symbol_load(cpu, buf + 9);
+			else if( *end == 0 && end != buf + 4 )
+				printf("0x%08x %s\n", addr, symbol_format(cpu, addr, name, sizeof(name)));
+			else if( symbol_addr(cpu, buf + 4, &addr) )
+				printf("0x%08x %s\n", addr, buf + 4);
+			else
+				printf("no symbol %s\n", buf + 4);
+			cli(cpu);
 			return;
 		}
 		else if( strncmp( buf, "bp", 2 ) == 0 )
 		{
-			int number = (int)strtol(buf + 3, NULL, 0);
-			do_step = true;
-			register_callback(cpu, number, bp);
+			/* bp addr|name */
+			char *end;
+			uint32_t number = strtoul(buf + 3, &end, 0);
+
+			buf[strcspn( buf, "\n" )] = 0;
+			if( end == buf + 3 && !symbol_addr(cpu, buf + 3, &number) )
+				printf("no symbol %s\n", buf + 3);
+			else
+			{
+				cpu->do_step = true;
+				register_callback(cpu, number, bp);
+			}
 			cli(cpu);
 			return;
 		}
-		if( !do_step )
+		if( !cpu->do_step )
 		{
 			exit(1);
 		}
@@ -920,6 +1355,7 @@ inline static void cli( struct cpu_state *cpu )
 
 void instlog(struct cpu_state *cpu)
 {
+	const struct symbol *sym;
 	int32_t instruction;
 	int32_t opcode;
 	int32_t rs;
@@ -931,7 +1367,10 @@ void instlog(struct cpu_state *cpu)
 	int32_t offset;
 	int16_t im16;
 
-	instruction = get_instruction(cpu->pc, cpu->ram, cpu->flash);
+	instruction = get_instruction(cpu, cpu->pc);
+	sym = symbol_at(cpu, cpu->pc);
+	if(sym && sym->addr == cpu->pc)
+		dtrace("%s:\n", sym->name);
 	dtrace("0x%x: ", cpu->pc);
 
 	base = get_base(instruction);
@@ -1304,7 +1743,7 @@ void instlog(struct cpu_state *cpu)
 			break;
 		case INS_LB:    /* 100000 */
 			/* vaddr = cpu->reg[base]+offset; */
-			/* cpu->reg[rt] = load_byte(vaddr, cpu->ram, cpu->flash); */
+			/* cpu->reg[rt] = load_byte(cpu, vaddr); */
 			dtrace("\tlh\t%s, 0x%x(%s)" AL "(%s = 0x%x) @ 0x%x\n",
 			       r2rn(rt), offset, r2rn(base), r2rn(rt), cpu->reg[rt], vaddr);
 			break;
@@ -1312,7 +1751,7 @@ void instlog(struct cpu_state *cpu)
 			/* vaddr = cpu->reg[base]+offset; */
 			/* if(vaddr & 0x1) */
 			/* 	dtrace("Exception address error\n"); */
-			/* cpu->reg[rt] = load_short(vaddr, cpu->ram, cpu->flash); */
+			/* cpu->reg[rt] = load_short(cpu, vaddr); */
 			dtrace("\tlh\t%s, 0x%x(%s)" AL "(%s = 0x%x) @ 0x%x\n",
 			       r2rn(rt), offset, r2rn(base), r2rn(rt), cpu->reg[rt], vaddr);
 			break;
@@ -1322,7 +1761,7 @@ void instlog(struct cpu_state *cpu)
 			uint32_t word;
 			vaddr = cpu->reg[base]+(int32_t)offset;
 			byte = (vaddr & 0x03);
-			word = load_word(vaddr & 0xfffffffc, cpu->ram, cpu->flash);
+			word = load_word(cpu, vaddr & 0xfffffffc);
 			switch(byte)
 			{
 			case 0:
@@ -1346,18 +1785,18 @@ void instlog(struct cpu_state *cpu)
 			if(vaddr & 0x3)
 				dtrace("Exception address error\n");
 			dtrace("\tlw\t%s, 0x%x(%s)" AL "(%s = 0x%x) @ 0x%x\n",
-			       r2rn(rt), offset, r2rn(base), r2rn(rt), load_word(vaddr, cpu->ram, cpu->flash), vaddr);
+			       r2rn(rt), offset, r2rn(base), r2rn(rt), load_word(cpu, vaddr), vaddr);
 			break;
 		case INS_LBU:   /* 100100 */
 			dtrace("\tlbu\t%s, 0x%x(%s)" AL "(%s = 0x%x) @ 0x%x\n",
-			       r2rn(rt), offset, r2rn(base), r2rn(rt), (int32_t)load_byte(cpu->reg[base]+offset, cpu->ram, cpu->flash), cpu->reg[base]+offset);
+			       r2rn(rt), offset, r2rn(base), r2rn(rt), (int32_t)load_byte(cpu, cpu->reg[base]+offset), cpu->reg[base]+offset);
 			break;
 		case INS_LHU:   /* 100101 */
 			vaddr = cpu->reg[base]+offset;
 			if(vaddr & 0x1)
 				dtrace("Exception address error\n");
 			dtrace("\tlhu\t%s, 0x%x(%s)" AL "(%s = 0x%x) @ 0x%x\n",
-			       r2rn(rt), offset, r2rn(base), r2rn(rt), 0 /* load_short(vaddr, cpu->ram, cpu->flash) */, vaddr);
+			       r2rn(rt), offset, r2rn(base), r2rn(rt), 0 /* load_short(cpu, vaddr) */, vaddr);
 			break;
 		case INS_LWR:   /* 100110 */
 		{
@@ -1367,7 +1806,7 @@ void instlog(struct cpu_state *cpu)
 			byte = (vaddr & 0x03);
 			dtrace("\tlwr\t%s, 0x%x(%s)" AL "(%s = 0x%x) @ 0x%x\n",
 			       r2rn(rt), offset, r2rn(base), r2rn(rt), cpu->reg[rt], vaddr);
-			word = load_word(vaddr & 0xfffffffc, cpu->ram, cpu->flash);
+			word = load_word(cpu, vaddr & 0xfffffffc);
 			switch(byte)
 			{
 			case 0:
@@ -1411,7 +1850,7 @@ void instlog(struct cpu_state *cpu)
 			byte = (vaddr & 0x03);
 			dtrace("\tswl\t%s, 0x%x(%s)" AL "(0x%x) @ 0x%x\n",
 			       r2rn(rt), offset, r2rn(base), cpu->reg[rt], vaddr);
-			word = load_word(vaddr & 0xfffffffc, cpu->ram, cpu->flash);
+			word = load_word(cpu, vaddr & 0xfffffffc);
 			switch(byte)
 			{
 			case 0:
@@ -1454,7 +1893,7 @@ void instlog(struct cpu_state *cpu)
 			byte = (vaddr & 0x03);
 			dtrace("\tswr\t%s, 0x%x(%s)" AL "(0x%x) @ 0x%x\n",
 			       r2rn(rt), offset, r2rn(base), cpu->reg[rt], vaddr);
-			word = load_word(vaddr & 0xfffffffc, cpu->ram, cpu->flash);
+			word = load_word(cpu, vaddr & 0xfffffffc);
 			switch(byte)
 			{
 			case 0:
@@ -1489,18 +1928,30 @@ void initialize_emulator(struct cpu_state *cpu, char *firmware_file)
 {
 	int32_t fd;
 
-	debug = false;
-	run = false;
-	do_step = false;
-
-	cpu->flash = malloc(FLASH_SIZE);
-	cpu->ram = malloc(RAM_SIZE);
-	bzero((void *)cpu->flash, FLASH_SIZE);
-	bzero((void *)cpu->ram, RAM_SIZE);
+	cpu->debug = false;
+	cpu->run = false;
+	cpu->do_step = false;
+	cpu->idle_skip = true;
+	cpu->hle = true;
+	cpu->mach = calloc(1, sizeof(struct machine));
+	cpu->mach->uart0_ir = (1 << 5) << 16;
+	cpu->mach->uart1_ir = (1 << 5) << 16;
+
+	/* zeroed and page aligned so snapshot_load() can map images over them */
+	cpu->flash = mmap(NULL, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	cpu->ram = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	cpu->icache = calloc(ICACHE_PAGES, sizeof(struct insn *));
+	block_init(cpu);
+	callback_init(cpu);
+	sched_init(cpu);
+	sched_add(cpu, TIMER_TICK, timer_event);
+	mmio_init();
+	mem_init(cpu);
 
 	fd = open(firmware_file, O_RDONLY);
 
 	read(fd, (void *)cpu->flash, FLASH_SIZE);
+	mem_convert(cpu->flash, FLASH_SIZE);
 }
 
 void initialize_cpu(struct cpu_state *cpu, int32_t start_address)
@@ -1524,661 +1975,1514 @@ void initialize_cpu(struct cpu_state *cpu, int32_t start_address)
 	cpu->jump_pc = 0;
 	cpu->HI = 0;
 	cpu->LO = 0;
-	cpu->callbacks = NULL;
+	callback_clear(cpu);
+	compare_update(cpu);
 }
 
-void register_callbacks(void)
+void register_callbacks(struct cpu_state *cpu)
 {
 	/* SB5100 */
-	/* register_callback(&cpu, 0x81f800a8, print_char); /\* bootloader putc *\/ */
-	/* register_callback(&cpu, 0x8027f1c0, print_string); /\* bcm_some_print_function *\/ */
-	/* register_callback(&cpu, 0x8025ca90, print_string); /\* printbuf, call to write *\/ */
-	/* register_callback(&cpu, 0x8025b8f8, printf_string); /\* printf *\/ */
+	/* register_callback(cpu, 0x81f800a8, print_char); /\* bootloader putc *\/ */
+	/* register_callback(cpu, 0x8027f1c0, print_string); /\* bcm_some_print_function *\/ */
+	/* register_callback(cpu, 0x8025ca90, print_string); /\* printbuf, call to write *\/ */
+	/* register_callback(cpu, 0x8025b8f8, printf_string); /\* printf *\/ */
+
+	/* TCM410, printf by name once the vxWorks symbol table is found */
+	register_callback(cpu, 0x8028bcf0, print_string); /*  */
+	register_callback_symbol(cpu, "printf", 0x80268558, printf_string);
+	hle_register(cpu);
+}
 
-	/* TCM410 */
-	register_callback(&cpu, 0x8028bcf0, print_string); /*  */
-	register_callback(&cpu, 0x80268558, printf_string); /*  */
+/* Copy a NUL terminated guest string, NULL if it is not in RAM or flash */
+static char *get_string(struct cpu_state *cpu, uint32_t vaddr, char *buf, uint32_t size)
+{
+	uint32_t i;
+
+	if(!get_address(cpu, vaddr))
+		return NULL;
+	for(i = 0; i < size - 1; i++)
+	{
+		buf[i] = load_byte(cpu, vaddr + i);
+		if(!buf[i])
+			break;
+	}
+	buf[i] = 0;
+	return buf;
+}
+
+/* What the guest prints goes out with uart0, in the order it was printed */
+static void print_guest(struct cpu_state *cpu, const char *fmt, ...)
+{
+	char buf[4096];
+	va_list ap;
+	int32_t i, n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	for(i = 0; i < n && i < (int32_t)sizeof(buf) - 1; i++)
+		uart_write(cpu, buf[i]);
 }
 
 void print_string(struct cpu_state *cpu)
 {
-	printf("print@0x%08x: ", cpu->prev_pc[2] );
-	printf("%s", (char *)get_address(cpu->reg[5], cpu->ram, cpu->flash));
-	fflush( stdout );
+	char str[1024];
+
+	if(cpu->rerun || !get_string(cpu, cpu->reg[5], str, sizeof(str)))
+		return;
+	print_guest(cpu, "print@0x%08x: ", cpu->prev_pc[2] );
+	print_guest(cpu, "%s", str);
 }
 
 void printf_string(struct cpu_state *cpu)
 {
-	printf("printf@0x%08x: ", cpu->prev_pc[2] );
-	printf((char *)get_address(cpu->reg[4], cpu->ram, cpu->flash), (char *)get_address(cpu->reg[5], cpu->ram, cpu->flash), (char *)get_address(cpu->reg[6], cpu->ram, cpu->flash), (char *)get_address(cpu->reg[7], cpu->ram, cpu->flash));
-	fflush( stdout );
+	char str[4][1024];
+
+	/* without its format there is nothing to print */
+	if(cpu->rerun || !get_string(cpu, cpu->reg[4], str[0], sizeof(str[0])))
+		return;
+	print_guest(cpu, "printf@0x%08x: ", cpu->prev_pc[2] );
+	print_guest(cpu, str[0], get_string(cpu, cpu->reg[5], str[1], sizeof(str[1])), get_string(cpu, cpu->reg[6], str[2], sizeof(str[2])), get_string(cpu, cpu->reg[7], str[3], sizeof(str[3])));
 }
 
 void print_char(struct cpu_state *cpu)
 {
-	printf("%c", cpu->reg[4]);
-	fflush( stdout );
+	if(cpu->rerun)
+		return;
+	uart_write(cpu, cpu->reg[4]);
 }
 
 void bp(struct cpu_state *cpu)
 {
-	run = false;
-	debug = true;
+	if(cpu->batch)
+	{
+		cpu->stop = STOP_BREAKPOINT;
+		return;
+	}
+	cpu->run = false;
+	cpu->debug = true;
 }
 
 void clear_workQIsEmpty(struct cpu_state *cpu)
 {
-	*(int*)(cpu->ram+(0x8035e2d8-0x80000000)) = 0;
+	store_word(cpu, 0x8035e2d8, 0);
 }
 
-void register_callback(struct cpu_state *cpu, uint32_t address, void(*callback)(struct cpu_state *))
+
+/*
+ * Instruction handlers. Each guest instruction is decoded once into a
+ * struct insn and then executed through its handler on every later visit.
+ * On entry cpu->pc already points past the instruction, as it did when
+ * execute() was a single switch.
+ */
+
+/* always_inline so that block_dispatch() gets the bodies even at -O0 */
+#define OP_HANDLER(name) static inline __attribute__((always_inline)) void op_##name(struct cpu_state *cpu, const struct insn *insn)
+
+/* Ends the program, or just the batch when running under run_until() */
+static void unknown_insn(struct cpu_state *cpu, int32_t status)
 {
-  struct callback *cb;
-  cb = (struct callback*)malloc(sizeof(struct callback));
+	if(!cpu->batch)
+		exit(status);
+	cpu->stop = STOP_UNKNOWN_INSN;
+}
 
-  cb->address = address;
-  cb->callback = callback;
-  cb->next = cpu->callbacks;
-  cpu->callbacks = cb;
+OP_HANDLER(sll)
+{
+	cpu->reg[insn->rd] = (uint32_t)cpu->reg[insn->rt] << insn->sa;
 }
 
-void execute(struct cpu_state *cpu)
+OP_HANDLER(movf)
 {
-	int32_t instruction;
-	int32_t opcode;
-	int32_t rs;
-	int32_t rt;
-	int32_t rd;
-	int32_t sa;
-	int32_t base;
-	uint32_t vaddr;
-	int32_t offset;
-	int16_t im16;
+	printf("\tmovf not implemented\n");
+	unknown_insn(cpu, 1);
+}
 
-		if( (uint32_t)cpu->cop0[9][0] >= (uint32_t)cpu->cop0[11][0] && (uint32_t)cpu->cop0[11][0] > 0 )
-		{
-			/* printf("******************\ncount: %u compare: %u\n******************\n", cpu->cop0[9][0], cpu->cop0[11][0] ); */
-			cpu->cop0[13][0] |= 1 << 15;
-		}
-		else
-		{
-			cpu->cop0[13][0] &= ~( 1 << 15 );
+OP_HANDLER(srl)
+{
+	cpu->reg[insn->rd] = (uint32_t)cpu->reg[insn->rt] >> insn->sa;
+}
 
-		}	/* tx empty irq */
-		if( ( uart0_ir & 0x00200020 ) == 0x00200020 )
-		{
-			irq_stat |= 4;
-			cpu->cop0[13][0] |= 1 << 10;
-		}
-		else
-		{
-			irq_stat &= ~4;
-			cpu->cop0[13][0] &= ~( 1 << 10 );
-		}
-		if( ( cpu->cop0[12][0] & 0x00000001 ) &&
-			( ( cpu->cop0[13][0] & cpu->cop0[12][0] & 0x0000ff00 ) ) &&
-			( cpu->cop0[12][0] & 0x00000002 ) == 0 &&
-			!cpu->in_irq )
-		{
-			if( cpu->cop0[13][0] == 1 << 15 )
-				dtrace("0x%08x:\tirq timer (0x%08x, 0x%08x, 0x%08x)\n", cpu->pc, cpu->jump_pc, cpu->cop0[12][0], cpu->cop0[13][0]);
-			else if( cpu->cop0[13][0] == 1 << 10 )
-				dtrace("0x%08x:\tirq tx (0x%08x, 0x%08x, 0x%08x)\n", cpu->pc, cpu->jump_pc, cpu->cop0[12][0], cpu->cop0[13][0]);
-			else
-				dtrace("0x%08x:\tirq tx|timer (0x%08x, 0x%08x, 0x%08x)\n", cpu->pc, cpu->jump_pc, cpu->cop0[12][0], cpu->cop0[13][0]);
+OP_HANDLER(sra)
+{
+	cpu->reg[insn->rd] = cpu->reg[insn->rt] >> insn->sa;
+}
 
-			if( cpu->delayed_jump )
-			{
-				/* use epc cop0 register instead */
-				cpu->eret = cpu->pc - 4;
-				cpu->delayed_jump = 0;
-			}
-			else
-			{
-				/* use epc cop0 register instead */
-				cpu->eret = cpu->pc;
-			}
-			cpu->cop0[12][0] |= 0x00000002;
-			cpu->pc = 0x80000180;
-			cpu->in_irq = true;
-		}
+OP_HANDLER(sllv)
+{
+	cpu->reg[insn->rd] = (uint32_t)cpu->reg[insn->rt] << (cpu->reg[insn->rs] & 0x1f);
+}
 
-		if(cpu->callbacks)
-			process_callbacks(cpu);
+OP_HANDLER(srlv)
+{
+	cpu->reg[insn->rd] = (uint32_t)cpu->reg[insn->rt] >> (cpu->reg[insn->rs] & 0x1f);
+}
 
-		cli(cpu);
-		cpu->cop0[9][0]++;
-		instruction = get_instruction(cpu->pc, cpu->ram, cpu->flash);
+OP_HANDLER(srav)
+{
+	cpu->reg[insn->rd] = (int32_t)cpu->reg[insn->rt] >> (cpu->reg[insn->rs] & 0x1f);
+}
 
-		cpu->prev_pc[0] = cpu->prev_pc[1];
-		cpu->prev_pc[1] = cpu->prev_pc[2];
-		cpu->prev_pc[2] = cpu->pc;
-		if(cpu->delayed_jump)
-		{
-			cpu->pc = cpu->jump_pc;
-			cpu->delayed_jump = 0;
-			cpu->jump_pc = 0;
-		}
-		else
-			cpu->pc += 4;
-
-		base = get_base(instruction);
-		im16 = get_immediate16(instruction);
-		offset = get_offset(instruction);
-		rd = get_rd(instruction);
-		rs = get_rs(instruction);
-		rt = get_rt(instruction);
-		sa = get_sa(instruction);
-		vaddr = cpu->reg[base]+offset;
-		opcode = decode_opcode(instruction);
-		if(opcode == 0)
-		{
-			opcode = decode_special_opcode(instruction);
-			switch(opcode)
-			{
-			case INS_SLL:   /* 000000 */
-				cpu->reg[rd] = (uint32_t)cpu->reg[rt] << sa;
-				break;
-			case INS_MOVF:  /* 000001 */
-				printf("\tmovf not implemented\n");
-				exit(1);
-				break;
-			case INS_SRL:   /* 000010 */
-				cpu->reg[rd] = (uint32_t)cpu->reg[rt] >> sa;
-				break;
-			case INS_SRA:   /* 000011 */
-				cpu->reg[rd] = cpu->reg[rt] >> sa;
-				break;
-			case INS_SLLV:  /* 000100 */
-				cpu->reg[rd] = (uint32_t)cpu->reg[rt] << (cpu->reg[rs] & 0x1f);
-				break;
-			case INS_SRLV:  /* 000110 */
-				cpu->reg[rd] = (uint32_t)cpu->reg[rt] >> (cpu->reg[rs] & 0x1f);
-				break;
-			case INS_SRAV:  /* 000111 */
-				cpu->reg[rd] = (int32_t)cpu->reg[rt] >> (cpu->reg[rs] & 0x1f);
-				break;
-			case INS_JR:    /* 001000 */
-				cpu->jump_pc = cpu->reg[rs] & ~0x20000000;
-				cpu->delayed_jump = 1;
-				break;
-			case INS_JALR:  /* 001001 */
-				cpu->jump_pc = cpu->reg[rs] & ~0x20000000;
-				cpu->reg[rd] = cpu->pc+4;
-				cpu->delayed_jump = 1;
-				break;
-			case INS_MOVZ:  /* 001010 */
-				if(cpu->reg[rt] == 0)
-					cpu->reg[rd] = cpu->reg[rs];
-				break;
-			case INS_MOVN:  /* 001011 */
-				if(cpu->reg[rt] != 0)
-					cpu->reg[rd] = cpu->reg[rs];
-				break;
-			case INS_MFHI:  /* 010000 */
-				cpu->reg[rd] = cpu->HI;
-				break;
-			case INS_MTHI:  /* 010001 */
-				cpu->HI = cpu->reg[rs];
-				break;
-			case INS_MFLO:  /* 010010 */
-				cpu->reg[rd] = cpu->LO;
-				break;
-			case INS_MTLO:  /* 010011 */
-				cpu->LO = cpu->reg[rs];
-				break;
-			case INS_MULT:  /* 011000 */
-				cpu->HI = ((int64_t)cpu->reg[rs] * (int64_t)cpu->reg[rt]) >> 32;
-				cpu->LO = ((int64_t)cpu->reg[rs] * (int64_t)cpu->reg[rt]) & 0xffffffff;
-				break;
-			case INS_MULTU: /* 011001 */
-				cpu->HI = ((uint64_t)(uint32_t)cpu->reg[rs] * (uint64_t)(uint32_t)cpu->reg[rt]) >> 32;
-				cpu->LO = ((uint64_t)(uint32_t)cpu->reg[rs] * (uint64_t)(uint32_t)cpu->reg[rt]) & 0xffffffff;
-				break;
-			case INS_DIV:   /* 011010 */
-				cpu->LO = cpu->reg[rs] / cpu->reg[rt];
-				cpu->HI = cpu->reg[rs] % cpu->reg[rt];
-				break;
-			case INS_DIVU:  /* 011011 */
-				cpu->LO = (uint32_t)cpu->reg[rs] / (uint32_t)cpu->reg[rt];
-				cpu->HI = (uint32_t)cpu->reg[rs] % (uint32_t)cpu->reg[rt];
-				break;
-			case INS_ADDU:  /* 100001 */
-				cpu->reg[rd] = cpu->reg[rs] + cpu->reg[rt];
-				break;
-			case INS_ADD:   /* 100000 */
-				cpu->reg[rd] = cpu->reg[rs] + cpu->reg[rt];
-				break;
-			case INS_SUB:   /* 100010 */
-				cpu->reg[rd] = cpu->reg[rs] - cpu->reg[rt];
-				break;
-			case INS_SUBU:  /* 100011 */
-				cpu->reg[rd] = cpu->reg[rs] - cpu->reg[rt];
-				break;
-			case INS_AND:   /* 100100 */
-				cpu->reg[rd] = cpu->reg[rs] & cpu->reg[rt];
-				break;
-			case INS_OR:    /* 100101 */
-				cpu->reg[rd] = cpu->reg[rs] | cpu->reg[rt];
-				break;
-			case INS_XOR:   /* 100110 */
-				cpu->reg[rd] = cpu->reg[rs] ^ cpu->reg[rt];
-				break;
-			case INS_NOR:   /* 100111 */
-				cpu->reg[rd] = ~(cpu->reg[rs] | cpu->reg[rt]);
-				break;
-			case INS_SLT:   /* 101010 */
-				cpu->reg[rd] = cpu->reg[rs] < cpu->reg[rt];
-				break;
-			case INS_SLTU:  /* 101011 */
-				cpu->reg[rd] = (uint32_t)cpu->reg[rs] < (uint32_t)cpu->reg[rt];
-				break;
-			default:
-				printf("unknown instruction at 0x%x special_opcode(0x%x)\n",
-					   cpu->pc-4, decode_special_opcode(instruction));
-				exit(0);
-			}
-		}
-		else if(opcode == 1)
-		{
-			opcode = decode_special_branch_opcode(instruction);
-			switch(opcode)
-			{
-			case INS_BLTZ:  /* 000000 */
-				if(cpu->reg[rs] < 0)
-				{
-					cpu->jump_pc = cpu->pc + (offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				break;
-			case INS_BGEZ:  /* 000001 */
-				if(cpu->reg[rs] >= 0)
-				{
-					cpu->jump_pc = cpu->pc + (offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				break;
-			case INS_BLTZL:  /* 000010 */
-				if(cpu->reg[rs] < 0)
-				{
-					cpu->jump_pc = cpu->pc + (offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				else
-					cpu->pc += 4;
-				break;
-			case INS_BGEZL:  /* 000011 */
-				if(cpu->reg[rs] >= 0)
-				{
-					cpu->jump_pc = cpu->pc + (offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				else
-					cpu->pc += 4;
-				break;
-			case INS_BAL:   /* 010010 */
-			{
-				cpu->jump_pc = cpu->pc + (offset << 2);
-				cpu->reg[31] = cpu->pc + 4;
-				cpu->delayed_jump = 1;
-			}
-			break;
-			default:
-				printf("unknown instruction at 0x%x special_branch_opcode(0x%x)\n",
-					   cpu->pc-4, decode_special_branch_opcode(instruction));
-				exit(0);
+OP_HANDLER(jr)
+{
+	cpu->jump_pc = cpu->reg[insn->rs] & ~0x20000000;
+	cpu->delayed_jump = 1;
+}
 
-			}
-		}
-		else if(opcode == 0x1c)
-		{
-			opcode = decode_special2_opcode(instruction);
-			switch (opcode)
-			{
-			case INS_MUL:   /* 000010 */
-				cpu->reg[rd] = ((int64_t)cpu->reg[rs] * (int64_t)cpu->reg[rt]) & 0xffffffff;
-				break;
-/* #define INS_MADD  0x0 */
-/* #define INS_MADDU 0x1 */
-/* #define INS_MSUB  0x4 */
-/* #define INS_MSUBU 0x5 */
-/* #define INS_CLZ   0x20 */
-/* #define INS_CLO   0x21 */
-/* #define INS_SDBBP 0x3f */
-			default:
-				printf("unknown instruction at 0x%x special_opcode2(0x%x)\n",
-					   cpu->pc-4, decode_special2_opcode(instruction));
-				exit(0);
-			}
-		}
-		else 
-		{
-			switch(opcode)
-			{
-			case INS_J:     /* 000010 */
-				cpu->jump_pc = get_jump_address(instruction, cpu->pc);
-				cpu->delayed_jump = 1;
-				break;
-			case INS_JAL:   /* 000011 */
-				cpu->jump_pc = get_jump_address(instruction, cpu->pc);
-				cpu->reg[31] = cpu->pc+4;
-				cpu->delayed_jump = 1;
-				break;
-			case INS_BEQ:   /* 000100 */
-				if(cpu->reg[rt] == cpu->reg[rs])
-				{
-					cpu->jump_pc = cpu->pc + ((int32_t)offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				break;
-			case INS_BNE:   /* 000101 */
-				if(cpu->reg[rt] != cpu->reg[rs])
-				{
-					cpu->jump_pc = cpu->pc + ((int32_t)offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				break;
-			case INS_BLEZ:  /* 000110 */
-				if(cpu->reg[rs] <= 0)
-				{
-					cpu->jump_pc = cpu->pc + (offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				break;
-			case INS_BGTZ:  /* 000111 */
-				if(cpu->reg[rs] > 0)
-				{
-					cpu->jump_pc = cpu->pc + (offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				break;
-			case INS_ADDI:  /* 001000 */
-				cpu->reg[rt] = cpu->reg[rs] + (int32_t)im16;
-				break;
-			case INS_ADDIU: /* 001001 */
-				cpu->reg[rt] = cpu->reg[rs] + (int32_t)im16;
-				break;
-			case INS_SLTI:  /* 001010 */
-				cpu->reg[rt] = cpu->reg[rs] < (int32_t)im16;
-				break;
-			case INS_SLTIU: /* 001011 */
-				cpu->reg[rt] = (uint32_t)cpu->reg[rs] < (uint32_t)(int32_t)im16;
-				break;
-			case INS_ANDI:  /* 001100 */
-				cpu->reg[rt] = cpu->reg[rs] & (int32_t)(uint16_t)im16;
-				break;
-			case INS_ORI:   /* 001101 */
-				cpu->reg[rt] = cpu->reg[rs] | (int32_t)(uint16_t)im16;
-				break;
-			case INS_XORI:  /* 001110 */
-				cpu->reg[rt] = cpu->reg[rs] ^ (int32_t)(uint16_t)im16;
-				break;
-			case INS_LUI:   /* 001111 */
-				cpu->reg[rt] = im16 << 16;
-				break;
-			case INS_COP0:  /* 010000 */
-				/* don't handle at the moment */
-				/* if(!debug) */
-				/* 	debug = 1; */
-				if( (instruction & 0x03e007f8) == 0)
-				{
-					cpu->reg[rt] = cpu->cop0[rd][instruction & 0x3];
-				}
-				else if( (instruction & 0x00800000) == 0x800000)
-				{
-					cpu->cop0[rd][instruction & 0x3] = cpu->reg[rt];
-				}
-				else if( (instruction & 0x42000002) == 0x42000002)
-				{
-				}
-				else if( (instruction & 0x42000018) == 0x42000018)
-				{
-					cpu->cop0[12][0] &= ~0x00000002;
-					/* use epc cop0 register instead */
-					cpu->pc = cpu->eret;
-					cpu->in_irq = false;
-					/* run = false; */
-				}
-				else
-				{
-					exit(1);
-				}
-				/* debug = 0; */
-				break;
-			case INS_COP1:  /* 010001 */
-				printf("\tcop1 not implemented\n");
-				exit(1);
-				break;
-			case INS_COP2:  /* 010010 */
-				printf("\tcop2 not implemented\n");
-				exit(1);
-				break;
-			case INS_NA1:   /* 010011 */
-				printf("\tundefined instruction na1 not implemented\n");
-				exit(1);
-				break;
-			case INS_BEQL:  /* 010100 */
-				if(cpu->reg[rt] == cpu->reg[rs])
-				{
-					cpu->jump_pc = cpu->pc + ((int32_t)offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				else
-					cpu->pc += 4;
-				break;
-			case INS_BNEL:   /* 010101 */
-				if(cpu->reg[rt] != cpu->reg[rs])
-				{
-					cpu->jump_pc = cpu->pc + ((int32_t)offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				else
-					cpu->pc += 4;
-				break;
-			case INS_BLEZL: /* 010110 */
-				if(cpu->reg[rs] <= 0)
-				{
-					cpu->jump_pc = cpu->pc + (offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				else
-					cpu->pc += 4;
-				break;
-			case INS_BGTZL: /* 010111 */
-				if(cpu->reg[rs] > 0)
-				{
-					cpu->jump_pc = cpu->pc + (offset << 2);
-					cpu->delayed_jump = 1;
-				}
-				else
-					cpu->pc += 4;
-				break;
-			case INS_NA2:   /* 011000 */
-				printf("\tundefined instruction na2 not implemented\n");
-				exit(1);
-				break;
-			case INS_NA3:   /* 011001 */
-				printf("\tundefined instruction na3 not implemented\n");
-				exit(1);
-				break;
-			case INS_NA4:   /* 011010 */
-				printf("\tundefined instruction na4 not implemented\n");
-				exit(1);
-				break;
-			case INS_NA5:   /* 011011 */
-				printf("\tundefined instruction na5 not implemented\n");
-				exit(1);
-				break;
-			case INS_NA6:   /* 011100 */
-				printf("\tundefined instruction na6 not implemented\n");
-				exit(1);
-				break;
-			case INS_NA7:   /* 011101 */
-				printf("\tundefined instruction na7 not implemented\n");
-				exit(1);
-				break;
-			case INS_NA8:   /* 011110 */
-				printf("\tundefined instruction na8 not implemented\n");
-				exit(1);
-				break;
-			case INS_NA9:   /* 011111 */
-				printf("\tundefined instruction na9 not implemented\n");
-				exit(1);
-				break;
-			case INS_LB:    /* 100000 */
-				vaddr = cpu->reg[base]+offset;
-				cpu->reg[rt] = (int32_t)(int8_t)load_byte(vaddr, cpu->ram, cpu->flash);
-				break;
-			case INS_LH:    /* 100001 */
-				vaddr = cpu->reg[base]+offset;
-				cpu->reg[rt] = (int32_t)(int16_t)load_short(vaddr, cpu->ram, cpu->flash);
+OP_HANDLER(jalr)
+{
+	cpu->jump_pc = cpu->reg[insn->rs] & ~0x20000000;
+	cpu->reg[insn->rd] = cpu->pc+4;
+	cpu->delayed_jump = 1;
+}
+
+OP_HANDLER(movz)
+{
+	if(cpu->reg[insn->rt] == 0)
+		cpu->reg[insn->rd] = cpu->reg[insn->rs];
+}
+
+OP_HANDLER(movn)
+{
+	if(cpu->reg[insn->rt] != 0)
+		cpu->reg[insn->rd] = cpu->reg[insn->rs];
+}
+
+OP_HANDLER(mfhi)
+{
+	cpu->reg[insn->rd] = cpu->HI;
+}
+
+OP_HANDLER(mthi)
+{
+	cpu->HI = cpu->reg[insn->rs];
+}
+
+OP_HANDLER(mflo)
+{
+	cpu->reg[insn->rd] = cpu->LO;
+}
+
+OP_HANDLER(mtlo)
+{
+	cpu->LO = cpu->reg[insn->rs];
+}
+
+OP_HANDLER(mult)
+{
+	cpu->HI = ((int64_t)cpu->reg[insn->rs] * (int64_t)cpu->reg[insn->rt]) >> 32;
+	cpu->LO = ((int64_t)cpu->reg[insn->rs] * (int64_t)cpu->reg[insn->rt]) & 0xffffffff;
+}
+
+OP_HANDLER(multu)
+{
+	cpu->HI = ((uint64_t)(uint32_t)cpu->reg[insn->rs] * (uint64_t)(uint32_t)cpu->reg[insn->rt]) >> 32;
+	cpu->LO = ((uint64_t)(uint32_t)cpu->reg[insn->rs] * (uint64_t)(uint32_t)cpu->reg[insn->rt]) & 0xffffffff;
+}
+
+OP_HANDLER(div)
+{
+	cpu->LO = cpu->reg[insn->rs] / cpu->reg[insn->rt];
+	cpu->HI = cpu->reg[insn->rs] % cpu->reg[insn->rt];
+}
+
+OP_HANDLER(divu)
+{
+	cpu->LO = (uint32_t)cpu->reg[insn->rs] / (uint32_t)cpu->reg[insn->rt];
+	cpu->HI = (uint32_t)cpu->reg[insn->rs] % (uint32_t)cpu->reg[insn->rt];
+}
+
+OP_HANDLER(addu)
+{
+	cpu->reg[insn->rd] = cpu->reg[insn->rs] + cpu->reg[insn->rt];
+}
+
+OP_HANDLER(add)
+{
+	cpu->reg[insn->rd] = cpu->reg[insn->rs] + cpu->reg[insn->rt];
+}
+
+OP_HANDLER(sub)
+{
+	cpu->reg[insn->rd] = cpu->reg[insn->rs] - cpu->reg[insn->rt];
+}
+
+OP_HANDLER(subu)
+{
+	cpu->reg[insn->rd] = cpu->reg[insn->rs] - cpu->reg[insn->rt];
+}
+
+OP_HANDLER(and)
+{
+	cpu->reg[insn->rd] = cpu->reg[insn->rs] & cpu->reg[insn->rt];
+}
+
+OP_HANDLER(or)
+{
+	cpu->reg[insn->rd] = cpu->reg[insn->rs] | cpu->reg[insn->rt];
+}
+
+OP_HANDLER(xor)
+{
+	cpu->reg[insn->rd] = cpu->reg[insn->rs] ^ cpu->reg[insn->rt];
+}
+
+OP_HANDLER(nor)
+{
+	cpu->reg[insn->rd] = ~(cpu->reg[insn->rs] | cpu->reg[insn->rt]);
+}
+
+OP_HANDLER(slt)
+{
+	cpu->reg[insn->rd] = cpu->reg[insn->rs] < cpu->reg[insn->rt];
+}
+
+OP_HANDLER(sltu)
+{
+	cpu->reg[insn->rd] = (uint32_t)cpu->reg[insn->rs] < (uint32_t)cpu->reg[insn->rt];
+}
+
+OP_HANDLER(unknown_special)
+{
+	printf("unknown instruction at 0x%x special_opcode(0x%x)\n",
+		   cpu->pc-4, decode_special_opcode(insn->instruction));
+	unknown_insn(cpu, 0);
+}
+
+OP_HANDLER(bltz)
+{
+	if(cpu->reg[insn->rs] < 0)
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+}
+
+OP_HANDLER(bgez)
+{
+	if(cpu->reg[insn->rs] >= 0)
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+}
+
+OP_HANDLER(bltzl)
+{
+	if(cpu->reg[insn->rs] < 0)
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+	else
+		cpu->pc += 4;
+}
+
+OP_HANDLER(bgezl)
+{
+	if(cpu->reg[insn->rs] >= 0)
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+	else
+		cpu->pc += 4;
+}
+
+OP_HANDLER(bal)
+{
+	cpu->jump_pc = insn->target;
+	cpu->reg[31] = cpu->pc + 4;
+	cpu->delayed_jump = 1;
+}
+
+OP_HANDLER(unknown_regimm)
+{
+	printf("unknown instruction at 0x%x special_branch_opcode(0x%x)\n",
+		   cpu->pc-4, decode_special_branch_opcode(insn->instruction));
+	unknown_insn(cpu, 0);
+}
+
+OP_HANDLER(mul)
+{
+	cpu->reg[insn->rd] = ((int64_t)cpu->reg[insn->rs] * (int64_t)cpu->reg[insn->rt]) & 0xffffffff;
+}
+
+OP_HANDLER(unknown_special2)
+{
+	printf("unknown instruction at 0x%x special_opcode2(0x%x)\n",
+		   cpu->pc-4, decode_special2_opcode(insn->instruction));
+	unknown_insn(cpu, 0);
+}
+
+OP_HANDLER(j)
+{
+	cpu->jump_pc = insn->target;
+	cpu->delayed_jump = 1;
+}
+
+OP_HANDLER(jal)
+{
+	cpu->jump_pc = insn->target;
+	cpu->reg[31] = cpu->pc+4;
+	cpu->delayed_jump = 1;
+}
+
+OP_HANDLER(beq)
+{
+	if(cpu->reg[insn->rt] == cpu->reg[insn->rs])
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+}
+
+OP_HANDLER(bne)
+{
+	if(cpu->reg[insn->rt] != cpu->reg[insn->rs])
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+}
+
+OP_HANDLER(blez)
+{
+	if(cpu->reg[insn->rs] <= 0)
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+}
+
+OP_HANDLER(bgtz)
+{
+	if(cpu->reg[insn->rs] > 0)
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+}
+
+OP_HANDLER(addi)
+{
+	cpu->reg[insn->rt] = cpu->reg[insn->rs] + (int32_t)insn->im16;
+}
+
+OP_HANDLER(addiu)
+{
+	cpu->reg[insn->rt] = cpu->reg[insn->rs] + (int32_t)insn->im16;
+}
+
+OP_HANDLER(slti)
+{
+	cpu->reg[insn->rt] = cpu->reg[insn->rs] < (int32_t)insn->im16;
+}
+
+OP_HANDLER(sltiu)
+{
+	cpu->reg[insn->rt] = (uint32_t)cpu->reg[insn->rs] < (uint32_t)(int32_t)insn->im16;
+}
+
+OP_HANDLER(andi)
+{
+	cpu->reg[insn->rt] = cpu->reg[insn->rs] & (int32_t)(uint16_t)insn->im16;
+}
+
+OP_HANDLER(ori)
+{
+	cpu->reg[insn->rt] = cpu->reg[insn->rs] | (int32_t)(uint16_t)insn->im16;
+}
+
+OP_HANDLER(xori)
+{
+	cpu->reg[insn->rt] = cpu->reg[insn->rs] ^ (int32_t)(uint16_t)insn->im16;
+}
+
+OP_HANDLER(lui)
+{
+	cpu->reg[insn->rt] = insn->im16 << 16;
+}
+
+OP_HANDLER(mfc0)
+{
+	cpu->reg[insn->rt] = cpu->cop0[insn->rd][insn->instruction & 0x3];
+}
+
+OP_HANDLER(mtc0)
+{
+	cpu->cop0[insn->rd][insn->instruction & 0x3] = cpu->reg[insn->rt];
+	/* Count, Compare, Status and Cause all feed the IRQ state */
+	if(insn->rd >= 9 && insn->rd <= 13 && insn->rd != 10)
+		compare_update(cpu);
+}
+
+OP_HANDLER(tlbwi)
+{
+}
+
+OP_HANDLER(eret)
+{
+	cpu->cop0[12][0] &= ~0x00000002;
+	/* use epc cop0 register instead */
+	cpu->pc = cpu->eret;
+	cpu->in_irq = false;
+	irq_update(cpu);
+}
+
+OP_HANDLER(unknown_cop0)
+{
+	unknown_insn(cpu, 1);
+}
+
+OP_HANDLER(cop1)
+{
+	printf("\tcop1 not implemented\n");
+	unknown_insn(cpu, 1);
+}
+
+OP_HANDLER(cop2)
+{
+	printf("\tcop2 not implemented\n");
+	unknown_insn(cpu, 1);
+}
+
+OP_HANDLER(undefined)
+{
+	const char *name;
+
+	switch(decode_opcode(insn->instruction))
+	{
+	case INS_NA1:  name = "na1";  break;
+	case INS_NA2:  name = "na2";  break;
+	case INS_NA3:  name = "na3";  break;
+	case INS_NA4:  name = "na4";  break;
+	case INS_NA5:  name = "na5";  break;
+	case INS_NA6:  name = "na6";  break;
+	case INS_NA7:  name = "na7";  break;
+	case INS_NA8:  name = "na8";  break;
+	case INS_NA9:  name = "na9";  break;
+	case INS_NA10: name = "na10"; break;
+	case INS_NA11: name = "na11"; break;
+	default:       name = "na12"; break;
+	}
+	printf("\tundefined instruction %s not implemented\n", name);
+	unknown_insn(cpu, 1);
+}
+
+OP_HANDLER(beql)
+{
+	if(cpu->reg[insn->rt] == cpu->reg[insn->rs])
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+	else
+		cpu->pc += 4;
+}
+
+OP_HANDLER(bnel)
+{
+	if(cpu->reg[insn->rt] != cpu->reg[insn->rs])
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+	else
+		cpu->pc += 4;
+}
+
+OP_HANDLER(blezl)
+{
+	if(cpu->reg[insn->rs] <= 0)
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+	else
+		cpu->pc += 4;
+}
+
+OP_HANDLER(bgtzl)
+{
+	if(cpu->reg[insn->rs] > 0)
+	{
+		cpu->jump_pc = insn->target;
+		cpu->delayed_jump = 1;
+	}
+	else
+		cpu->pc += 4;
+}
+
+OP_HANDLER(lb)
+{
+	uint32_t vaddr = cpu->reg[insn->rs]+insn->im16;
+	cpu->reg[insn->rt] = (int32_t)(int8_t)load_byte(cpu, vaddr);
+}
+
+OP_HANDLER(lh)
+{
+	uint32_t vaddr = cpu->reg[insn->rs]+insn->im16;
+	cpu->reg[insn->rt] = (int32_t)(int16_t)load_short(cpu, vaddr);
+}
+
+OP_HANDLER(lwl)
+{
+	int8_t byte;
+	uint32_t word;
+	uint32_t vaddr = cpu->reg[insn->rs]+(int32_t)insn->im16;
+	byte = (vaddr & 0x03);
+	word = load_word(cpu, vaddr & 0xfffffffc);
+	switch(byte)
+	{
+	case 0:
+		break;
+	case 1:
+		word = (cpu->reg[insn->rt] & 0x000000ff) | ((word & 0x00ffffff) << 8);
+		break;
+	case 2:
+		word = (cpu->reg[insn->rt] & 0x0000ffff) | ((word & 0x0000ffff) << 16);
+		break;
+	case 3:
+		word = (cpu->reg[insn->rt] & 0x00ffffff) | ((word & 0x000000ff) << 24);
+		break;
+	}
+	cpu->reg[insn->rt] = word;
+}
+
+OP_HANDLER(lw)
+{
+	uint32_t vaddr = cpu->reg[insn->rs]+insn->im16;
+	cpu->reg[insn->rt] = load_word(cpu, vaddr);
+}
+
+OP_HANDLER(lbu)
+{
+	uint32_t vaddr = cpu->reg[insn->rs]+insn->im16;
+	cpu->reg[insn->rt] = (int32_t)load_byte(cpu, vaddr);
+}
+
+OP_HANDLER(lhu)
+{
+	uint32_t vaddr = cpu->reg[insn->rs]+insn->im16;
+	cpu->reg[insn->rt] = load_short(cpu, vaddr);
+}
+
+OP_HANDLER(lwr)
+{
+	int8_t byte;
+	uint32_t word;
+	uint32_t vaddr = cpu->reg[insn->rs]+(int32_t)insn->im16;
+	byte = (vaddr & 0x03);
+	word = load_word(cpu, vaddr & 0xfffffffc);
+	switch(byte)
+	{
+	case 0:
+		word = (cpu->reg[insn->rt] & 0xffffff00) | ((word & 0xff000000) >> 24);
+		break;
+	case 1:
+		word = (cpu->reg[insn->rt] & 0xffff0000) | ((word & 0xffff0000) >> 16);
+		break;
+	case 2:
+		word = (cpu->reg[insn->rt] & 0xff000000) | ((word & 0xffffff00) >> 8);
+		break;
+	case 3:
+		break;
+	}
+	cpu->reg[insn->rt] = word;
+}
+
+OP_HANDLER(sb)
+{
+	uint32_t vaddr = cpu->reg[insn->rs]+insn->im16;
+	store_byte(cpu, vaddr, cpu->reg[insn->rt]);
+}
+
+OP_HANDLER(sh)
+{
+	uint32_t vaddr = cpu->reg[insn->rs]+insn->im16;
+	store_short(cpu, vaddr, cpu->reg[insn->rt]);
+}
+
+OP_HANDLER(swl)
+{
+	int8_t byte;
+	uint32_t word;
+	uint32_t vaddr = cpu->reg[insn->rs]+(int32_t)insn->im16;
+	byte = (vaddr & 0x03);
+	word = load_word(cpu, vaddr & 0xfffffffc);
+	switch(byte)
+	{
+	case 0:
+		word = cpu->reg[insn->rt];
+		break;
+	case 1:
+		word = ((cpu->reg[insn->rt] & 0xffffff00) >>  8) | ((word & 0xff000000));
+		break;
+	case 2:
+		word = ((cpu->reg[insn->rt] & 0xffff0000) >> 16) | ((word & 0xffff0000));
+		break;
+	case 3:
+		word = ((cpu->reg[insn->rt] & 0xff000000) >> 24) | ((word & 0xffffff00));
+		break;
+	}
+	store_word(cpu, vaddr & 0xfffffffc, word);
+}
+
+OP_HANDLER(sw)
+{
+	uint32_t vaddr = cpu->reg[insn->rs]+insn->im16;
+	store_word(cpu, vaddr, cpu->reg[insn->rt]);
+}
+
+OP_HANDLER(swr)
+{
+	int8_t byte;
+	uint32_t word;
+	uint32_t vaddr = cpu->reg[insn->rs]+(int32_t)insn->im16;
+	byte = (vaddr & 0x03);
+	word = load_word(cpu, vaddr & 0xfffffffc);
+	switch(byte)
+	{
+	case 0:
+		word = ((cpu->reg[insn->rt] & 0x000000ff) << 24) | (word & 0x00ffffff);
+		break;
+	case 1:
+		word = ((cpu->reg[insn->rt] & 0x0000ffff) << 16) | (word & 0x0000ffff);
+		break;
+	case 2:
+		word = ((cpu->reg[insn->rt] & 0x00ffffff) <<  8) | (word & 0x000000ff);
+		break;
+	case 3:
+		word = cpu->reg[insn->rt];
+		break;
+	}
+	store_word(cpu, vaddr & 0xfffffffc, word);
+}
+
+OP_HANDLER(cache)
+{
+	/* don't handle at the moment */
+}
+
+OP_HANDLER(unknown)
+{
+	printf("\nunknown instruction at 0x%x opcode(0x%x)\n",
+		   cpu->pc-4, decode_opcode(insn->instruction));
+	unknown_insn(cpu, 0);
+}
+
+/*
+ * Every handler above, in one list so the op numbers, the handler table and
+ * the labels of the threaded interpreter are generated from the same place.
+ */
+#define OPS(X) \
+	X(sll) X(movf) X(srl) X(sra) X(sllv) X(srlv) X(srav) X(jr) X(jalr) \
+	X(movz) X(movn) X(mfhi) X(mthi) X(mflo) X(mtlo) X(mult) X(multu) \
+	X(div) X(divu) X(addu) X(add) X(sub) X(subu) X(and) X(or) X(xor) \
+	X(nor) X(slt) X(sltu) X(unknown_special) \
+	X(bltz) X(bgez) X(bltzl) X(bgezl) X(bal) X(unknown_regimm) \
+	X(mul) X(unknown_special2) \
+	X(j) X(jal) X(beq) X(bne) X(blez) X(bgtz) X(addi) X(addiu) X(slti) \
+	X(sltiu) X(andi) X(ori) X(xori) X(lui) X(mfc0) X(mtc0) X(tlbwi) \
+	X(eret) X(unknown_cop0) X(cop1) X(cop2) X(undefined) X(beql) X(bnel) \
+	X(blezl) X(bgtzl) X(lb) X(lh) X(lwl) X(lw) X(lbu) X(lhu) X(lwr) \
+	X(sb) X(sh) X(swl) X(sw) X(swr) X(cache) X(unknown)
+
+#define OP_ENUM(name) OP_##name,
+enum { OPS(OP_ENUM) OP_COUNT };
+#undef OP_ENUM
+
+#define OP_POINTER(name) op_##name,
+static const insn_handler op_handlers[OP_COUNT] = { OPS(OP_POINTER) };
+#undef OP_POINTER
+
+/*
+ * One flat table for all four opcode spaces: the primary opcode, then the
+ * SPECIAL function field, the REGIMM rt field and the SPECIAL2 function
+ * field, so decoding an instruction is a single lookup.
+ */
+#define OP_TABLE_SPECIAL  64
+#define OP_TABLE_REGIMM   (OP_TABLE_SPECIAL + 64)
+#define OP_TABLE_SPECIAL2 (OP_TABLE_REGIMM + 32)
+#define OP_TABLE_SIZE     (OP_TABLE_SPECIAL2 + 64)
+
+static const uint8_t op_table[OP_TABLE_SIZE] =
+{
+	[0 ... OP_TABLE_SPECIAL - 1]                  = OP_unknown,
+	[OP_TABLE_SPECIAL ... OP_TABLE_REGIMM - 1]    = OP_unknown_special,
+	[OP_TABLE_REGIMM ... OP_TABLE_SPECIAL2 - 1]   = OP_unknown_regimm,
+	[OP_TABLE_SPECIAL2 ... OP_TABLE_SIZE - 1]     = OP_unknown_special2,
+
+	[INS_J]     = OP_j,
+	[INS_JAL]   = OP_jal,
+	[INS_BEQ]   = OP_beq,
+	[INS_BNE]   = OP_bne,
+	[INS_BLEZ]  = OP_blez,
+	[INS_BGTZ]  = OP_bgtz,
+	[INS_ADDI]  = OP_addi,
+	[INS_ADDIU] = OP_addiu,
+	[INS_SLTI]  = OP_slti,
+	[INS_SLTIU] = OP_sltiu,
+	[INS_ANDI]  = OP_andi,
+	[INS_ORI]   = OP_ori,
+	[INS_XORI]  = OP_xori,
+	[INS_LUI]   = OP_lui,
+	[INS_COP0]  = OP_unknown_cop0,	/* see decode_cop0() */
+	[INS_COP1]  = OP_cop1,
+	[INS_COP2]  = OP_cop2,
+	[INS_NA1]   = OP_undefined,
+	[INS_BEQL]  = OP_beql,
+	[INS_BNEL]  = OP_bnel,
+	[INS_BLEZL] = OP_blezl,
+	[INS_BGTZL] = OP_bgtzl,
+	[INS_NA2]   = OP_undefined,
+	[INS_NA3]   = OP_undefined,
+	[INS_NA4]   = OP_undefined,
+	[INS_NA5]   = OP_undefined,
+	[INS_NA7]   = OP_undefined,
+	[INS_NA8]   = OP_undefined,
+	[INS_NA9]   = OP_undefined,
+	[INS_LB]    = OP_lb,
+	[INS_LH]    = OP_lh,
+	[INS_LWL]   = OP_lwl,
+	[INS_LW]    = OP_lw,
+	[INS_LBU]   = OP_lbu,
+	[INS_LHU]   = OP_lhu,
+	[INS_LWR]   = OP_lwr,
+	[INS_NA10]  = OP_undefined,
+	[INS_SB]    = OP_sb,
+	[INS_SH]    = OP_sh,
+	[INS_SWL]   = OP_swl,
+	[INS_SW]    = OP_sw,
+	[INS_NA11]  = OP_undefined,
+	[INS_NA12]  = OP_undefined,
+	[INS_SWR]   = OP_swr,
+	[INS_CACHE] = OP_cache,
+
+	[OP_TABLE_SPECIAL + INS_SLL]   = OP_sll,
+	[OP_TABLE_SPECIAL + INS_MOVF]  = OP_movf,
+	[OP_TABLE_SPECIAL + INS_SRL]   = OP_srl,
+	[OP_TABLE_SPECIAL + INS_SRA]   = OP_sra,
+	[OP_TABLE_SPECIAL + INS_SLLV]  = OP_sllv,
+	[OP_TABLE_SPECIAL + INS_SRLV]  = OP_srlv,
+	[OP_TABLE_SPECIAL + INS_SRAV]  = OP_srav,
+	[OP_TABLE_SPECIAL + INS_JR]    = OP_jr,
+	[OP_TABLE_SPECIAL + INS_JALR]  = OP_jalr,
+	[OP_TABLE_SPECIAL + INS_MOVZ]  = OP_movz,
+	[OP_TABLE_SPECIAL + INS_MOVN]  = OP_movn,
+	[OP_TABLE_SPECIAL + INS_MFHI]  = OP_mfhi,
+	[OP_TABLE_SPECIAL + INS_MTHI]  = OP_mthi,
+	[OP_TABLE_SPECIAL + INS_MFLO]  = OP_mflo,
+	[OP_TABLE_SPECIAL + INS_MTLO]  = OP_mtlo,
+	[OP_TABLE_SPECIAL + INS_MULT]  = OP_mult,
+	[OP_TABLE_SPECIAL + INS_MULTU] = OP_multu,
+	[OP_TABLE_SPECIAL + INS_DIV]   = OP_div,
+	[OP_TABLE_SPECIAL + INS_DIVU]  = OP_divu,
+	[OP_TABLE_SPECIAL + INS_ADD]   = OP_add,
+	[OP_TABLE_SPECIAL + INS_ADDU]  = OP_addu,
+	[OP_TABLE_SPECIAL + INS_SUB]   = OP_sub,
+	[OP_TABLE_SPECIAL + INS_SUBU]  = OP_subu,
+	[OP_TABLE_SPECIAL + INS_AND]   = OP_and,
+	[OP_TABLE_SPECIAL + INS_OR]    = OP_or,
+	[OP_TABLE_SPECIAL + INS_XOR]   = OP_xor,
+	[OP_TABLE_SPECIAL + INS_NOR]   = OP_nor,
+	[OP_TABLE_SPECIAL + INS_SLT]   = OP_slt,
+	[OP_TABLE_SPECIAL + INS_SLTU]  = OP_sltu,
+
+	[OP_TABLE_REGIMM + INS_BLTZ]   = OP_bltz,
+	[OP_TABLE_REGIMM + INS_BGEZ]   = OP_bgez,
+	[OP_TABLE_REGIMM + INS_BLTZL]  = OP_bltzl,
+	[OP_TABLE_REGIMM + INS_BGEZL]  = OP_bgezl,
+	[OP_TABLE_REGIMM + INS_BAL]    = OP_bal,
+
+	[OP_TABLE_SPECIAL2 + INS_MUL]  = OP_mul,
+};
+
+static inline uint32_t op_index(int32_t instruction)
+{
+	switch(decode_opcode(instruction))
+	{
+	case 0:    return OP_TABLE_SPECIAL + decode_special_opcode(instruction);
+	case 1:    return OP_TABLE_REGIMM + decode_special_branch_opcode(instruction);
+	case 0x1c: return OP_TABLE_SPECIAL2 + decode_special2_opcode(instruction);
+	default:   return decode_opcode(instruction);
+	}
+}
+
+static uint8_t decode_cop0(int32_t instruction)
+{
+	if( (instruction & 0x03e007f8) == 0)
+		return OP_mfc0;
+	else if( (instruction & 0x00800000) == 0x800000)
+		return OP_mtc0;
+	else if( (instruction & 0x42000002) == 0x42000002)
+		return OP_tlbwi;
+	else if( (instruction & 0x42000018) == 0x42000018)
+		return OP_eret;
+	return OP_unknown_cop0;
+}
+
+/* Constant for a constant op, so block_dispatch() tests nothing at run time */
+#define OP_LIKELY(op) ((op) == OP_beql || (op) == OP_bnel || (op) == OP_blezl || \
+		       (op) == OP_bgtzl || (op) == OP_bltzl || (op) == OP_bgezl)
+#define OP_MEMORY(op) ((op) == OP_sb || (op) == OP_sh || (op) == OP_sw || (op) == OP_swl || \
+		       (op) == OP_swr || (op) == OP_lb || (op) == OP_lh || (op) == OP_lwl || \
+		       (op) == OP_lw || (op) == OP_lbu || (op) == OP_lhu || (op) == OP_lwr)
+
+static inline uint8_t decode_flags(uint8_t op)
+{
+	switch(op)
+	{
+	case OP_beql:
+	case OP_bnel:
+	case OP_blezl:
+	case OP_bgtzl:
+	case OP_bltzl:
+	case OP_bgezl:
+		return INSN_BRANCH | INSN_LIKELY;
+	case OP_j:
+	case OP_jal:
+	case OP_jr:
+	case OP_jalr:
+	case OP_beq:
+	case OP_bne:
+	case OP_blez:
+	case OP_bgtz:
+	case OP_bltz:
+	case OP_bgez:
+	case OP_bal:
+		return INSN_BRANCH;
+	case OP_sb:
+	case OP_sh:
+	case OP_sw:
+	case OP_swl:
+	case OP_swr:
+		return INSN_STORE;
+	case OP_lb:
+	case OP_lh:
+	case OP_lwl:
+	case OP_lw:
+	case OP_lbu:
+	case OP_lhu:
+	case OP_lwr:
+		return INSN_LOAD;
+	case OP_mfc0:
+	case OP_mtc0:
+	case OP_tlbwi:
+	case OP_eret:
+	case OP_unknown_cop0:
+	case OP_unknown:
+	case OP_unknown_special:
+	case OP_unknown_regimm:
+	case OP_unknown_special2:
+	case OP_undefined:
+	case OP_movf:
+	case OP_cop1:
+	case OP_cop2:
+		return INSN_END;
+	default:
+		return 0;
+	}
+}
+
+void decode_insn(struct insn *insn, int32_t instruction, uint32_t pc)
+{
+	insn->instruction = instruction;
+	insn->rs = get_rs(instruction);
+	insn->rt = get_rt(instruction);
+	insn->rd = get_rd(instruction);
+	insn->sa = get_sa(instruction);
+	insn->im16 = get_immediate16(instruction);
+	if(decode_opcode(instruction) == INS_J || decode_opcode(instruction) == INS_JAL)
+		insn->target = get_jump_address(instruction, pc + 4);
+	else
+		insn->target = pc + 4 + ((int32_t)insn->im16 << 2);
+	insn->op = op_table[op_index(instruction)];
+	if(insn->op == OP_unknown_cop0)
+		insn->op = decode_cop0(instruction);
+	insn->handler = op_handlers[insn->op];
+	insn->flags = decode_flags(insn->op);
+}
+
+#ifdef THREADED_DISPATCH
+/*
+ * block_run() with the handlers inlined behind computed gotos: every guest
+ * instruction ends in its own indirect jump to the next one instead of
+ * returning to a shared call site. OP_HANDLER() forces the inlining and
+ * the flag tests are constants per label, so nothing is called per
+ * instruction. On test programs it runs as fast as block_interpret(), at
+ * -O0 and -O2 alike, not faster; it is kept as the base for tuning.
+ */
+uint32_t block_dispatch(struct cpu_state *cpu, struct block *b)
+{
+#define OP_LABEL(name) &&do_##name,
+	static void *const labels[OP_COUNT] = { OPS(OP_LABEL) };
+#undef OP_LABEL
+	const struct insn *insn = b->insn;
+	const struct insn *end = insn + b->count;
+
+#define DISPATCH() \
+	do { \
+		if(insn == end) \
+			goto done; \
+		if(cpu->delayed_jump) \
+		{ \
+			cpu->pc = cpu->jump_pc; \
+			cpu->delayed_jump = 0; \
+			cpu->jump_pc = 0; \
+		} \
+		else \
+			cpu->pc += 4; \
+		goto *labels[insn->op]; \
+	} while(0)
+
+	DISPATCH();
+
+#define OP_BODY(name) \
+	do_##name: \
+		op_##name(cpu, insn++); \
+		if(OP_LIKELY(OP_##name) && !cpu->delayed_jump) \
+			goto done; \
+		if(OP_MEMORY(OP_##name) && !b->valid) \
+			goto done; \
+		DISPATCH();
+	OPS(OP_BODY)
+#undef OP_BODY
+#undef DISPATCH
+
+done:
+	return insn - b->insn;
+}
+#endif /* THREADED_DISPATCH */
+
+/*
+ * The predecode cache holds one struct insn per word of RAM and flash,
+ * allocated a 4 KiB guest page at a time the first time code runs there.
+ * A page with an allocated slot array is a code page; stores into it are
+ * routed to ram_write(), which clears the slots they touch so the next fetch
+ * decodes the new word.
+ */
+const struct insn *fetch_insn(struct cpu_state *cpu, uint32_t pc)
+{
+	uint32_t page = icache_page(pc);
+	struct insn *insn;
+
+	if(!cpu->icache[page])
+	{
+		cpu->icache[page] = calloc(ICACHE_PAGE_SLOTS, sizeof(struct insn));
+		mem_update_page(cpu, pc);
+	}
+	insn = &cpu->icache[page][(pc >> 2) & (ICACHE_PAGE_SLOTS - 1)];
+	if(!insn->handler)
+		decode_insn(insn, get_instruction(cpu, pc), pc);
+	return insn;
+}
+
+void icache_flush(struct cpu_state *cpu)
+{
+	int32_t i;
+
+	for(i = 0; i < ICACHE_PAGES; i++)
+	{
+		if(!cpu->icache[i])
+			continue;
+		free(cpu->icache[i]);
+		cpu->icache[i] = NULL;
+		if(i < ICACHE_RAM_PAGES)
+			mem_update_page(cpu, RAM_START + (i << ICACHE_PAGE_SHIFT));
+	}
+	block_flush(cpu);
+}
+
+/*
+ * Recompute the UART TX-empty line and whether an interrupt is to be taken.
+ * Called whenever one of its inputs changes: an event fires, software
+ * writes Status/Cause/Count/Compare or the UART IRQ registers, or the CPU
+ * enters or leaves the handler.
+ */
+static void irq_update(struct cpu_state *cpu)
+{
+	/*
+	 * uart0 irq, tx empty as before and rx not empty, which only a PTY
+	 * sets, where unmasked. Other status bits never raise it.
+	 */
+	if( ( cpu->mach->uart0_ir >> 16 ) & cpu->mach->uart0_ir & ( UART_TXFIFOEMT | UART_RXFIFONE ) )
+	{
+		cpu->mach->irq_stat |= 4;
+		cpu->cop0[13][0] |= 1 << 10;
+	}
+	else
+	{
+		cpu->mach->irq_stat &= ~4;
+		cpu->cop0[13][0] &= ~( 1 << 10 );
+	}
+	cpu->irq_pending = ( cpu->cop0[12][0] & 0x00000001 ) &&
+		( ( cpu->cop0[13][0] & cpu->cop0[12][0] & 0x0000ff00 ) ) &&
+		( cpu->cop0[12][0] & 0x00000002 ) == 0 &&
+		!cpu->in_irq;
+}
+
+static void compare_event(struct cpu_state *cpu)
+{
+	compare_update(cpu);
+}
+
+/*
+ * The timer line is high while Count >= Compare (and Compare is set). It
+ * next changes when Count reaches Compare, or when Count wraps.
+ */
+static void compare_update(struct cpu_state *cpu)
+{
+	uint32_t count = cpu->cop0[9][0];
+	uint32_t compare = cpu->cop0[11][0];
+
+	if( count >= compare && compare > 0 )
+	{
+		/* printf("******************\ncount: %u compare: %u\n******************\n", cpu->cop0[9][0], cpu->cop0[11][0] ); */
+		cpu->cop0[13][0] |= 1 << 15;
+		sched_add(cpu, cpu->sched->now + (0x100000000ull - count), compare_event);
+	}
+	else
+	{
+		cpu->cop0[13][0] &= ~( 1 << 15 );
+		if(compare > 0)
+			sched_add(cpu, cpu->sched->now + (compare - count), compare_event);
+		else
+			sched_cancel(cpu, compare_event);
+	}
+	irq_update(cpu);
+}
+
+/* Fakes the timer status every TIMER_TICK instructions */
+static void timer_event(struct cpu_state *cpu)
+{
+	uint64_t now = cpu->sched->now;
+
+	cpu->mach->timer_int = 2;
+	sched_add(cpu, now - now % TIMER_TICK + TIMER_TICK, timer_event);
+}
+
+/*
+ * Rebuild what is derived from the registers and the device state after
+ * they were replaced wholesale by snapshot_load(): the pending events, the
+ * IRQ lines, the predecoded code and the flash mapping.
+ */
+void machine_resync(struct cpu_state *cpu)
+{
+	uint64_t now = cpu->sched->now;
+
+	sched_clear(cpu);
+	sched_add(cpu, now - now % TIMER_TICK + TIMER_TICK, timer_event);
+	compare_update(cpu);
+	icache_flush(cpu);
+	mem_map_flash(cpu);
+	symbol_schedule(cpu);
+	if(uart_input(cpu))
+		sched_add(cpu, now - now % UART_RX_POLL + UART_RX_POLL, uart0_rx_event);
+}
+
+static void take_interrupt(struct cpu_state *cpu)
+{
+	if( cpu->cop0[13][0] == 1 << 15 )
+		dtrace("0x%08x:\tirq timer (0x%08x, 0x%08x, 0x%08x)\n", cpu->pc, cpu->jump_pc, cpu->cop0[12][0], cpu->cop0[13][0]);
+	else if( cpu->cop0[13][0] == 1 << 10 )
+		dtrace("0x%08x:\tirq tx (0x%08x, 0x%08x, 0x%08x)\n", cpu->pc, cpu->jump_pc, cpu->cop0[12][0], cpu->cop0[13][0]);
+	else
+		dtrace("0x%08x:\tirq tx|timer (0x%08x, 0x%08x, 0x%08x)\n", cpu->pc, cpu->jump_pc, cpu->cop0[12][0], cpu->cop0[13][0]);
+
+	if( cpu->delayed_jump )
+	{
+		/* use epc cop0 register instead */
+		cpu->eret = cpu->pc - 4;
+		cpu->delayed_jump = 0;
+	}
+	else
+	{
+		/* use epc cop0 register instead */
+		cpu->eret = cpu->pc;
+	}
+	cpu->cop0[12][0] |= 0x00000002;
+	cpu->pc = 0x80000180;
+	cpu->in_irq = true;
+	irq_update(cpu);
+}
+
+static inline void check_interrupts(struct cpu_state *cpu)
+{
+	if(sched_due(cpu))
+		sched_run(cpu);
+	if(cpu->irq_pending)
+		take_interrupt(cpu);
+}
+
+static void step_insn(struct cpu_state *cpu)
+{
+	const struct insn *insn;
+	uint32_t pc = cpu->pc;
+
+	cpu->cop0[9][0]++;
+	cpu->sched->now++;
+	insn = fetch_insn(cpu, pc);
+	if(cpu->trace)
+		trace_insn(cpu, insn, pc);
+
+	cpu->prev_pc[0] = cpu->prev_pc[1];
+	cpu->prev_pc[1] = cpu->prev_pc[2];
+	cpu->prev_pc[2] = cpu->pc;
+	if(cpu->delayed_jump)
+	{
+		cpu->pc = cpu->jump_pc;
+		cpu->delayed_jump = 0;
+		cpu->jump_pc = 0;
+	}
+	else
+		cpu->pc += 4;
+
+	insn->handler(cpu, insn);
+	if(cpu->trace)
+		trace_commit(cpu);
+	if(cpu->prof)
+	{
+		profile_count(cpu, pc, 1);
+		if(insn->flags & INSN_BRANCH)
+			profile_branch(cpu, insn, pc);
+	}
+}
+
+static void step(struct cpu_state *cpu)
+{
+	bool prompt = !cpu->run;
+
+	cli(cpu);
+	/* the way on from here may have changed, see reverse.c */
+	if(prompt && cpu->rev)
+		reverse_point(cpu);
+	step_insn(cpu);
+}
+
+/*
+ * Fire the callbacks at pc, true if one of them moved it (hle.c returns
+ * from the routine it ran). The new pc is then a block boundary like any
+ * other: interrupts and callbacks are looked at again before it runs.
+ */
+static bool run_callbacks(struct cpu_state *cpu)
+{
+	uint32_t pc = cpu->pc;
+
+	process_callbacks(cpu);
+	return (uint32_t)cpu->pc != pc;
+}
+
+/*
+ * Blocks start with no jump pending. A stop or the end of a budget can
+ * fall between a branch and its delay slot; the slot is then stepped on
+ * its own before the next block is looked up, true if it was.
+ */
+static bool step_delay_slot(struct cpu_state *cpu)
+{
+	if(!cpu->delayed_jump)
+		return false;
+	step_insn(cpu);
+	return true;
+}
+
+void execute(struct cpu_state *cpu)
+{
+	check_interrupts(cpu);
+	while(callback_filter(cpu, cpu->pc) && run_callbacks(cpu))
+		check_interrupts(cpu);
+	step(cpu);
+}
+
+struct idle_snapshot
+{
+	int32_t reg[32];
+	int32_t HI;
+	int32_t LO;
+	uint32_t io_events;
+	uint32_t io_polls;
+};
+
+static void idle_save(struct cpu_state *cpu, struct idle_snapshot *s)
+{
+	memcpy(s->reg, cpu->reg, sizeof(s->reg));
+	s->HI = cpu->HI;
+	s->LO = cpu->LO;
+	s->io_events = cpu->io_events;
+	s->io_polls = cpu->io_polls;
+}
+
+/*
+ * A block that branched back to itself without stores, without device
+ * reads other than the polled status registers and without changing a
+ * register will spin exactly the same way until the next event fires.
+ */
+static bool idle_loop(struct cpu_state *cpu, struct block *b, struct idle_snapshot *s)
+{
+	return cpu->pc == b->pc && !cpu->irq_pending &&
+		cpu->io_events == s->io_events &&
+		cpu->HI == s->HI && cpu->LO == s->LO &&
+		!callback_filter(cpu, b->pc) &&
+		memcmp(cpu->reg, s->reg, sizeof(s->reg)) == 0;
+}
+
+/* ... and if it polls nothing and cannot be interrupted, it never ends */
+static bool idle_halted(struct cpu_state *cpu, struct idle_snapshot *s)
+{
+	return cpu->io_polls == s->io_polls &&
+		(!(cpu->cop0[12][0] & 0x00000001) || (cpu->cop0[12][0] & 0x00000002) || cpu->in_irq);
+}
+
+static void idle_forward(struct cpu_state *cpu, uint64_t limit)
+{
+	uint64_t skip = sched_skip(cpu, limit);
+
+	cpu->cop0[9][0] += skip;
+	dtrace("0x%08x:\tidle, skipped %llu cycles\n", cpu->pc, (unsigned long long)skip);
+}
+
+/* Run one block, keeping Count and the clock in step with it */
+static void run_block(struct cpu_state *cpu, struct block *b, uint64_t limit)
+{
+	struct idle_snapshot idle;
+	bool check_idle = b->idle && (cpu->idle_skip || cpu->batch);
+	uint32_t executed;
+
+	if(check_idle)
+		idle_save(cpu, &idle);
+	/* Count is read by mfc0, which can only be the last instruction */
+	cpu->cop0[9][0] += b->count;
+	cpu->sched->now += b->count;
+	if(cpu->jit && cpu->jit->enabled)
+		executed = jit_execute(cpu, b);
+	else
+		executed = block_run(cpu, b);
+	cpu->cop0[9][0] -= b->count - executed;
+	cpu->sched->now -= b->count - executed;
+	if(cpu->prof)
+	{
+		profile_count(cpu, b->pc, executed);
+		if(executed == b->count && b->count > 1 && (b->insn[b->count - 2].flags & INSN_BRANCH))
+			profile_branch(cpu, &b->insn[b->count - 2], b->pc + (b->count - 2) * 4);
+	}
+	if(check_idle && idle_loop(cpu, b, &idle))
+	{
+		if(cpu->batch && idle_halted(cpu, &idle))
+			cpu->stop = STOP_HALT;
+		else if(cpu->idle_skip)
+			idle_forward(cpu, limit);
+	}
+}
+
+/*
+ * Run a chain of basic blocks. Interrupts and callbacks are only looked at
+ * between blocks; the CLI and tracing fall back to execute() per
+ * instruction.
+ */
+void execute_block(struct cpu_state *cpu)
+{
+	struct block *b = NULL;
+	int32_t i;
+
+	for(i = 0; i < BLOCK_CHAIN_MAX; i++)
+	{
+		check_interrupts(cpu);
+		if(callback_filter(cpu, cpu->pc) && run_callbacks(cpu))
+			continue;
+		if(!cpu->run || cpu->debug || cpu->trace)
+		{
+			step(cpu);
+			return;
+		}
+		if(step_delay_slot(cpu))
+		{
+			b = NULL;
+			continue;
+		}
+
+		if(cpu->jit && cpu->jit->full)
+		{
+			block_flush(cpu);
+			b = NULL;
+		}
+		b = block_next(cpu, b);
+		run_block(cpu, b, UINT64_MAX);
+	}
+}
+
+/*
+ * Run up to budget instructions without returning to the caller, for
+ * library users that would otherwise pay for a call per block. Stops
+ * early at pc, at a bp() callback, at an unimplemented instruction or
+ * when the guest halts. Blocks that would overrun the budget or contain
+ * pc are stepped one instruction at a time, as is everything while
+ * tracing. The CLI is never entered.
+ *
+ * A breakpoint stops before the instruction at it runs; the next call
+ * resumes there without firing the callbacks again. A watchpoint stops
+ * after the instruction that hit it.
+ */
+enum stop_reason run_until(struct cpu_state *cpu, uint32_t pc, uint64_t budget)
+{
+	uint64_t end = cpu->sched->now + budget;
+	bool resume = cpu->stop == STOP_BREAKPOINT;
+	struct block *b = NULL;
+
+	cpu->batch = true;
+	cpu->stop = STOP_NONE;
+	if(cpu->rev)
+		reverse_batch(cpu, pc, end, resume);
+	while(!cpu->stop)
+	{
+		check_interrupts(cpu);
+		if((uint32_t)cpu->pc == pc)
+			cpu->stop = STOP_PC;
+		else if(cpu->sched->now >= end)
+			cpu->stop = STOP_BUDGET;
+		else if(!resume && callback_filter(cpu, cpu->pc) && run_callbacks(cpu))
+		{
+			if(cpu->stop)
 				break;
-			case INS_LWL:   /* 100010 */
+			continue;
+		}
+		resume = false;
+		if(cpu->stop)
+			break;
+		if(step_delay_slot(cpu))
+		{
+			b = NULL;
+			continue;
+		}
+
+		if(cpu->jit && cpu->jit->full)
+		{
+			block_flush(cpu);
+			b = NULL;
+		}
+		b = block_next(cpu, b);
+		if(b->count > end - cpu->sched->now || pc - b->pc < b->count * 4 || cpu->trace)
+		{
+			step_insn(cpu);
+			b = NULL;
+		}
+		else
+			run_block(cpu, b, end);
+	}
+	cpu->batch = false;
+	return cpu->stop;
+}
+
+enum stop_reason execute_n(struct cpu_state *cpu, uint64_t budget)
+{
+	return run_until(cpu, RUN_NO_PC, budget);
+}
+
+/* Hits on the ranges reverse.c watched with WATCH_COUNT so far */
+static uint32_t watch_counted(struct cpu_state *cpu)
+{
+	return cpu->watches ? cpu->watches->counted : 0;
+}
+
+/*
+ * Run a restored point in time again up to target, the way mode says
+ * execution went on from it, for reverse.c. Interrupts are taken and
+ * callbacks fired at the same boundaries as the first time, and a target
+ * within a block is reached by stepping its first instructions. Stops
+ * early at a bp() callback, before the instruction at it runs, and after
+ * the block or instruction that stored into the watched range; unit is
+ * then the clock before it. The block starting at fine is always stepped,
+ * so unit is that of the last store in it. Console output is not repeated.
+ */
+enum stop_reason rerun_until(struct cpu_state *cpu, const struct exec_mode *mode, uint64_t target, uint64_t fine, uint64_t *unit)
+{
+	bool resume = mode->resume;
+	bool debug = cpu->debug;
+	struct block *b = NULL;
+	uint32_t hits, seen, i;
+	uint64_t n, start;
+
+	cpu->batch = true;
+	cpu->rerun = true;
+	cpu->debug = false;
+	cpu->stop = STOP_NONE;
+	while(!cpu->stop)
+	{
+		*unit = cpu->sched->now;
+		if(!resume)
+		{
+			check_interrupts(cpu);
+			if(callback_filter(cpu, cpu->pc) && run_callbacks(cpu))
 			{
-				int8_t byte;
-				uint32_t word;
-				vaddr = cpu->reg[base]+(int32_t)offset;
-				byte = (vaddr & 0x03);
-				word = load_word(vaddr & 0xfffffffc, cpu->ram, cpu->flash);
-				switch(byte)
-				{
-				case 0:
-					break;
-				case 1:
-					word = (cpu->reg[rt] & 0x000000ff) | ((word & 0x00ffffff) << 8);
-					break;
-				case 2:
-					word = (cpu->reg[rt] & 0x0000ffff) | ((word & 0x0000ffff) << 16);
-					break;
-				case 3:
-					word = (cpu->reg[rt] & 0x00ffffff) | ((word & 0x000000ff) << 24);
+				if(cpu->stop)
 					break;
-				}
-				cpu->reg[rt] = word;
-				break;
+				continue;
 			}
-			case INS_LW:    /* 100011 */
-				vaddr = cpu->reg[base]+offset;
-				cpu->reg[rt] = load_word(vaddr, cpu->ram, cpu->flash);
-				break;
-			case INS_LBU:   /* 100100 */
-				vaddr = cpu->reg[base]+offset;
-				cpu->reg[rt] = (int32_t)load_byte(vaddr, cpu->ram, cpu->flash);
-				break;
-			case INS_LHU:   /* 100101 */
-				vaddr = cpu->reg[base]+offset;
-				cpu->reg[rt] = load_short(vaddr, cpu->ram, cpu->flash);
+			if(cpu->stop)
 				break;
-			case INS_LWR:   /* 100110 */
+		}
+		resume = false;
+		if(cpu->sched->now >= target)
+			break;
+
+		hits = watch_counted(cpu);
+		if(mode->stepping)
+		{
+			step_insn(cpu);
+		}
+		else if(step_delay_slot(cpu))
+		{
+			b = NULL;
+		}
+		else
+		{
+			if(cpu->jit && cpu->jit->full)
 			{
-				int8_t byte;
-				uint32_t word;
-				vaddr = cpu->reg[base]+(int32_t)offset;
-				byte = (vaddr & 0x03);
-				word = load_word(vaddr & 0xfffffffc, cpu->ram, cpu->flash);
-				switch(byte)
-				{
-				case 0:
-					word = (cpu->reg[rt] & 0xffffff00) | ((word & 0xff000000) >> 24);
-					break;
-				case 1:
-					word = (cpu->reg[rt] & 0xffff0000) | ((word & 0xffff0000) >> 16);
-					break;
-				case 2:
-					word = (cpu->reg[rt] & 0xff000000) | ((word & 0xffffff00) >> 8);
-					break;
-				case 3:
-					break;
-				}
-				cpu->reg[rt] = word;
-				break;
+				block_flush(cpu);
+				b = NULL;
 			}
-			case INS_NA10:   /* 100111 */
-				printf("\tundefined instruction na10 not implemented\n");
-				exit(1);
-				break;
-			case INS_SB:    /* 101000 */
-				vaddr = cpu->reg[base]+offset;
-				store_byte(vaddr, cpu->reg[rt], cpu->ram, cpu->flash);
-				break;
-			case INS_SH:    /* 101001 */
-				vaddr = cpu->reg[base]+offset;
-				store_short(vaddr, cpu->reg[rt], cpu->ram, cpu->flash);
-				break;
-			case INS_SWL:   /* 101010 */
+			b = block_next(cpu, b);
+			n = target - cpu->sched->now;
+			if(mode->batch && (b->count > mode->end - cpu->sched->now || mode->pc - b->pc < b->count * 4))
 			{
-				int8_t byte;
-				uint32_t word;
-				vaddr = cpu->reg[base]+(int32_t)offset;
-				byte = (vaddr & 0x03);
-				word = load_word(vaddr & 0xfffffffc, cpu->ram, cpu->flash);
-				switch(byte)
+				/* run_until() stepped it as well */
+				step_insn(cpu);
+				b = NULL;
+			}
+			else if(b->count > n || cpu->sched->now == fine)
+			{
+				for(i = 0; i < b->count && i < n; i++)
 				{
-				case 0:
-					word = cpu->reg[rt];
-					break;
-				case 1:
-					word = ((cpu->reg[rt] & 0xffffff00) >>  8) | ((word & 0xff000000));
-					break;
-				case 2:
-					word = ((cpu->reg[rt] & 0xffff0000) >> 16) | ((word & 0xffff0000));
-					break;
-				case 3:
-					word = ((cpu->reg[rt] & 0xff000000) >> 24) | ((word & 0xffffff00));
-					break;
+					seen = watch_counted(cpu);
+					start = cpu->sched->now;
+					step_insn(cpu);
+					if(watch_counted(cpu) != seen)
+						*unit = start;
 				}
-				store_word(vaddr & 0xfffffffc, word, cpu->ram, cpu->flash);
-				break;
+				b = NULL;
+				if(watch_counted(cpu) != hits)
+					cpu->stop = STOP_WATCH;
+				else if(cpu->sched->now >= target)
+					break;
+				continue;
 			}
-			case INS_SW:    /* 101011 */
-				vaddr = cpu->reg[base]+offset;
-				store_word(vaddr, cpu->reg[rt], cpu->ram, cpu->flash);
-				break;
-			case INS_NA11:   /* 101100 */
-				printf("\tundefined instruction na11 not implemented\n");
-				exit(1);
-				break;
-			case INS_NA12:   /* 101101 */
-				printf("\tundefined instruction na12 not implemented\n");
-				exit(1);
-				break;
-			case INS_SWR:   /* 101110 */
+			else
 			{
-				int8_t byte;
-				uint32_t word;
-				vaddr = cpu->reg[base]+(int32_t)offset;
-				byte = (vaddr & 0x03);
-				word = load_word(vaddr & 0xfffffffc, cpu->ram, cpu->flash);
-				switch(byte)
+				run_block(cpu, b, target);
+				/* without run_until() the loop was skipped over or spun on */
+				if(cpu->stop == STOP_HALT && !mode->batch)
 				{
-				case 0:
-					word = ((cpu->reg[rt] & 0x000000ff) << 24) | (word & 0x00ffffff);
-					break;
-				case 1:
-					word = ((cpu->reg[rt] & 0x0000ffff) << 16) | (word & 0x0000ffff);
-					break;
-				case 2:
-					word = ((cpu->reg[rt] & 0x00ffffff) <<  8) | (word & 0x000000ff);
-					break;
-				case 3:
-					word = cpu->reg[rt];
-					break;
+					cpu->stop = STOP_NONE;
+					if(cpu->idle_skip)
+						idle_forward(cpu, target);
 				}
-				store_word(vaddr & 0xfffffffc, word, cpu->ram, cpu->flash);
-				break;
-			}
-			case INS_CACHE: /* 101111 */
-				/* don't handle at the moment */
-				break;
-			default:
-				printf("\nunknown instruction at 0x%x opcode(0x%x)\n",
-					   cpu->pc-4, decode_opcode(instruction));
-				exit(0);
 			}
 		}
-		count++;
-
-		if(count % 10000000 == 0)
-			timer_int = 2;
-		cpu->cop0[9][10]++; /* Count register */
+		if(watch_counted(cpu) != hits && !cpu->stop)
+			cpu->stop = STOP_WATCH;
+	}
+	cpu->debug = debug;
+	cpu->rerun = false;
+	cpu->batch = false;
+	return cpu->stop;
 }
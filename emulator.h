@@ -12,13 +12,72 @@
 #define REG_START   0xfffe0000
 #define REG_END     0xffffffff
 
+#define ICACHE_PAGE_SHIFT 12
+#define ICACHE_PAGE_SLOTS (1 << (ICACHE_PAGE_SHIFT - 2))
+#define ICACHE_RAM_PAGES  (RAM_SIZE >> ICACHE_PAGE_SHIFT)
+#define ICACHE_PAGES      ((RAM_SIZE + FLASH_SIZE) >> ICACHE_PAGE_SHIFT)
+
 struct cpu_state;
+struct insn;
+struct block_cache;
+struct jit_state;
+struct callback_table;
+struct scheduler;
+struct machine;
+struct mem_dirty;
+struct mem_watches;
+struct recorder;
+struct reverse;
+struct tracer;
+struct profiler;
+struct uart;
+struct symtab;
+
+typedef void (*insn_handler)(struct cpu_state *cpu, const struct insn *insn);
+
+#define INSN_BRANCH 0x01	/* followed by a delay slot */
+#define INSN_LIKELY 0x02	/* delay slot nullified when not taken */
+#define INSN_STORE  0x04
+#define INSN_END    0x08	/* interrupts must be checked after it */
+#define INSN_LOAD   0x10
+
+/* Why execute_n()/run_until() returned */
+enum stop_reason
+{
+	STOP_NONE = 0,
+	STOP_BUDGET,		/* ran the whole budget */
+	STOP_PC,		/* reached the run_until() address */
+	STOP_BREAKPOINT,	/* a bp() callback fired, pc is at it */
+	STOP_UNKNOWN_INSN,	/* unimplemented instruction, pc is past it */
+	STOP_HALT,		/* spinning with interrupts off, nothing wakes it */
+	STOP_WATCH,		/* an access hit a watchpoint, see mem_watch_add() */
+};
 
-struct callback
+#define RUN_NO_PC 0xffffffff	/* never a valid pc */
+
+/* How execution went on from a point in time, so rerun_until() can repeat it */
+struct exec_mode
+{
+	bool batch;		/* inside run_until() with these end and pc */
+	bool stepping;		/* execute() or the CLI, one instruction at a time */
+	bool resume;		/* interrupts and callbacks at pc were handled already */
+	uint32_t pc;
+	uint64_t end;
+};
+
+/* A predecoded instruction, see fetch_insn() */
+struct insn
 {
-	struct callback* next;
-	uint32_t address;
-	void(*callback)(struct cpu_state *);
+	insn_handler handler;
+	int32_t instruction;
+	uint32_t target;	/* branch/jump destination */
+	int16_t im16;		/* also the load/store offset */
+	uint8_t rs;		/* also the load/store base */
+	uint8_t rt;
+	uint8_t rd;
+	uint8_t sa;
+	uint8_t flags;
+	uint8_t op;		/* index into the handler table */
 };
 
 struct cpu_state
@@ -32,24 +91,73 @@ struct cpu_state
 	int32_t jump_pc;
 	int32_t eret;
 	bool in_irq;
-	struct callback *callbacks;
+	bool irq_pending;	/* an interrupt is taken at the next boundary */
+	uint32_t io_events;	/* device accesses that may have side effects */
+	uint32_t io_polls;	/* reads of the polled status registers */
+	bool batch;		/* inside run_until(), handlers stop instead of exiting */
+	enum stop_reason stop;
+	struct callback_table *callbacks;
 	int8_t *ram;
 	int8_t *flash;
+	int8_t **mem_read;	/* see mem.h */
+	int8_t **mem_write;
+	int8_t **mem_host;
+	uint8_t *mem_type;
+	struct mem_dirty *dirty;	/* NULL while stores are not tracked */
+	struct mem_watches *watches;	/* NULL while no watchpoint is set */
+	char *checkpoint;	/* snapshot the dirty pages are relative to */
 	int32_t cop0[32][10];
+	struct insn **icache;
+	struct block_cache *blocks;
+	struct jit_state *jit;
+	struct scheduler *sched;
+	struct machine *mach;	/* device state, see emulator.c */
+	struct recorder *rec;	/* NULL unless recording or replaying inputs */
+	struct reverse *rev;	/* NULL unless keeping history, see reverse.c */
+	struct tracer *trace;	/* NULL unless tracing, see trace.c */
+	struct profiler *prof;	/* NULL unless profiling, see profile.c */
+	struct symtab *syms;	/* NULL until symbols are loaded or wanted */
+	struct uart *uart;	/* NULL until uart0 is used, see uart.c */
+	bool rerun;		/* repeating history, console output is not printed again */
+	bool debug;
+	bool run;
+	bool do_step;
+	bool idle_skip;		/* fast-forward idle loops, see execute_block() */
+	bool hle;		/* run memcpy() and friends natively, see hle.c */
 };
 
+/* the board run by main.c and main.py, others can be set up alongside */
 extern struct cpu_state cpu;
-extern bool debug;
-extern bool run;
-extern bool do_step;
 
 void initialize_emulator(struct cpu_state *cpu, char *firmware_file);
 void initialize_cpu(struct cpu_state *cpu, int32_t start_address);
-void register_callbacks(void);
+static inline uint32_t icache_page(uint32_t pc)
+{
+	if(pc >= RAM_START && pc < RAM_END)
+		return (pc - RAM_START) >> ICACHE_PAGE_SHIFT;
+	else if(pc >= FLASH_START && pc < FLASH_END)
+		return ICACHE_RAM_PAGES + ((pc - FLASH_START) >> ICACHE_PAGE_SHIFT);
+	exit(1);
+}
+
+void register_callbacks(struct cpu_state *cpu);
 void register_callback(struct cpu_state *cpu, uint32_t address, void(*callback)(struct cpu_state *));
+void unregister_callback(struct cpu_state *cpu, uint32_t address, void(*callback)(struct cpu_state *));
+void process_callbacks(struct cpu_state *cpu);
 void bp(struct cpu_state *cpu);
 void instlog(struct cpu_state *cpu);
 void execute(struct cpu_state *cpu);
+void execute_block(struct cpu_state *cpu);
+enum stop_reason execute_n(struct cpu_state *cpu, uint64_t budget);
+enum stop_reason rerun_until(struct cpu_state *cpu, const struct exec_mode *mode, uint64_t target, uint64_t fine, uint64_t *unit);
+enum stop_reason run_until(struct cpu_state *cpu, uint32_t pc, uint64_t budget);
+uint32_t decode_opcode(uint32_t instruction);
+uint32_t decode_special_opcode(uint32_t instruction);
+uint32_t decode_special2_opcode(uint32_t instruction);
+uint32_t decode_special_branch_opcode(uint32_t instruction);
+void decode_insn(struct insn *insn, int32_t instruction, uint32_t pc);
+const struct insn *fetch_insn(struct cpu_state *cpu, uint32_t pc);
+void icache_flush(struct cpu_state *cpu);
 
 void print_string(struct cpu_state *cpu);
 void printf_string(struct cpu_state *cpu);
@@ -0,0 +1,133 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "scheduler.h"
+#include "forkserver.h"
+#include "uart.h"
+
+static bool read_full(int32_t fd, void *buf, size_t size)
+{
+	ssize_t n;
+
+	while(size)
+	{
+		n = read(fd, buf, size);
+		if(n <= 0)
+			return false;
+		buf = (int8_t *)buf + n;
+		size -= n;
+	}
+	return true;
+}
+
+static void send_result(int32_t fd, uint32_t event, int32_t pid, int32_t status)
+{
+	struct fork_result r;
+
+	memset(&r, 0, sizeof(r));
+	r.event = event;
+	r.pid = pid;
+	r.status = status;
+	write(fd, &r, sizeof(r));
+}
+
+/* Runs in the child: everything the server had is shared copy-on-write */
+static void fork_child(struct cpu_state *cpu, int32_t ctl_fd, int32_t result_fd,
+		       fork_setup_fn setup, const struct fork_request *req, const uint8_t *input)
+{
+	struct fork_result r;
+
+	close(ctl_fd);
+	if(setup)
+		setup(cpu, input, req->size);
+
+	memset(&r, 0, sizeof(r));
+	r.event = FORK_DONE;
+	r.pid = getpid();
+	r.stop = run_until(cpu, req->pc, req->budget);
+	r.pc = cpu->pc;
+	r.now = cpu->sched->now;
+	/* _exit() runs no atexit() handlers to write out what is buffered */
+	uart_flush(cpu);
+	fflush(stdout);
+	write(result_fd, &r, sizeof(r));
+	_exit(0);
+}
+
+/* Report children that died without sending FORK_DONE */
+static void fork_reap(int32_t result_fd, int32_t flags)
+{
+	int32_t status;
+	pid_t pid;
+
+	while((pid = waitpid(-1, &status, flags)) > 0)
+	{
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			send_result(result_fd, FORK_CRASHED, pid, status);
+	}
+}
+
+/*
+ * Serve runs from the current machine state, usually a booted system or a
+ * restored snapshot. Every FORK_RUN forks a child that shares RAM, flash
+ * and the decoded code with the server copy-on-write, lets setup apply the
+ * request's input, runs run_until() and reports through result_fd. Children
+ * run in parallel and their results carry their pid; a FORK_DONE can arrive
+ * before the matching FORK_STARTED. Returns on FORK_QUIT or when the
+ * control pipe is closed.
+ */
+void forkserver(struct cpu_state *cpu, int32_t ctl_fd, int32_t result_fd, fork_setup_fn setup)
+{
+	struct fork_request req;
+	uint8_t *input = malloc(FORK_INPUT_MAX);
+	pid_t pid;
+
+	while(read_full(ctl_fd, &req, sizeof(req)))
+	{
+		fork_reap(result_fd, WNOHANG);
+		switch(req.cmd)
+		{
+		case FORK_RUN:
+			if(req.size > FORK_INPUT_MAX || !read_full(ctl_fd, input, req.size))
+			{
+				printf("forkserver: bad input size %u\n", req.size);
+				exit(1);
+			}
+			/* or the child prints the server's pending output again */
+			fflush(stdout);
+			pid = fork();
+			if(pid == 0)
+				fork_child(cpu, ctl_fd, result_fd, setup, &req, input);
+			if(pid < 0)
+			{
+				printf("forkserver: fork failed\n");
+				exit(1);
+			}
+			send_result(result_fd, FORK_STARTED, pid, 0);
+			break;
+		case FORK_KILL:
+			if(req.pid > 0)
+				kill(req.pid, SIGKILL);
+			break;
+		case FORK_WAIT:
+			fork_reap(result_fd, 0);
+			send_result(result_fd, FORK_IDLE, 0, 0);
+			break;
+		case FORK_QUIT:
+			free(input);
+			return;
+		default:
+			printf("forkserver: unknown command %u\n", req.cmd);
+			exit(1);
+		}
+	}
+	free(input);
+}
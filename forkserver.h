@@ -0,0 +1,49 @@
+#ifndef _FORKSERVER_H_
+#define _FORKSERVER_H_
+
+#define FORK_INPUT_MAX (1 << 20)
+
+enum fork_cmd
+{
+	FORK_RUN = 1,	/* fork a child and run_until() in it */
+	FORK_KILL,	/* kill the child in pid */
+	FORK_WAIT,	/* reap every child, then answer FORK_IDLE */
+	FORK_QUIT,	/* return from forkserver() */
+};
+
+enum fork_event
+{
+	FORK_STARTED = 1,	/* a FORK_RUN child is running */
+	FORK_DONE,		/* a child finished its run */
+	FORK_CRASHED,		/* a child died without finishing, see status */
+	FORK_IDLE,		/* FORK_WAIT found no child left */
+};
+
+/* Written to the control pipe, followed by size bytes of input */
+struct fork_request
+{
+	uint32_t cmd;
+	int32_t pid;		/* FORK_KILL */
+	uint32_t pc;		/* FORK_RUN: run_until() arguments */
+	uint32_t size;
+	uint64_t budget;
+};
+
+/* Read from the result pipe, small enough to be written atomically */
+struct fork_result
+{
+	uint32_t event;
+	int32_t pid;
+	int32_t status;		/* FORK_CRASHED: waitpid() status */
+	uint32_t stop;		/* FORK_DONE: enum stop_reason */
+	uint32_t pc;
+	uint32_t pad;
+	uint64_t now;		/* scheduler clock when the child stopped */
+};
+
+/* Prepares a child before it runs, e.g. patches RAM from the input */
+typedef void (*fork_setup_fn)(struct cpu_state *cpu, const uint8_t *input, uint32_t size);
+
+void forkserver(struct cpu_state *cpu, int32_t ctl_fd, int32_t result_fd, fork_setup_fn setup);
+
+#endif /* _FORKSERVER_H_ */
@@ -0,0 +1,867 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "machine.h"
+#include "mem.h"
+#include "reverse.h"
+#include "gdbstub.h"
+
+/*
+ * GDB remote serial protocol, spoken to one debugger over TCP. While gdb
+ * has the target stopped the emulator waits here for packets; c and s
+ * run it through run_until(), a slice at a time so a ^C gets through.
+ * Breakpoints are ordinary callbacks and watchpoints those of
+ * mem_watch_add(), so neither costs anything until it is hit.
+ */
+
+#define GDB_REGS 72	/* r0-r31, status, lo, hi, badvaddr, cause, pc, f0-f31, fcsr, fir */
+
+struct gdb_break
+{
+	uint32_t address;
+	uint32_t type;		/* 0 software, 1 hardware */
+};
+
+struct gdb_watch
+{
+	uint32_t address;	/* as gdb sent it, maybe in kseg1 */
+	uint32_t size;
+	uint32_t type;		/* 2 write, 3 read, 4 access */
+};
+
+struct gdb
+{
+	struct cpu_state *cpu;
+	int32_t fd;
+	bool ack;		/* until QStartNoAckMode */
+	uint32_t len;		/* received and not yet parsed */
+	uint32_t pos;
+	uint8_t in[4096];
+	char pkt[GDB_PACKET_MAX + 1];
+	char out[GDB_PACKET_MAX + 1];
+	char frame[GDB_PACKET_MAX + 4];
+	struct gdb_break *breaks;
+	uint32_t break_count;
+	uint32_t break_size;
+	struct gdb_watch watches[WATCH_MAX];
+	uint32_t watch_count;
+};
+
+static const uint32_t watch_types[5] = { 0, 0, WATCH_WRITE, WATCH_READ, WATCH_ACCESS };
+static const char *const watch_names[5] = { "", "", "watch", "rwatch", "awatch" };
+
+static const char hex_chars[] = "0123456789abcdef";
+
+static const char target_xml[] =
+	"<?xml version=\"1.0\"?>"
+	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+	"<target version=\"1.0\">"
+	"<architecture>mips</architecture>"
+	"<feature name=\"org.gnu.gdb.mips.cpu\">"
+	"<reg name=\"r0\" bitsize=\"32\" regnum=\"0\"/>"
+	"<reg name=\"r1\" bitsize=\"32\"/><reg name=\"r2\" bitsize=\"32\"/>"
+	"<reg name=\"r3\" bitsize=\"32\"/><reg name=\"r4\" bitsize=\"32\"/>"
+	"<reg name=\"r5\" bitsize=\"32\"/><reg name=\"r6\" bitsize=\"32\"/>"
+	"<reg name=\"r7\" bitsize=\"32\"/><reg name=\"r8\" bitsize=\"32\"/>"
+	"<reg name=\"r9\" bitsize=\"32\"/><reg name=\"r10\" bitsize=\"32\"/>"
+	"<reg name=\"r11\" bitsize=\"32\"/><reg name=\"r12\" bitsize=\"32\"/>"
+	"<reg name=\"r13\" bitsize=\"32\"/><reg name=\"r14\" bitsize=\"32\"/>"
+	"<reg name=\"r15\" bitsize=\"32\"/><reg name=\"r16\" bitsize=\"32\"/>"
+	"<reg name=\"r17\" bitsize=\"32\"/><reg name=\"r18\" bitsize=\"32\"/>"
+	"<reg name=\"r19\" bitsize=\"32\"/><reg name=\"r20\" bitsize=\"32\"/>"
+	"<reg name=\"r21\" bitsize=\"32\"/><reg name=\"r22\" bitsize=\"32\"/>"
+	"<reg name=\"r23\" bitsize=\"32\"/><reg name=\"r24\" bitsize=\"32\"/>"
+	"<reg name=\"r25\" bitsize=\"32\"/><reg name=\"r26\" bitsize=\"32\"/>"
+	"<reg name=\"r27\" bitsize=\"32\"/><reg name=\"r28\" bitsize=\"32\"/>"
+	"<reg name=\"r29\" bitsize=\"32\"/><reg name=\"r30\" bitsize=\"32\"/>"
+	"<reg name=\"r31\" bitsize=\"32\"/>"
+	"<reg name=\"lo\" bitsize=\"32\" regnum=\"33\"/>"
+	"<reg name=\"hi\" bitsize=\"32\" regnum=\"34\"/>"
+	"<reg name=\"pc\" bitsize=\"32\" regnum=\"37\"/>"
+	"</feature>"
+	"<feature name=\"org.gnu.gdb.mips.cp0\">"
+	"<reg name=\"status\" bitsize=\"32\" regnum=\"32\"/>"
+	"<reg name=\"badvaddr\" bitsize=\"32\" regnum=\"35\"/>"
+	"<reg name=\"cause\" bitsize=\"32\" regnum=\"36\"/>"
+	"</feature>"
+	"<feature name=\"org.gnu.gdb.mips.fpu\">"
+	"<reg name=\"f0\" bitsize=\"32\" type=\"ieee_single\" regnum=\"38\"/>"
+	"<reg name=\"f1\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f2\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f3\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f4\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f5\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f6\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f7\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f8\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f9\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f10\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f11\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f12\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f13\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f14\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f15\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f16\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f17\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f18\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f19\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f20\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f21\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f22\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f23\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f24\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f25\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f26\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f27\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f28\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f29\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f30\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"f31\" bitsize=\"32\" type=\"ieee_single\"/>"
+	"<reg name=\"fcsr\" bitsize=\"32\" group=\"float\"/>"
+	"<reg name=\"fir\" bitsize=\"32\" group=\"float\"/>"
+	"</feature>"
+	"</target>";
+
+static int32_t hex_digit(int32_t c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Parse a hex number at *p and move past it */
+static uint32_t hex_parse(const char **p)
+{
+	uint32_t val = 0;
+
+	while(hex_digit(**p) >= 0)
+		val = val << 4 | hex_digit(*(*p)++);
+	return val;
+}
+
+static int32_t gdb_getc(struct gdb *g)
+{
+	ssize_t n;
+
+	if(g->pos == g->len)
+	{
+		n = read(g->fd, g->in, sizeof(g->in));
+		if(n <= 0)
+			return -1;
+		g->len = n;
+		g->pos = 0;
+	}
+	return g->in[g->pos++];
+}
+
+static bool gdb_write(struct gdb *g, const char *buf, size_t size)
+{
+	ssize_t n;
+
+	while(size)
+	{
+		n = write(g->fd, buf, size);
+		if(n <= 0)
+			return false;
+		buf += n;
+		size -= n;
+	}
+	return true;
+}
+
+/* Send one packet, again until it is acknowledged */
+static bool gdb_send(struct gdb *g, const char *data)
+{
+	size_t size = strlen(data);
+	uint8_t sum = 0;
+	int32_t c;
+	size_t i;
+
+	g->frame[0] = '$';
+	for(i = 0; i < size; i++)
+	{
+		g->frame[i + 1] = data[i];
+		sum += data[i];
+	}
+	g->frame[size + 1] = '#';
+	g->frame[size + 2] = hex_chars[sum >> 4];
+	g->frame[size + 3] = hex_chars[sum & 15];
+	for(;;)
+	{
+		if(!gdb_write(g, g->frame, size + 4))
+			return false;
+		if(!g->ack)
+			return true;
+		while((c = gdb_getc(g)) != '+' && c != '-')
+		{
+			if(c < 0)
+				return false;
+		}
+		if(c == '+')
+			return true;
+	}
+}
+
+/* Wait for the next packet, its data ends up NUL terminated in pkt */
+static bool gdb_recv(struct gdb *g)
+{
+	uint32_t len;
+	uint8_t sum;
+	int32_t c, hi, lo;
+
+	for(;;)
+	{
+		/* acks and ^C outside of a run are dropped */
+		while((c = gdb_getc(g)) != '$')
+		{
+			if(c < 0)
+				return false;
+		}
+		len = 0;
+		sum = 0;
+		while((c = gdb_getc(g)) >= 0 && c != '#')
+		{
+			sum += c;
+			if(len < GDB_PACKET_MAX)
+				g->pkt[len++] = c;
+		}
+		hi = gdb_getc(g);
+		lo = gdb_getc(g);
+		if(c < 0 || hi < 0 || lo < 0)
+			return false;
+		g->pkt[len] = 0;
+		if(!g->ack)
+			return true;
+		if(hex_digit(hi) << 4 == (sum & 0xf0) && hex_digit(lo) == (sum & 15))
+			return gdb_write(g, "+", 1);
+		if(!gdb_write(g, "-", 1))
+			return false;
+	}
+}
+
+/*
+ * A ^C arrived, or the debugger went away, while the target runs. With
+ * wait, as for a halted machine, nothing else can happen until it does.
+ */
+static bool gdb_interrupted(struct gdb *g, bool wait)
+{
+	struct pollfd pfd = { .fd = g->fd, .events = POLLIN };
+	int32_t c;
+
+	while(g->pos < g->len || poll(&pfd, 1, wait ? -1 : 0) == 1)
+	{
+		c = gdb_getc(g);
+		if(c < 0 || c == 0x03)
+			return true;
+	}
+	return false;
+}
+
+static bool gdb_reg(struct cpu_state *cpu, uint32_t n, uint32_t *val)
+{
+	if(n < 32)
+	{
+		*val = cpu->reg[n];
+		return true;
+	}
+	switch(n)
+	{
+	case 32:
+		*val = cpu->cop0[12][0];
+		break;
+	case 33:
+		*val = cpu->LO;
+		break;
+	case 34:
+		*val = cpu->HI;
+		break;
+	case 35:
+		*val = cpu->cop0[8][0];
+		break;
+	case 36:
+		*val = cpu->cop0[13][0];
+		break;
+	case 37:
+		*val = cpu->pc;
+		break;
+	default:
+		/* there is no FPU */
+		return false;
+	}
+	return true;
+}
+
+static void gdb_set_reg(struct cpu_state *cpu, uint32_t n, uint32_t val)
+{
+	if(n > 0 && n < 32)
+	{
+		cpu->reg[n] = val;
+		return;
+	}
+	switch(n)
+	{
+	case 32:
+		cpu->cop0[12][0] = val;
+		machine_resync(cpu);
+		break;
+	case 33:
+		cpu->LO = val;
+		break;
+	case 34:
+		cpu->HI = val;
+		break;
+	case 35:
+		cpu->cop0[8][0] = val;
+		break;
+	case 36:
+		cpu->cop0[13][0] = val;
+		machine_resync(cpu);
+		break;
+	case 37:
+		/* a new pc leaves the branch it was in, and any breakpoint at it armed */
+		cpu->pc = val;
+		cpu->delayed_jump = 0;
+		cpu->stop = STOP_NONE;
+		break;
+	}
+}
+
+static void gdb_put_reg(char *out, struct cpu_state *cpu, uint32_t n)
+{
+	uint32_t val;
+
+	if(gdb_reg(cpu, n, &val))
+		sprintf(out, "%08x", val);
+	else
+		strcpy(out, "xxxxxxxx");
+}
+
+/* Read straight from the RAM and flash pages; stops at anything else */
+static uint32_t gdb_read_mem(struct cpu_state *cpu, uint32_t addr, uint32_t size, char *out)
+{
+	uint32_t page, n, i = 0, j;
+	int8_t *host;
+	uint8_t b;
+
+	while(i < size)
+	{
+		page = (addr + i) >> MEM_PAGE_SHIFT;
+		host = cpu->mem_host[page];
+		if(!host || (cpu->mem_type[page] != MEM_RAM && cpu->mem_type[page] != MEM_FLASH))
+			break;
+		n = MEM_PAGE_SIZE - ((addr + i) & MEM_PAGE_MASK);
+		if(n > size - i)
+			n = size - i;
+		for(j = i; j < i + n; j++)
+		{
+			b = host[MEM_ADDR8((addr + j) & MEM_PAGE_MASK)];
+			out[j * 2] = hex_chars[b >> 4];
+			out[j * 2 + 1] = hex_chars[b & 15];
+		}
+		i += n;
+	}
+	out[i * 2] = 0;
+	return i;
+}
+
+/* Only RAM is written, through the stores so predecoded code follows */
+static bool gdb_write_mem(struct cpu_state *cpu, uint32_t addr, uint32_t size, const char *hex)
+{
+	struct mem_watches *mw;
+	uint32_t i;
+
+	for(i = 0; i < size; i++)
+	{
+		if(cpu->mem_type[(addr + i) >> MEM_PAGE_SHIFT] != MEM_RAM ||
+		   hex_digit(hex[i * 2]) < 0 || hex_digit(hex[i * 2 + 1]) < 0)
+			return false;
+	}
+	/* the debugger's own stores do not hit its watchpoints */
+	mw = cpu->watches;
+	cpu->watches = NULL;
+	for(i = 0; i < size; i++)
+		store_byte(cpu, addr + i, hex_digit(hex[i * 2]) << 4 | hex_digit(hex[i * 2 + 1]));
+	cpu->watches = mw;
+	return true;
+}
+
+static void gdb_break(struct cpu_state *cpu)
+{
+	bp(cpu);
+}
+
+static struct gdb_break *gdb_find_break(struct gdb *g, uint32_t address)
+{
+	uint32_t i;
+
+	for(i = 0; i < g->break_count; i++)
+	{
+		if(g->breaks[i].address == address)
+			return &g->breaks[i];
+	}
+	return NULL;
+}
+
+/* Z and z packets: type,addr,kind */
+static const char *gdb_breakpoint(struct gdb *g, bool insert)
+{
+	struct cpu_state *cpu = g->cpu;
+	const char *p = g->pkt + 1;
+	struct gdb_break *b;
+	uint32_t type, addr, size, i;
+
+	type = hex_parse(&p);
+	if(*p++ != ',')
+		return "E01";
+	addr = hex_parse(&p);
+	if(*p++ != ',')
+		return "E01";
+	size = hex_parse(&p);
+
+	switch(type)
+	{
+	case 0:
+	case 1:
+		b = gdb_find_break(g, addr);
+		if(insert && !b)
+		{
+			if(g->break_count == g->break_size)
+			{
+				g->break_size = g->break_size ? g->break_size * 2 : 16;
+				g->breaks = realloc(g->breaks, g->break_size * sizeof(struct gdb_break));
+			}
+			g->breaks[g->break_count].address = addr;
+			g->breaks[g->break_count].type = type;
+			g->break_count++;
+			register_callback(cpu, addr, gdb_break);
+		}
+		else if(!insert && b)
+		{
+			*b = g->breaks[--g->break_count];
+			unregister_callback(cpu, addr, gdb_break);
+		}
+		return "OK";
+	case 2:
+	case 3:
+	case 4:
+		for(i = 0; i < g->watch_count; i++)
+		{
+			if(g->watches[i].address == addr && g->watches[i].size == size && g->watches[i].type == type)
+				break;
+		}
+		if(!insert)
+		{
+			if(i < g->watch_count)
+			{
+				g->watches[i] = g->watches[--g->watch_count];
+				mem_watch_remove(cpu, addr, size, watch_types[type]);
+			}
+			return "OK";
+		}
+		if(i < g->watch_count)
+			return "OK";
+		if(g->watch_count == WATCH_MAX || !mem_watch_add(cpu, addr, size, watch_types[type]))
+			return "E01";
+		g->watches[g->watch_count].address = addr;
+		g->watches[g->watch_count].size = size;
+		g->watches[g->watch_count].type = type;
+		g->watch_count++;
+		return "OK";
+	}
+	return "";
+}
+
+/* The watchpoint of gdb's the last hit was on */
+static struct gdb_watch *gdb_find_watch(struct gdb *g, uint32_t hit, uint32_t hit_type)
+{
+	struct gdb_watch *w;
+	uint32_t i, start;
+
+	for(i = 0; i < g->watch_count; i++)
+	{
+		w = &g->watches[i];
+		start = mem_kseg0(w->address);
+		if((watch_types[w->type] & hit_type) && hit >= start && hit - start < w->size)
+			return w;
+	}
+	return NULL;
+}
+
+static void gdb_stop_reply(struct gdb *g, enum stop_reason stop)
+{
+	struct cpu_state *cpu = g->cpu;
+	struct gdb_break *b;
+	struct gdb_watch *w = NULL;
+	char *out = g->out;
+
+	switch(stop)
+	{
+	case STOP_BREAKPOINT:
+		b = gdb_find_break(g, cpu->pc);
+		if(b && b->type == 1)
+			out += sprintf(out, "T05hwbreak:;");
+		else
+			out += sprintf(out, "T05swbreak:;");
+		break;
+	case STOP_WATCH:
+		if(cpu->watches)
+			w = gdb_find_watch(g, cpu->watches->hit, cpu->watches->hit_type);
+		if(w)
+			out += sprintf(out, "T05%s:%08x;", watch_names[w->type],
+				       w->address + (cpu->watches->hit - mem_kseg0(w->address)));
+		else
+			out += sprintf(out, "T05");
+		break;
+	case STOP_UNKNOWN_INSN:
+		out += sprintf(out, "T04");
+		break;
+	case STOP_NONE:
+		/* interrupted */
+		out += sprintf(out, "T02");
+		break;
+	default:
+		out += sprintf(out, "T05");
+		break;
+	}
+	/* spare gdb fetching the registers it looks at first */
+	sprintf(out, "1d:%08x;25:%08x;", cpu->reg[29], cpu->pc);
+}
+
+/* c and s, with an optional address to resume at */
+static void gdb_resume(struct gdb *g, bool step)
+{
+	struct cpu_state *cpu = g->cpu;
+	const char *p = g->pkt + 1;
+	enum stop_reason stop;
+
+	if(*p)
+		gdb_set_reg(cpu, 37, hex_parse(&p));
+	if(step)
+	{
+		stop = run_until(cpu, RUN_NO_PC, 1);
+	}
+	else
+	{
+		while((stop = run_until(cpu, RUN_NO_PC, GDB_SLICE)) == STOP_BUDGET || stop == STOP_HALT)
+		{
+			if(gdb_interrupted(g, stop == STOP_HALT))
+			{
+				stop = STOP_NONE;
+				break;
+			}
+		}
+	}
+	gdb_stop_reply(g, stop);
+}
+
+/*
+ * bs and bc, on the history kept by reverse.c. History only knows about
+ * stores, so bc goes back to a breakpoint or the first write or access
+ * watchpoint on RAM; read watchpoints are not looked for.
+ */
+static void gdb_reverse(struct gdb *g, bool step)
+{
+	struct cpu_state *cpu = g->cpu;
+	struct gdb_watch *w = NULL;
+	uint32_t i, offset;
+	bool ok;
+
+	if(!cpu->rev)
+	{
+		strcpy(g->out, "E01");
+		return;
+	}
+	for(i = 0; i < g->watch_count && !w; i++)
+	{
+		offset = mem_kseg0(g->watches[i].address) - RAM_START;
+		if((watch_types[g->watches[i].type] & WATCH_WRITE) &&
+		   offset < RAM_SIZE && g->watches[i].size <= RAM_SIZE - offset)
+			w = &g->watches[i];
+	}
+	if(step)
+		ok = reverse_stepi(cpu, 1);
+	else if(w)
+		ok = reverse_continue(cpu, w->address, w->size);
+	else
+		ok = reverse_continue(cpu, 0, 0);
+	if(!ok)
+	{
+		strcpy(g->out, "T05replaylog:begin;");
+	}
+	else if(cpu->stop == STOP_BREAKPOINT)
+	{
+		gdb_stop_reply(g, STOP_BREAKPOINT);
+	}
+	else if(!step && w)
+	{
+		cpu->watches->hit = mem_kseg0(w->address);
+		cpu->watches->hit_type = WATCH_WRITE;
+		gdb_stop_reply(g, STOP_WATCH);
+	}
+	else
+	{
+		gdb_stop_reply(g, STOP_BUDGET);
+	}
+}
+
+/* qXfer:features:read:annex:offset,length */
+static void gdb_xfer(struct gdb *g)
+{
+	const char *p = g->pkt + strlen("qXfer:features:read:");
+	uint32_t offset, size, total = sizeof(target_xml) - 1;
+
+	if(strncmp(p, "target.xml:", strlen("target.xml:")) != 0)
+	{
+		strcpy(g->out, "E00");
+		return;
+	}
+	p += strlen("target.xml:");
+	offset = hex_parse(&p);
+	if(*p++ != ',')
+	{
+		strcpy(g->out, "E01");
+		return;
+	}
+	size = hex_parse(&p);
+	if(size > GDB_PACKET_MAX - 1)
+		size = GDB_PACKET_MAX - 1;
+	if(offset >= total)
+	{
+		strcpy(g->out, "l");
+		return;
+	}
+	if(size > total - offset)
+		size = total - offset;
+	g->out[0] = offset + size < total ? 'm' : 'l';
+	memcpy(g->out + 1, target_xml + offset, size);
+	g->out[size + 1] = 0;
+}
+
+/* monitor commands, hex encoded in qRcmd */
+static void gdb_monitor(struct gdb *g)
+{
+	struct cpu_state *cpu = g->cpu;
+	const char *p = g->pkt + strlen("qRcmd,");
+	char cmd[64];
+	uint32_t i;
+
+	for(i = 0; i < sizeof(cmd) - 1 && hex_digit(p[0]) >= 0 && hex_digit(p[1]) >= 0; i++, p += 2)
+		cmd[i] = hex_digit(p[0]) << 4 | hex_digit(p[1]);
+	cmd[i] = 0;
+
+	if(strcmp(cmd, "history on") == 0 || strcmp(cmd, "history") == 0)
+	{
+		if(!cpu->rev && !reverse_enable(cpu, REVERSE_INTERVAL, REVERSE_BUDGET))
+		{
+			strcpy(g->out, "E01");
+			return;
+		}
+	}
+	else if(strcmp(cmd, "history off") == 0)
+	{
+		reverse_disable(cpu);
+	}
+	else
+	{
+		strcpy(g->out, "");
+		return;
+	}
+	strcpy(g->out, "OK");
+}
+
+/* Answer one packet in pkt, false once the debugger is done */
+static bool gdb_packet(struct gdb *g)
+{
+	struct cpu_state *cpu = g->cpu;
+	const char *p = g->pkt + 1;
+	uint32_t addr, size, i, j, val;
+	char *out = g->out;
+
+	out[0] = 0;
+	switch(g->pkt[0])
+	{
+	case '?':
+		gdb_stop_reply(g, STOP_BUDGET);
+		break;
+	case 'g':
+		for(i = 0; i < GDB_REGS; i++)
+			gdb_put_reg(out + i * 8, cpu, i);
+		break;
+	case 'G':
+		for(i = 0; i < GDB_REGS && strlen(p) >= 8; i++, p += 8)
+		{
+			/* registers sent back as xxxxxxxx are left alone */
+			for(j = 0, val = 0; j < 8 && hex_digit(p[j]) >= 0; j++)
+				val = val << 4 | hex_digit(p[j]);
+			if(j == 8)
+				gdb_set_reg(cpu, i, val);
+		}
+		strcpy(out, "OK");
+		break;
+	case 'p':
+		gdb_put_reg(out, cpu, hex_parse(&p));
+		break;
+	case 'P':
+		i = hex_parse(&p);
+		if(*p++ != '=')
+		{
+			strcpy(out, "E01");
+			break;
+		}
+		gdb_set_reg(cpu, i, hex_parse(&p));
+		strcpy(out, "OK");
+		break;
+	case 'm':
+		addr = hex_parse(&p);
+		if(*p++ != ',')
+		{
+			strcpy(out, "E01");
+			break;
+		}
+		size = hex_parse(&p);
+		if(size > GDB_PACKET_MAX / 2)
+			size = GDB_PACKET_MAX / 2;
+		if(size && !gdb_read_mem(cpu, addr, size, out))
+			strcpy(out, "E14");
+		break;
+	case 'M':
+		addr = hex_parse(&p);
+		if(*p++ != ',')
+		{
+			strcpy(out, "E01");
+			break;
+		}
+		size = hex_parse(&p);
+		if(*p++ != ':' || strlen(p) < size * 2 || !gdb_write_mem(cpu, addr, size, p))
+			strcpy(out, "E14");
+		else
+			strcpy(out, "OK");
+		break;
+	case 'Z':
+	case 'z':
+		strcpy(out, gdb_breakpoint(g, g->pkt[0] == 'Z'));
+		break;
+	case 'c':
+	case 's':
+		gdb_resume(g, g->pkt[0] == 's');
+		break;
+	case 'b':
+		if(g->pkt[1] == 's' || g->pkt[1] == 'c')
+			gdb_reverse(g, g->pkt[1] == 's');
+		break;
+	case 'H':
+		strcpy(out, "OK");
+		break;
+	case 'T':
+		strcpy(out, "OK");
+		break;
+	case 'D':
+		gdb_send(g, "OK");
+		return false;
+	case 'k':
+		close(g->fd);
+		exit(0);
+	case 'q':
+		if(strncmp(g->pkt, "qSupported", strlen("qSupported")) == 0)
+			sprintf(out, "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+;"
+				"swbreak+;hwbreak+;ReverseStep+;ReverseContinue+", GDB_PACKET_MAX);
+		else if(strncmp(g->pkt, "qXfer:features:read:", strlen("qXfer:features:read:")) == 0)
+			gdb_xfer(g);
+		else if(strncmp(g->pkt, "qRcmd,", strlen("qRcmd,")) == 0)
+			gdb_monitor(g);
+		else if(strcmp(g->pkt, "qAttached") == 0)
+			strcpy(out, "1");
+		else if(strcmp(g->pkt, "qC") == 0)
+			strcpy(out, "QC1");
+		else if(strcmp(g->pkt, "qfThreadInfo") == 0)
+			strcpy(out, "m1");
+		else if(strcmp(g->pkt, "qsThreadInfo") == 0)
+			strcpy(out, "l");
+		else if(strcmp(g->pkt, "qSymbol::") == 0)
+			strcpy(out, "OK");
+		break;
+	case 'Q':
+		if(strcmp(g->pkt, "QStartNoAckMode") == 0)
+		{
+			gdb_send(g, "OK");
+			g->ack = false;
+			return true;
+		}
+		break;
+	}
+	return gdb_send(g, out);
+}
+
+/*
+ * Wait for gdb on 127.0.0.1:port and serve it until it detaches or the
+ * connection drops; the breakpoints and watchpoints it set are removed
+ * then and the machine is left where it stopped.
+ */
+bool gdb_serve(struct cpu_state *cpu, uint16_t port)
+{
+	struct sockaddr_in sa;
+	struct gdb *g;
+	int32_t s, fd, one = 1;
+	uint32_t i;
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if(s < 0)
+	{
+		printf("gdb: cannot create a socket\n");
+		return false;
+	}
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(s, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(s, 1) < 0)
+	{
+		printf("gdb: cannot listen on port %u\n", port);
+		close(s);
+		return false;
+	}
+	printf("gdb: waiting on port %u\n", port);
+	fflush(stdout);
+	fd = accept(s, NULL, NULL);
+	close(s);
+	if(fd < 0)
+	{
+		printf("gdb: accept failed\n");
+		return false;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	g = calloc(1, sizeof(struct gdb));
+	g->cpu = cpu;
+	g->fd = fd;
+	g->ack = true;
+	while(gdb_recv(g) && gdb_packet(g))
+		;
+
+	for(i = 0; i < g->break_count; i++)
+		unregister_callback(cpu, g->breaks[i].address, gdb_break);
+	for(i = 0; i < g->watch_count; i++)
+		mem_watch_remove(cpu, g->watches[i].address, g->watches[i].size, watch_types[g->watches[i].type]);
+	cpu->stop = STOP_NONE;
+	close(fd);
+	free(g->breaks);
+	free(g);
+	printf("gdb: detached\n");
+	return true;
+}
@@ -0,0 +1,9 @@
+#ifndef _GDBSTUB_H_
+#define _GDBSTUB_H_
+
+#define GDB_PACKET_MAX 0x4000	/* advertised as PacketSize */
+#define GDB_SLICE      1000000	/* instructions run between looks at the socket */
+
+bool gdb_serve(struct cpu_state *cpu, uint16_t port);
+
+#endif /* _GDBSTUB_H_ */
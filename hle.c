@@ -0,0 +1,329 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <lzma.h>
+
+#include "emulator.h"
+#include "mem.h"
+#include "symbol.h"
+#include "hle.h"
+
+/*
+ * The libc routines the image spends most of its time in, and the
+ * bootloader's LZMA decoder, run natively from a callback at their entry.
+ * Each reads its arguments, does the work straight on the pages mem.h
+ * maps, sets $v0 and returns to $ra; memory and the return value are what
+ * the guest code would have left. Pages that are
+ * not mapped directly (code, not yet dirty, watched) go a byte at a time
+ * through load_byte()/store_byte() and their slow paths. Anything that is
+ * not RAM or readable flash, and memcpy between overlapping buffers, is
+ * left to the guest: the callback returns without touching anything and
+ * the routine runs as before. cpu->hle = false leaves all of it to the
+ * guest, to compare against.
+ */
+
+/* The host page holding vaddr if it is mapped directly, else NULL */
+static inline int8_t *hle_page(struct cpu_state *cpu, uint32_t vaddr, bool write)
+{
+	uint32_t page = vaddr >> MEM_PAGE_SHIFT;
+
+	return write ? cpu->mem_write[page] : cpu->mem_read[page];
+}
+
+static inline uint32_t hle_left(uint32_t vaddr)
+{
+	return MEM_PAGE_SIZE - (vaddr & MEM_PAGE_MASK);
+}
+
+/* Can n bytes at vaddr be accessed without a device seeing it? */
+static bool hle_range(struct cpu_state *cpu, uint32_t vaddr, uint32_t n, bool write)
+{
+	uint32_t page, last;
+	uint8_t type;
+
+	if(!n)
+		return true;
+	if(vaddr + n - 1 < vaddr)
+		return false;
+	last = (vaddr + n - 1) >> MEM_PAGE_SHIFT;
+	for(page = vaddr >> MEM_PAGE_SHIFT; page <= last; page++)
+	{
+		type = cpu->mem_type[page];
+		if(type != MEM_RAM && (write || type != MEM_FLASH || !cpu->mem_read[page]))
+			return false;
+	}
+	return true;
+}
+
+static inline uint8_t hle_byte(struct cpu_state *cpu, uint32_t vaddr)
+{
+	int8_t *page = hle_page(cpu, vaddr, false);
+
+	if(page)
+		return page[MEM_ADDR8(vaddr & MEM_PAGE_MASK)];
+	return load_byte(cpu, vaddr);
+}
+
+/* Bytes up to the first NUL at vaddr, false if one is not reached in RAM or flash */
+static bool hle_strlen_at(struct cpu_state *cpu, uint32_t vaddr, uint32_t *len)
+{
+	uint32_t n;
+
+	for(n = 0; hle_range(cpu, vaddr + n, 1, false); n++)
+	{
+		if(!hle_byte(cpu, vaddr + n))
+		{
+			*len = n;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void hle_return(struct cpu_state *cpu, uint32_t v0)
+{
+	cpu->reg[2] = v0;
+	cpu->pc = cpu->reg[31];
+}
+
+/*
+ * Host memcpy()/memset() over the largest piece of n bytes at dst (and
+ * src) that stays within one page, the number of bytes done; 0 if the
+ * first byte has to go byte-wise. With MEM_SWIZZLE only whole words are
+ * in guest order.
+ */
+static uint32_t hle_chunk(struct cpu_state *cpu, uint32_t dst, uint32_t src, uint32_t n, int32_t fill)
+{
+	int8_t *d = hle_page(cpu, dst, true), *s = fill < 0 ? hle_page(cpu, src, false) : d;
+	uint32_t chunk = n < hle_left(dst) ? n : hle_left(dst);
+
+	if(fill < 0 && chunk > hle_left(src))
+		chunk = hle_left(src);
+	if(!d || !s)
+		return 0;
+#ifdef MEM_SWIZZLE
+	if(((dst | src) & 3) || chunk < 4)
+		return 0;
+	chunk &= ~3;
+#endif
+	if(fill < 0)
+		memcpy(d + (dst & MEM_PAGE_MASK), s + (src & MEM_PAGE_MASK), chunk);
+	else
+		memset(d + (dst & MEM_PAGE_MASK), fill, chunk);
+	return chunk;
+}
+
+/* void *memcpy(void *dst, const void *src, size_t n) */
+static void hle_memcpy(struct cpu_state *cpu)
+{
+	uint32_t dst = cpu->reg[4], src = cpu->reg[5], n = cpu->reg[6];
+	uint32_t chunk;
+
+	if(!cpu->hle || !hle_range(cpu, dst, n, true) || !hle_range(cpu, src, n, false) ||
+	   (n && mem_kseg0(dst) < mem_kseg0(src) + n && mem_kseg0(src) < mem_kseg0(dst) + n))
+		return;
+	while(n)
+	{
+		chunk = hle_chunk(cpu, dst, src, n, -1);
+		if(!chunk)
+		{
+			store_byte(cpu, dst, hle_byte(cpu, src));
+			chunk = 1;
+		}
+		dst += chunk;
+		src += chunk;
+		n -= chunk;
+	}
+	hle_return(cpu, cpu->reg[4]);
+}
+
+static void hle_fill(struct cpu_state *cpu, uint32_t dst, uint8_t c, uint32_t n)
+{
+	uint32_t chunk;
+
+	while(n)
+	{
+		chunk = hle_chunk(cpu, dst, 0, n, c);
+		if(!chunk)
+		{
+			store_byte(cpu, dst, c);
+			chunk = 1;
+		}
+		dst += chunk;
+		n -= chunk;
+	}
+}
+
+/* void *memset(void *dst, int c, size_t n) */
+static void hle_memset(struct cpu_state *cpu)
+{
+	if(!cpu->hle || !hle_range(cpu, cpu->reg[4], cpu->reg[6], true))
+		return;
+	hle_fill(cpu, cpu->reg[4], cpu->reg[5], cpu->reg[6]);
+	hle_return(cpu, cpu->reg[4]);
+}
+
+/* void bzero(void *dst, size_t n), $v0 as the guest left it */
+static void hle_bzero(struct cpu_state *cpu)
+{
+	if(!cpu->hle || !hle_range(cpu, cpu->reg[4], cpu->reg[5], true))
+		return;
+	hle_fill(cpu, cpu->reg[4], 0, cpu->reg[5]);
+	hle_return(cpu, cpu->reg[2]);
+}
+
+/* size_t strlen(const char *s) */
+static void hle_strlen(struct cpu_state *cpu)
+{
+	uint32_t len;
+
+	if(!cpu->hle || !hle_strlen_at(cpu, cpu->reg[4], &len))
+		return;
+	hle_return(cpu, len);
+}
+
+/* int strcmp(const char *a, const char *b), the difference of the first unequal bytes */
+static void hle_strcmp(struct cpu_state *cpu)
+{
+	uint32_t a = cpu->reg[4], b = cpu->reg[5], la, lb, i;
+	uint8_t x, y;
+
+	/* both strings are checked before any byte counts */
+	if(!cpu->hle || !hle_strlen_at(cpu, a, &la) || !hle_strlen_at(cpu, b, &lb))
+		return;
+	for(i = 0; ; i++)
+	{
+		x = hle_byte(cpu, a + i);
+		y = hle_byte(cpu, b + i);
+		if(x != y || !x)
+			break;
+	}
+	hle_return(cpu, (int32_t)x - (int32_t)y);
+}
+
+/* Copy n host bytes to the guest at dst, through the slow path where there is one */
+static void hle_write(struct cpu_state *cpu, uint32_t dst, const uint8_t *buf, uint32_t n)
+{
+	int8_t *page;
+	uint32_t chunk, i;
+
+	while(n)
+	{
+		page = hle_page(cpu, dst, true);
+		chunk = n < hle_left(dst) ? n : hle_left(dst);
+		if(page)
+		{
+#ifdef MEM_SWIZZLE
+			for(i = 0; i < chunk; i++)
+				page[MEM_ADDR8((dst & MEM_PAGE_MASK) + i)] = buf[i];
+#else
+			memcpy(page + (dst & MEM_PAGE_MASK), buf, chunk);
+#endif
+		}
+		else
+		{
+			for(i = 0; i < chunk; i++)
+				store_byte(cpu, dst + i, buf[i]);
+		}
+		dst += chunk;
+		buf += chunk;
+		n -= chunk;
+	}
+}
+
+/*
+ * Decode the LZMA stream in in, 5 bytes of properties and the raw data
+ * after them as ProgramStore writes it, into out. Only a stream that ends
+ * with its end marker or fills out exactly is taken: anything else leaves
+ * the guest decoder to read what it reads past the end of its input.
+ */
+static bool hle_unlzma(const uint8_t *in, uint32_t in_size, uint8_t *out, uint32_t out_size, uint32_t *done)
+{
+	lzma_filter filters[2] = { { LZMA_FILTER_LZMA1, NULL }, { LZMA_VLI_UNKNOWN, NULL } };
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_ret ret;
+
+	if(in_size < HLE_LZMA_PROPS || lzma_properties_decode(&filters[0], NULL, in, HLE_LZMA_PROPS) != LZMA_OK)
+		return false;
+	ret = lzma_raw_decoder(&strm, filters);
+	free(filters[0].options);
+	if(ret != LZMA_OK)
+		return false;
+	strm.next_in = in + HLE_LZMA_PROPS;
+	strm.avail_in = in_size - HLE_LZMA_PROPS;
+	strm.next_out = out;
+	strm.avail_out = out_size;
+	ret = lzma_code(&strm, LZMA_FINISH);
+	lzma_end(&strm);
+	*done = out_size - strm.avail_out;
+	return ret == LZMA_STREAM_END || (ret == LZMA_OK && !strm.avail_out);
+}
+
+/*
+ * int decompress_lzma_7z(const void *in, unsigned in_size, void *out,
+ * unsigned out_size), 0 once out holds the image. The bootloader spends
+ * most of a cold boot here; its scratch state in guest memory is not
+ * reproduced, only out and $v0.
+ */
+static void hle_lzma(struct cpu_state *cpu)
+{
+	uint32_t in = cpu->reg[4], in_size = cpu->reg[5], out = cpu->reg[6], out_size = cpu->reg[7];
+	uint8_t *src, *dst;
+	uint32_t i, done;
+
+	if(!cpu->hle || !hle_range(cpu, in, in_size, false) || !hle_range(cpu, out, out_size, true))
+		return;
+	src = malloc(in_size);
+	dst = malloc(out_size);
+	for(i = 0; i < in_size; i++)
+		src[i] = hle_byte(cpu, in + i);
+	if(hle_unlzma(src, in_size, dst, out_size, &done))
+	{
+		hle_write(cpu, out, dst, done);
+		hle_return(cpu, 0);
+	}
+	free(src);
+	free(dst);
+}
+
+static const struct
+{
+	const char *name;
+	void (*fn)(struct cpu_state *cpu);
+} hle_routines[] = {
+	{ "memcpy", hle_memcpy },
+	{ "memset", hle_memset },
+	{ "bzero", hle_bzero },
+	{ "strlen", hle_strlen },
+	{ "strcmp", hle_strcmp },
+	{ "decompress_lzma_7z", hle_lzma },
+};
+
+/* Hook every routine at its name, once a symbol table has it */
+void hle_register(struct cpu_state *cpu)
+{
+	uint32_t i;
+
+	for(i = 0; i < sizeof(hle_routines) / sizeof(hle_routines[0]); i++)
+		register_callback_symbol(cpu, hle_routines[i].name, 0, hle_routines[i].fn);
+}
+
+/* Hook routine at addr, for images without symbols */
+bool hle_add(struct cpu_state *cpu, const char *routine, uint32_t addr)
+{
+	uint32_t i;
+
+	for(i = 0; i < sizeof(hle_routines) / sizeof(hle_routines[0]); i++)
+	{
+		if(strcmp(hle_routines[i].name, routine) == 0)
+		{
+			register_callback(cpu, addr, hle_routines[i].fn);
+			return true;
+		}
+	}
+	printf("hle: no routine %s\n", routine);
+	return false;
+}
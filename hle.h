@@ -0,0 +1,9 @@
+#ifndef _HLE_H_
+#define _HLE_H_
+
+#define HLE_LZMA_PROPS 5	/* bytes of properties ahead of an LZMA stream */
+
+void hle_register(struct cpu_state *cpu);
+bool hle_add(struct cpu_state *cpu, const char *routine, uint32_t addr);
+
+#endif /* _HLE_H_ */
@@ -0,0 +1,23 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#define JIT_CODE_SIZE  (16 << 20)
+#define JIT_THRESHOLD  32	/* block runs before it is compiled */
+
+struct block;
+
+typedef uint32_t (*jit_code)(struct cpu_state *cpu);
+
+struct jit_state
+{
+	bool enabled;
+	bool full;
+	uint8_t *code;
+	uint32_t used;
+};
+
+void jit_enable(struct cpu_state *cpu, bool enable);
+void jit_flush(struct cpu_state *cpu);
+uint32_t jit_execute(struct cpu_state *cpu, struct block *b);
+
+#endif /* _JIT_H_ */
@@ -0,0 +1,950 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "mem.h"
+#include "block.h"
+#include "jit.h"
+#include "opcode.h"
+
+/*
+ * Translates hot basic blocks to x86-64. Inside a translated block the most
+ * used guest registers (HI and LO included) live in callee-saved host
+ * registers and the pc is a compile time constant; everything is written
+ * back to the cpu_state on every exit and around calls into the
+ * interpreter. Loads and stores go through the page tables inline; pages
+ * without a direct mapping (MMIO, fakeflash, RAM holding code for stores),
+ * COP0 and the rarely used instructions call the interpreter's handler
+ * instead.
+ */
+
+#if defined(__x86_64__)
+
+enum
+{
+	RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+#define CPU R15
+
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G  0xf
+
+#define GUEST_HI 32
+#define GUEST_LO 33
+#define GUEST_REGS 34
+
+static const int8_t alloc_order[] = { RBX, RBP, R12, R13, R14 };
+#define ALLOC_REGS (int32_t)(sizeof(alloc_order) / sizeof(alloc_order[0]))
+
+/*
+ * Upper bound of host bytes per guest instruction. The largest is a load or
+ * store: the page lookup and fast path, then the handler call spilling and
+ * reloading every host register and the valid check with its own exit,
+ * about 300 bytes in all. The prologue and the last exit take two more.
+ */
+#define INSN_MAX_CODE 320
+
+struct jit_ctx
+{
+	uint8_t *p;
+	struct block *b;
+	int8_t host[GUEST_REGS];	/* host register of a guest register or -1 */
+};
+
+static inline void emit8(struct jit_ctx *c, uint8_t v)
+{
+	*c->p++ = v;
+}
+
+static inline void emit32(struct jit_ctx *c, uint32_t v)
+{
+	memcpy(c->p, &v, 4);
+	c->p += 4;
+}
+
+static inline void emit64(struct jit_ctx *c, uint64_t v)
+{
+	memcpy(c->p, &v, 8);
+	c->p += 8;
+}
+
+static inline void emit_rex(struct jit_ctx *c, int w, int r, int b)
+{
+	uint8_t rex = 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3);
+
+	if(rex != 0x40)
+		emit8(c, rex);
+}
+
+/* op r/m32, r32 */
+static void emit_rr(struct jit_ctx *c, uint8_t opcode, int rm, int reg)
+{
+	emit_rex(c, 0, reg, rm);
+	emit8(c, opcode);
+	emit8(c, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* two byte 0x0f op r32, r/m32 */
+static void emit_0f_rr(struct jit_ctx *c, uint8_t opcode, int reg, int rm)
+{
+	emit_rex(c, 0, reg, rm);
+	emit8(c, 0x0f);
+	emit8(c, opcode);
+	emit8(c, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_mov_rr(struct jit_ctx *c, int dst, int src)
+{
+	if(dst != src)
+		emit_rr(c, 0x89, dst, src);
+}
+
+/* mov r32, [cpu + disp] and back */
+static void emit_load_cpu(struct jit_ctx *c, int dst, int32_t disp)
+{
+	emit_rex(c, 0, dst, CPU);
+	emit8(c, 0x8b);
+	emit8(c, 0x80 | ((dst & 7) << 3) | (CPU & 7));
+	emit32(c, disp);
+}
+
+static void emit_store_cpu(struct jit_ctx *c, int32_t disp, int src)
+{
+	emit_rex(c, 0, src, CPU);
+	emit8(c, 0x89);
+	emit8(c, 0x80 | ((src & 7) << 3) | (CPU & 7));
+	emit32(c, disp);
+}
+
+static void emit_load_cpu64(struct jit_ctx *c, int dst, int32_t disp)
+{
+	emit_rex(c, 1, dst, CPU);
+	emit8(c, 0x8b);
+	emit8(c, 0x80 | ((dst & 7) << 3) | (CPU & 7));
+	emit32(c, disp);
+}
+
+static void emit_store_cpu_imm(struct jit_ctx *c, int32_t disp, uint32_t imm)
+{
+	emit_rex(c, 0, 0, CPU);
+	emit8(c, 0xc7);
+	emit8(c, 0x80 | (CPU & 7));
+	emit32(c, disp);
+	emit32(c, imm);
+}
+
+static void emit_mov_imm(struct jit_ctx *c, int dst, uint32_t imm)
+{
+	emit_rex(c, 0, 0, dst);
+	emit8(c, 0xb8 | (dst & 7));
+	emit32(c, imm);
+}
+
+static void emit_mov_imm64(struct jit_ctx *c, int dst, uint64_t imm)
+{
+	emit_rex(c, 1, 0, dst);
+	emit8(c, 0xb8 | (dst & 7));
+	emit64(c, imm);
+}
+
+/* 0x81 group: add=0 or=1 and=4 sub=5 xor=6 cmp=7 */
+static void emit_alu_imm(struct jit_ctx *c, int digit, int dst, uint32_t imm)
+{
+	emit_rex(c, 0, 0, dst);
+	emit8(c, 0x81);
+	emit8(c, 0xc0 | (digit << 3) | (dst & 7));
+	emit32(c, imm);
+}
+
+/* 0xc1/0xd3 group: shl=4 shr=5 sar=7, by immediate or by cl */
+static void emit_shift_imm(struct jit_ctx *c, int digit, int dst, uint8_t imm)
+{
+	emit_rex(c, 0, 0, dst);
+	emit8(c, 0xc1);
+	emit8(c, 0xc0 | (digit << 3) | (dst & 7));
+	emit8(c, imm);
+}
+
+static void emit_shift_cl(struct jit_ctx *c, int digit, int dst)
+{
+	emit_rex(c, 0, 0, dst);
+	emit8(c, 0xd3);
+	emit8(c, 0xc0 | (digit << 3) | (dst & 7));
+}
+
+/* 0xf7 group: not=2 mul=4 imul=5 */
+static void emit_unary(struct jit_ctx *c, int digit, int dst)
+{
+	emit_rex(c, 0, 0, dst);
+	emit8(c, 0xf7);
+	emit8(c, 0xc0 | (digit << 3) | (dst & 7));
+}
+
+static void emit_setcc_eax(struct jit_ctx *c, int cc)
+{
+	emit8(c, 0x0f);
+	emit8(c, 0x90 | cc);
+	emit8(c, 0xc0);
+	emit8(c, 0x0f);		/* movzx eax, al */
+	emit8(c, 0xb6);
+	emit8(c, 0xc0);
+}
+
+/* [rsp] holds the pc a branch continues at after its delay slot */
+static void emit_store_next(struct jit_ctx *c, int src)
+{
+	emit8(c, 0x89);
+	emit8(c, 0x04 | ((src & 7) << 3));
+	emit8(c, 0x24);
+}
+
+static void emit_store_next_imm(struct jit_ctx *c, uint32_t imm)
+{
+	emit8(c, 0xc7);
+	emit8(c, 0x04);
+	emit8(c, 0x24);
+	emit32(c, imm);
+}
+
+static void emit_load_next(struct jit_ctx *c, int dst)
+{
+	emit8(c, 0x8b);
+	emit8(c, 0x04 | ((dst & 7) << 3));
+	emit8(c, 0x24);
+}
+
+static uint8_t *emit_jcc(struct jit_ctx *c, int cc)
+{
+	emit8(c, 0x0f);
+	emit8(c, 0x80 | cc);
+	emit32(c, 0);
+	return c->p - 4;
+}
+
+static uint8_t *emit_jmp(struct jit_ctx *c)
+{
+	emit8(c, 0xe9);
+	emit32(c, 0);
+	return c->p - 4;
+}
+
+static void patch(struct jit_ctx *c, uint8_t *rel)
+{
+	int32_t off = c->p - (rel + 4);
+
+	memcpy(rel, &off, 4);
+}
+
+static int32_t guest_disp(int32_t g)
+{
+	if(g == GUEST_HI)
+		return offsetof(struct cpu_state, HI);
+	if(g == GUEST_LO)
+		return offsetof(struct cpu_state, LO);
+	return offsetof(struct cpu_state, reg) + g * 4;
+}
+
+static void load_guest(struct jit_ctx *c, int dst, int32_t g)
+{
+	if(c->host[g] >= 0)
+		emit_mov_rr(c, dst, c->host[g]);
+	else
+		emit_load_cpu(c, dst, guest_disp(g));
+}
+
+static void store_guest(struct jit_ctx *c, int32_t g, int src)
+{
+	if(c->host[g] >= 0)
+		emit_mov_rr(c, c->host[g], src);
+	else
+		emit_store_cpu(c, guest_disp(g), src);
+}
+
+static void spill_all(struct jit_ctx *c)
+{
+	int32_t g;
+
+	for(g = 0; g < GUEST_REGS; g++)
+	{
+		if(c->host[g] >= 0)
+			emit_store_cpu(c, guest_disp(g), c->host[g]);
+	}
+}
+
+static void reload_all(struct jit_ctx *c)
+{
+	int32_t g;
+
+	for(g = 0; g < GUEST_REGS; g++)
+	{
+		if(c->host[g] >= 0)
+			emit_load_cpu(c, c->host[g], guest_disp(g));
+	}
+}
+
+static void emit_prev_pc(struct jit_ctx *c, uint32_t executed)
+{
+	int32_t prev = offsetof(struct cpu_state, prev_pc);
+	uint32_t pc = c->b->pc;
+
+	if(executed == 1)
+	{
+		emit_load_cpu(c, RAX, prev + 4);
+		emit_store_cpu(c, prev, RAX);
+		emit_load_cpu(c, RAX, prev + 8);
+		emit_store_cpu(c, prev + 4, RAX);
+		emit_store_cpu_imm(c, prev + 8, pc);
+	}
+	else if(executed == 2)
+	{
+		emit_load_cpu(c, RAX, prev + 8);
+		emit_store_cpu(c, prev, RAX);
+		emit_store_cpu_imm(c, prev + 4, pc);
+		emit_store_cpu_imm(c, prev + 8, pc + 4);
+	}
+	else
+	{
+		emit_store_cpu_imm(c, prev, pc + (executed - 3) * 4);
+		emit_store_cpu_imm(c, prev + 4, pc + (executed - 2) * 4);
+		emit_store_cpu_imm(c, prev + 8, pc + (executed - 1) * 4);
+	}
+}
+
+enum exit_pc { PC_CONST, PC_NEXT, PC_KEEP };
+
+static void emit_exit(struct jit_ctx *c, uint32_t executed, enum exit_pc mode, uint32_t pc)
+{
+	spill_all(c);
+	if(mode == PC_CONST)
+		emit_store_cpu_imm(c, offsetof(struct cpu_state, pc), pc);
+	else if(mode == PC_NEXT)
+	{
+		emit_load_next(c, RAX);
+		emit_store_cpu(c, offsetof(struct cpu_state, pc), RAX);
+	}
+	emit_prev_pc(c, executed);
+	emit_mov_imm(c, RAX, executed);
+	emit8(c, 0x48);		/* add rsp, 8 */
+	emit8(c, 0x83);
+	emit8(c, 0xc4);
+	emit8(c, 0x08);
+	emit8(c, 0x41);		/* pop r15 .. rbx */
+	emit8(c, 0x5f);
+	emit8(c, 0x41);
+	emit8(c, 0x5e);
+	emit8(c, 0x41);
+	emit8(c, 0x5d);
+	emit8(c, 0x41);
+	emit8(c, 0x5c);
+	emit8(c, 0x5d);
+	emit8(c, 0x5b);
+	emit8(c, 0xc3);
+}
+
+/*
+ * Run one instruction through its interpreter handler. The cpu_state is
+ * brought up to date first, with pc pointing past the instruction (or at
+ * the branch destination in a delay slot) exactly as execute() leaves it.
+ */
+static void emit_call_handler(struct jit_ctx *c, const struct insn *insn, uint32_t pc, bool delay_slot)
+{
+	if(delay_slot)
+	{
+		emit_load_next(c, RAX);
+		emit_store_cpu(c, offsetof(struct cpu_state, pc), RAX);
+	}
+	else
+		emit_store_cpu_imm(c, offsetof(struct cpu_state, pc), pc + 4);
+	spill_all(c);
+	emit8(c, 0x4c);				/* mov rdi, r15 */
+	emit8(c, 0x89);
+	emit8(c, 0xff);
+	emit_mov_imm64(c, RSI, (uintptr_t)insn);
+	emit_mov_imm64(c, RAX, (uintptr_t)insn->handler);
+	emit8(c, 0xff);				/* call rax */
+	emit8(c, 0xd0);
+	reload_all(c);
+}
+
+/* Leave the block if an access through the interpreter invalidated it */
+static void emit_check_valid(struct jit_ctx *c, uint32_t index)
+{
+	uint8_t *skip;
+
+	emit_mov_imm64(c, RAX, (uintptr_t)&c->b->valid);
+	emit8(c, 0x80);				/* cmp byte [rax], 0 */
+	emit8(c, 0x38);
+	emit8(c, 0x00);
+	skip = emit_jcc(c, CC_NE);
+	emit_exit(c, index + 1, PC_CONST, c->b->pc + (index + 1) * 4);
+	patch(c, skip);
+}
+
+/*
+ * Look the guest address up in one of the page tables, leaving the host
+ * page in rdx and the offset into it in rcx. Jumps to the returned fixup
+ * for pages without a direct mapping.
+ */
+static uint8_t *emit_page_lookup(struct jit_ctx *c, const struct insn *insn, int32_t table)
+{
+	load_guest(c, RAX, insn->rs);
+	if(insn->im16)
+		emit_alu_imm(c, 0, RAX, (int32_t)insn->im16);
+	emit_mov_rr(c, RCX, RAX);
+	emit_shift_imm(c, 5, RCX, MEM_PAGE_SHIFT);
+	emit_load_cpu64(c, RDX, table);
+	emit8(c, 0x48); emit8(c, 0x8b); emit8(c, 0x14); emit8(c, 0xca);	/* mov rdx, [rdx+rcx*8] */
+	emit_mov_rr(c, RCX, RAX);
+	emit_alu_imm(c, 4, RCX, MEM_PAGE_MASK);
+	emit8(c, 0x48); emit8(c, 0x85); emit8(c, 0xd2);			/* test rdx, rdx */
+	return emit_jcc(c, CC_E);
+}
+
+/* Convert between a value in eax and its RAM representation, see mem.h */
+static void emit_swap(struct jit_ctx *c, int32_t width)
+{
+#ifndef MEM_SWIZZLE
+	if(width == 4)
+	{
+		emit8(c, 0x0f); emit8(c, 0xc8);				/* bswap eax */
+	}
+	else if(width == 2)
+	{
+		emit8(c, 0x66); emit8(c, 0xc1); emit8(c, 0xc0); emit8(c, 0x08);	/* rol ax, 8 */
+	}
+#endif
+}
+
+/* Adjust the page offset in ecx for a halfword or byte access */
+static void emit_swizzle(struct jit_ctx *c, int32_t width)
+{
+#ifdef MEM_SWIZZLE
+	emit_alu_imm(c, 6, RCX, 4 - width);
+#endif
+}
+
+static void emit_load(struct jit_ctx *c, const struct insn *insn, uint32_t index, bool delay_slot)
+{
+	uint32_t pc = c->b->pc + index * 4;
+	uint8_t *slow;
+	uint8_t *done;
+
+	slow = emit_page_lookup(c, insn, offsetof(struct cpu_state, mem_read));
+	switch(decode_opcode(insn->instruction))
+	{
+	case INS_LW:		/* mov eax, [rdx+rcx] */
+		emit8(c, 0x8b); emit8(c, 0x04); emit8(c, 0x0a);
+		emit_swap(c, 4);
+		break;
+	case INS_LH:		/* movzx eax, word [rdx+rcx]; movsx eax, ax */
+	case INS_LHU:		/* ... movzx eax, ax */
+		emit_swizzle(c, 2);
+		emit8(c, 0x0f); emit8(c, 0xb7); emit8(c, 0x04); emit8(c, 0x0a);
+		emit_swap(c, 2);
+		emit8(c, 0x0f);
+		emit8(c, decode_opcode(insn->instruction) == INS_LH ? 0xbf : 0xb7);
+		emit8(c, 0xc0);
+		break;
+	case INS_LB:		/* movsx eax, byte [rdx+rcx] */
+		emit_swizzle(c, 1);
+		emit8(c, 0x0f); emit8(c, 0xbe); emit8(c, 0x04); emit8(c, 0x0a);
+		break;
+	case INS_LBU:		/* movzx eax, byte [rdx+rcx] */
+		emit_swizzle(c, 1);
+		emit8(c, 0x0f); emit8(c, 0xb6); emit8(c, 0x04); emit8(c, 0x0a);
+		break;
+	}
+	store_guest(c, insn->rt, RAX);
+	done = emit_jmp(c);
+	patch(c, slow);
+	emit_call_handler(c, insn, pc, delay_slot);
+	if(!delay_slot)
+		emit_check_valid(c, index);
+	patch(c, done);
+}
+
+static void emit_store(struct jit_ctx *c, const struct insn *insn, uint32_t index, bool delay_slot)
+{
+	uint32_t pc = c->b->pc + index * 4;
+	uint8_t *slow;
+	uint8_t *done;
+
+	slow = emit_page_lookup(c, insn, offsetof(struct cpu_state, mem_write));
+	load_guest(c, RAX, insn->rt);
+	switch(decode_opcode(insn->instruction))
+	{
+	case INS_SW:		/* mov [rdx+rcx], eax */
+		emit_swap(c, 4);
+		emit8(c, 0x89); emit8(c, 0x04); emit8(c, 0x0a);
+		break;
+	case INS_SH:		/* mov [rdx+rcx], ax */
+		emit_swizzle(c, 2);
+		emit_swap(c, 2);
+		emit8(c, 0x66); emit8(c, 0x89); emit8(c, 0x04); emit8(c, 0x0a);
+		break;
+	case INS_SB:		/* mov [rdx+rcx], al */
+		emit_swizzle(c, 1);
+		emit8(c, 0x88); emit8(c, 0x04); emit8(c, 0x0a);
+		break;
+	}
+	done = emit_jmp(c);
+	patch(c, slow);
+	emit_call_handler(c, insn, pc, delay_slot);
+	if(!delay_slot)
+		emit_check_valid(c, index);
+	patch(c, done);
+}
+
+static void emit_alu3(struct jit_ctx *c, const struct insn *insn, uint8_t opcode)
+{
+	load_guest(c, RAX, insn->rs);
+	load_guest(c, RCX, insn->rt);
+	emit_rr(c, opcode, RAX, RCX);
+	store_guest(c, insn->rd, RAX);
+}
+
+static void emit_alu_imm16(struct jit_ctx *c, const struct insn *insn, int digit, uint32_t imm)
+{
+	load_guest(c, RAX, insn->rs);
+	emit_alu_imm(c, digit, RAX, imm);
+	store_guest(c, insn->rt, RAX);
+}
+
+static void emit_set_less(struct jit_ctx *c, const struct insn *insn, int cc, bool imm)
+{
+	load_guest(c, RAX, insn->rs);
+	if(imm)
+		emit_alu_imm(c, 7, RAX, (int32_t)insn->im16);
+	else
+	{
+		load_guest(c, RCX, insn->rt);
+		emit_rr(c, 0x39, RAX, RCX);
+	}
+	emit_setcc_eax(c, cc);
+	store_guest(c, imm ? insn->rt : insn->rd, RAX);
+}
+
+static void emit_shift(struct jit_ctx *c, const struct insn *insn, int digit, bool variable)
+{
+	load_guest(c, RAX, insn->rt);
+	if(variable)
+	{
+		load_guest(c, RCX, insn->rs);
+		emit_shift_cl(c, digit, RAX);
+	}
+	else if(insn->sa)
+		emit_shift_imm(c, digit, RAX, insn->sa);
+	store_guest(c, insn->rd, RAX);
+}
+
+static void emit_move_cond(struct jit_ctx *c, const struct insn *insn, int cc)
+{
+	load_guest(c, RAX, insn->rd);
+	load_guest(c, RCX, insn->rs);
+	load_guest(c, RDX, insn->rt);
+	emit_rr(c, 0x85, RDX, RDX);
+	emit_0f_rr(c, 0x40 | cc, RAX, RCX);
+	store_guest(c, insn->rd, RAX);
+}
+
+static void emit_mult(struct jit_ctx *c, const struct insn *insn, int digit)
+{
+	load_guest(c, RAX, insn->rs);
+	load_guest(c, RCX, insn->rt);
+	emit_unary(c, digit, RCX);
+	store_guest(c, GUEST_LO, RAX);
+	store_guest(c, GUEST_HI, RDX);
+}
+
+/*
+ * Conditional branches: set flags for cc from rs (and rt), leaving the
+ * comparison to the caller. Returns false for instructions that are not a
+ * conditional branch.
+ */
+static bool emit_branch_compare(struct jit_ctx *c, const struct insn *insn, int *cc, bool *likely)
+{
+	uint32_t opcode = decode_opcode(insn->instruction);
+
+	*likely = false;
+	if(opcode == 1)
+	{
+		switch(decode_special_branch_opcode(insn->instruction))
+		{
+		case INS_BLTZL: *likely = true; /* fall through */
+		case INS_BLTZ:  *cc = CC_L;  break;
+		case INS_BGEZL: *likely = true; /* fall through */
+		case INS_BGEZ:  *cc = CC_GE; break;
+		default:
+			return false;
+		}
+		load_guest(c, RAX, insn->rs);
+		emit_rr(c, 0x85, RAX, RAX);
+		return true;
+	}
+
+	switch(opcode)
+	{
+	case INS_BEQL:  *likely = true; /* fall through */
+	case INS_BEQ:   *cc = CC_E;  break;
+	case INS_BNEL:  *likely = true; /* fall through */
+	case INS_BNE:   *cc = CC_NE; break;
+	case INS_BLEZL: *likely = true; /* fall through */
+	case INS_BLEZ:  *cc = CC_LE; break;
+	case INS_BGTZL: *likely = true; /* fall through */
+	case INS_BGTZ:  *cc = CC_G;  break;
+	default:
+		return false;
+	}
+	load_guest(c, RAX, insn->rs);
+	if(opcode == INS_BEQ || opcode == INS_BNE || opcode == INS_BEQL || opcode == INS_BNEL)
+	{
+		load_guest(c, RCX, insn->rt);
+		emit_rr(c, 0x39, RAX, RCX);
+	}
+	else
+		emit_rr(c, 0x85, RAX, RAX);
+	return true;
+}
+
+/*
+ * Branches and jumps store the pc to continue at after the delay slot in
+ * [rsp]. Likely branches that are not taken leave the block right away.
+ */
+static void emit_branch(struct jit_ctx *c, const struct insn *insn, uint32_t index)
+{
+	uint32_t pc = c->b->pc + index * 4;
+	uint32_t opcode = decode_opcode(insn->instruction);
+	uint8_t *taken;
+	bool likely;
+	int cc;
+
+	if(opcode == INS_J || opcode == INS_JAL)
+	{
+		emit_store_next_imm(c, insn->target);
+		if(opcode == INS_JAL)
+		{
+			emit_mov_imm(c, RAX, pc + 8);
+			store_guest(c, 31, RAX);
+		}
+	}
+	else if(opcode == 0)
+	{
+		/* jr, jalr */
+		load_guest(c, RAX, insn->rs);
+		emit_alu_imm(c, 4, RAX, ~0x20000000);
+		emit_store_next(c, RAX);
+		if(decode_special_opcode(insn->instruction) == INS_JALR)
+		{
+			emit_mov_imm(c, RAX, pc + 8);
+			store_guest(c, insn->rd, RAX);
+		}
+	}
+	else if(opcode == 1 && decode_special_branch_opcode(insn->instruction) == INS_BAL)
+	{
+		emit_store_next_imm(c, insn->target);
+		emit_mov_imm(c, RAX, pc + 8);
+		store_guest(c, 31, RAX);
+	}
+	else if(emit_branch_compare(c, insn, &cc, &likely))
+	{
+		if(likely)
+		{
+			taken = emit_jcc(c, cc);
+			emit_exit(c, index + 1, PC_CONST, pc + 8);
+			patch(c, taken);
+			emit_store_next_imm(c, insn->target);
+		}
+		else
+		{
+			emit_mov_imm(c, RDX, pc + 8);
+			emit_mov_imm(c, RSI, insn->target);
+			emit_0f_rr(c, 0x40 | cc, RDX, RSI);
+			emit_store_next(c, RDX);
+		}
+	}
+}
+
+/* Emit one non-branch instruction. Returns false if it ended the block. */
+static bool emit_insn(struct jit_ctx *c, const struct insn *insn, uint32_t index, bool delay_slot)
+{
+	uint32_t pc = c->b->pc + index * 4;
+	uint32_t opcode = decode_opcode(insn->instruction);
+
+	if(insn->instruction == 0)
+		return true;		/* nop */
+
+	if(opcode == 0)
+	{
+		switch(decode_special_opcode(insn->instruction))
+		{
+		case INS_SLL:   emit_shift(c, insn, 4, false); return true;
+		case INS_SRL:   emit_shift(c, insn, 5, false); return true;
+		case INS_SRA:   emit_shift(c, insn, 7, false); return true;
+		case INS_SLLV:  emit_shift(c, insn, 4, true); return true;
+		case INS_SRLV:  emit_shift(c, insn, 5, true); return true;
+		case INS_SRAV:  emit_shift(c, insn, 7, true); return true;
+		case INS_MOVZ:  emit_move_cond(c, insn, CC_E); return true;
+		case INS_MOVN:  emit_move_cond(c, insn, CC_NE); return true;
+		case INS_MFHI:
+			load_guest(c, RAX, GUEST_HI);
+			store_guest(c, insn->rd, RAX);
+			return true;
+		case INS_MTHI:
+			load_guest(c, RAX, insn->rs);
+			store_guest(c, GUEST_HI, RAX);
+			return true;
+		case INS_MFLO:
+			load_guest(c, RAX, GUEST_LO);
+			store_guest(c, insn->rd, RAX);
+			return true;
+		case INS_MTLO:
+			load_guest(c, RAX, insn->rs);
+			store_guest(c, GUEST_LO, RAX);
+			return true;
+		case INS_MULT:  emit_mult(c, insn, 5); return true;
+		case INS_MULTU: emit_mult(c, insn, 4); return true;
+		case INS_ADD:
+		case INS_ADDU:  emit_alu3(c, insn, 0x01); return true;
+		case INS_SUB:
+		case INS_SUBU:  emit_alu3(c, insn, 0x29); return true;
+		case INS_AND:   emit_alu3(c, insn, 0x21); return true;
+		case INS_OR:    emit_alu3(c, insn, 0x09); return true;
+		case INS_XOR:   emit_alu3(c, insn, 0x31); return true;
+		case INS_NOR:
+			load_guest(c, RAX, insn->rs);
+			load_guest(c, RCX, insn->rt);
+			emit_rr(c, 0x09, RAX, RCX);
+			emit_unary(c, 2, RAX);
+			store_guest(c, insn->rd, RAX);
+			return true;
+		case INS_SLT:   emit_set_less(c, insn, CC_L, false); return true;
+		case INS_SLTU:  emit_set_less(c, insn, CC_B, false); return true;
+		}
+	}
+	else if(opcode == 0x1c && decode_special2_opcode(insn->instruction) == INS_MUL)
+	{
+		load_guest(c, RAX, insn->rs);
+		load_guest(c, RCX, insn->rt);
+		emit_0f_rr(c, 0xaf, RAX, RCX);
+		store_guest(c, insn->rd, RAX);
+		return true;
+	}
+	else
+	{
+		switch(opcode)
+		{
+		case INS_ADDI:
+		case INS_ADDIU: emit_alu_imm16(c, insn, 0, (int32_t)insn->im16); return true;
+		case INS_SLTI:  emit_set_less(c, insn, CC_L, true); return true;
+		case INS_SLTIU: emit_set_less(c, insn, CC_B, true); return true;
+		case INS_ANDI:  emit_alu_imm16(c, insn, 4, (uint16_t)insn->im16); return true;
+		case INS_ORI:   emit_alu_imm16(c, insn, 1, (uint16_t)insn->im16); return true;
+		case INS_XORI:  emit_alu_imm16(c, insn, 6, (uint16_t)insn->im16); return true;
+		case INS_LUI:
+			emit_mov_imm(c, RAX, (uint32_t)(uint16_t)insn->im16 << 16);
+			store_guest(c, insn->rt, RAX);
+			return true;
+		case INS_LB:
+		case INS_LH:
+		case INS_LW:
+		case INS_LBU:
+		case INS_LHU:
+			emit_load(c, insn, index, delay_slot);
+			return true;
+		case INS_SB:
+		case INS_SH:
+		case INS_SW:
+			emit_store(c, insn, index, delay_slot);
+			return true;
+		case INS_CACHE:
+			return true;
+		}
+	}
+
+	/* everything else runs in the interpreter */
+	emit_call_handler(c, insn, pc, delay_slot);
+	if(delay_slot)
+		return true;
+	if(insn->flags & INSN_END)
+	{
+		emit_exit(c, index + 1, PC_KEEP, 0);
+		return false;
+	}
+	if(insn->flags & (INSN_STORE | INSN_LOAD))
+		emit_check_valid(c, index);
+	return true;
+}
+
+/* Give host registers to the guest registers used most in the block */
+static void allocate_registers(struct jit_ctx *c)
+{
+	int32_t uses[GUEST_REGS] = { 0 };
+	const struct insn *insn;
+	int32_t best;
+	int32_t g;
+	int32_t i;
+
+	for(i = 0; i < (int32_t)c->b->count; i++)
+	{
+		insn = &c->b->insn[i];
+		uses[insn->rs]++;
+		uses[insn->rt]++;
+		uses[insn->rd]++;
+		if(decode_opcode(insn->instruction) == 0)
+		{
+			switch(decode_special_opcode(insn->instruction))
+			{
+			case INS_MULT:
+			case INS_MULTU:
+				uses[GUEST_HI]++;
+				uses[GUEST_LO]++;
+				break;
+			case INS_MFHI:
+			case INS_MTHI:
+				uses[GUEST_HI]++;
+				break;
+			case INS_MFLO:
+			case INS_MTLO:
+				uses[GUEST_LO]++;
+				break;
+			}
+		}
+	}
+
+	memset(c->host, -1, sizeof(c->host));
+	for(i = 0; i < ALLOC_REGS; i++)
+	{
+		best = -1;
+		for(g = 0; g < GUEST_REGS; g++)
+		{
+			if(c->host[g] < 0 && uses[g] >= 2 && (best < 0 || uses[g] > uses[best]))
+				best = g;
+		}
+		if(best < 0)
+			break;
+		c->host[best] = alloc_order[i];
+	}
+}
+
+static bool jit_compile(struct cpu_state *cpu, struct block *b)
+{
+	struct jit_state *jit = cpu->jit;
+	struct jit_ctx c;
+	const struct insn *insn;
+	uint32_t n = b->count;
+	uint32_t i;
+
+	/* delay slots holding a branch or ending the block are left to the interpreter */
+	if(n >= 2 && (b->insn[n - 2].flags & INSN_BRANCH) &&
+	   (b->insn[n - 1].flags & (INSN_BRANCH | INSN_END)))
+		return false;
+	if(jit->used + (n + 2) * INSN_MAX_CODE > JIT_CODE_SIZE)
+	{
+		jit->full = true;
+		return false;
+	}
+
+	c.p = jit->code + jit->used;
+	c.b = b;
+	allocate_registers(&c);
+
+	emit8(&c, 0x53);		/* push rbx, rbp, r12 .. r15 */
+	emit8(&c, 0x55);
+	emit8(&c, 0x41); emit8(&c, 0x54);
+	emit8(&c, 0x41); emit8(&c, 0x55);
+	emit8(&c, 0x41); emit8(&c, 0x56);
+	emit8(&c, 0x41); emit8(&c, 0x57);
+	emit8(&c, 0x48); emit8(&c, 0x83); emit8(&c, 0xec); emit8(&c, 0x08);	/* sub rsp, 8 */
+	emit8(&c, 0x49); emit8(&c, 0x89); emit8(&c, 0xff);			/* mov r15, rdi */
+	reload_all(&c);
+
+	for(i = 0; i < n; i++)
+	{
+		insn = &b->insn[i];
+		if(insn->flags & INSN_BRANCH)
+		{
+			emit_branch(&c, insn, i);
+			emit_insn(&c, &b->insn[i + 1], i + 1, true);
+			emit_exit(&c, n, PC_NEXT, 0);
+			break;
+		}
+		if(!emit_insn(&c, insn, i, false))
+			break;
+		if(i == n - 1)
+			emit_exit(&c, n, PC_CONST, b->pc + n * 4);
+	}
+
+	b->code = jit->code + jit->used;
+	jit->used = (c.p - jit->code + 15) & ~15;
+	return true;
+}
+
+void jit_enable(struct cpu_state *cpu, bool enable)
+{
+	if(enable && !cpu->jit)
+	{
+		cpu->jit = calloc(1, sizeof(struct jit_state));
+		cpu->jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+				      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(cpu->jit->code == MAP_FAILED)
+		{
+			printf("jit: can't map code buffer\n");
+			free(cpu->jit);
+			cpu->jit = NULL;
+			return;
+		}
+	}
+	if(cpu->jit)
+		cpu->jit->enabled = enable;
+}
+
+#else /* !__x86_64__ */
+
+static bool jit_compile(struct cpu_state *cpu, struct block *b)
+{
+	return false;
+}
+
+void jit_enable(struct cpu_state *cpu, bool enable)
+{
+	if(enable)
+		printf("jit: not supported on this host\n");
+}
+
+#endif /* __x86_64__ */
+
+void jit_flush(struct cpu_state *cpu)
+{
+	if(!cpu->jit)
+		return;
+	cpu->jit->used = 0;
+	cpu->jit->full = false;
+}
+
+/*
+ * Run a block, compiling it once it has run JIT_THRESHOLD times. Blocks
+ * entered with a delay slot still pending (after single stepping onto a
+ * branch) always go through the interpreter.
+ */
+uint32_t jit_execute(struct cpu_state *cpu, struct block *b)
+{
+	if(!b->code && !cpu->delayed_jump && ++b->runs == JIT_THRESHOLD)
+		jit_compile(cpu, b);
+	if(b->code && !cpu->delayed_jump)
+		return ((jit_code)b->code)(cpu);
+	return block_run(cpu, b);
+}
@@ -0,0 +1,50 @@
+#ifndef _MACHINE_H_
+#define _MACHINE_H_
+
+#define UART_RX_FIFO 32	/* bytes uart0 receives ahead of the guest */
+
+/*
+ * Device state of one emulated board, allocated by initialize_emulator()
+ * next to its cpu_state so several boards can run side by side.
+ */
+struct machine
+{
+	int32_t timer_int;
+	int32_t fakeflash_state;
+	int32_t flash_auto_select;
+	bool flash_log;
+
+	int32_t pll_control;
+	int32_t blk_enables;
+	int32_t perf_sys_pll;
+	int32_t irq_mask;
+	int32_t irq_stat;
+	int32_t timer_ctl0;
+	int32_t timer_ctl1;
+	int32_t timer_ctl2;
+	int32_t uart0_ctrl;
+	int32_t uart0_baud_rate;
+	int32_t uart0_mctl;
+	int32_t uart0_ir;
+	uint8_t uart0_rx[UART_RX_FIFO];
+	uint32_t uart0_rx_head;
+	uint32_t uart0_rx_count;
+	int32_t uart1_ctrl;
+	int32_t uart1_baud_rate;
+	int32_t uart1_mctl;
+	int32_t uart1_ir;
+	int32_t mpi_csbase_0;
+	int32_t mpi_csctl_0;
+	int32_t mpi_csbase_1;
+	int32_t mpi_csctl_1;
+	int32_t pci_timers;
+	int32_t sdram_cfg;
+	int32_t sdram_unk1;
+	int32_t sdram_unk2;
+	int32_t sdram_mbase;
+	int32_t sdram_unk3;
+};
+
+void machine_resync(struct cpu_state *cpu);
+
+#endif /* _MACHINE_H_ */
@@ -11,16 +11,64 @@
 #include <stdint.h>
 
 #include "emulator.h"
+#include "record.h"
+#include "gdbstub.h"
+#include "trace.h"
+#include "profile.h"
+#include "symbol.h"
+#include "hle.h"
+#include "uart.h"
 
-int32_t main(void)
+/*
+ * -r log records the inputs of this run, -p log replays them, -g port
+ * waits for gdb there before running, -t trace writes every instruction
+ * run to trace for tracedump, -P folded profiles the run and writes its
+ * stacks to folded on exit, -s symbols names addresses from nm output,
+ * -H leaves memcpy() and friends to the guest code, -L addr decompresses
+ * the image natively when the bootloader calls its LZMA decoder at addr,
+ * -u puts uart0 on a new PTY instead of the console
+ */
+int32_t main(int32_t argc, char **argv)
 {
+	int32_t opt;
+	int32_t port = 0;
+
 	initialize_emulator(&cpu, "fw.bin");
 	initialize_cpu(&cpu, FLASH_START);
-    register_callbacks();
+    register_callbacks(&cpu);
+
+	while((opt = getopt(argc, argv, "r:p:g:t:P:s:HL:u")) != -1)
+	{
+		if(opt == 'r' && !record_start(&cpu, optarg))
+			return 1;
+		if(opt == 'p' && !replay_start(&cpu, optarg))
+			return 1;
+		if(opt == 'g')
+			port = atoi(optarg);
+		if(opt == 't' && !trace_start(&cpu, optarg))
+			return 1;
+		if(opt == 'P')
+			profile_start(&cpu, optarg);
+		if(opt == 's' && !symbol_load(&cpu, optarg))
+			return 1;
+		if(opt == 'H')
+			cpu.hle = false;
+		if(opt == 'L')
+			hle_add(&cpu, "decompress_lzma_7z", strtoul(optarg, NULL, 16));
+		if(opt == 'u' && !uart_pty(&cpu))
+			return 1;
+		if(opt == '?')
+		{
+			printf("usage: %s [-r log | -p log] [-g port] [-t trace] [-P folded] [-s symbols] [-H] [-L addr] [-u]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(port && !gdb_serve(&cpu, port))
+		return 1;
 
     for(;;)
     {
-	    execute(&cpu);
+	    execute_block(&cpu);
     }
 	return 0;
 }
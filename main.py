@@ -1,10 +1,28 @@
 from ctypes import *
 
+# enum stop_reason in emulator.h
+STOP_BUDGET = 1
+STOP_PC = 2
+STOP_BREAKPOINT = 3
+STOP_UNKNOWN_INSN = 4
+STOP_HALT = 5
+STOP_WATCH = 6
+
+BATCH = 10000000
+
 if __name__ == '__main__':
     emulator = cdll.LoadLibrary('emulator.so')
-    cpu = byref(emulator.cpu)
+    emulator.execute_n.argtypes = [c_void_p, c_uint64]
+    emulator.run_until.argtypes = [c_void_p, c_uint32, c_uint64]
+    cpu = byref(c_char.in_dll(emulator, 'cpu'))
     emulator.initialize_emulator(cpu, create_string_buffer(b"fw.bin"))
     emulator.initialize_cpu(cpu, 0x9fc00000)
-    emulator.register_callbacks()
+    emulator.register_callbacks(cpu)
     while True:
-        emulator.execute(cpu)
+        reason = emulator.execute_n(cpu, BATCH)
+        if reason in (STOP_UNKNOWN_INSN, STOP_HALT):
+            print('stopped:', reason)
+            break
+        if reason == STOP_WATCH:
+            # the access is done, the next call goes on after it
+            print('watchpoint hit')
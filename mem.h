@@ -0,0 +1,182 @@
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include <arpa/inet.h>
+
+/*
+ * Guest memory is looked up through a table with one entry per 4 KiB page
+ * of the 32 bit address space. mem_read/mem_write hold the host address of
+ * pages that can be accessed directly (RAM, flash while it is not in CFI
+ * mode, the kseg1 aliases of both); every other page, and every RAM page
+ * holding predecoded code for stores, is left NULL and goes to the device
+ * in mem_type.
+ */
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE  (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK  (MEM_PAGE_SIZE - 1)
+#define MEM_PAGES      (1 << (32 - MEM_PAGE_SHIFT))
+#define MEM_RAM_PAGES  (RAM_SIZE >> MEM_PAGE_SHIFT)
+
+/*
+ * RAM and flash hold the guest's big-endian image by default. Building with
+ * HOST_ENDIAN_RAM keeps them in host order instead: words are stored as
+ * native words, and on a little-endian host halfwords and bytes are found
+ * by swizzling their address within the word. Images are converted with
+ * mem_convert() where they enter or leave the emulator.
+ */
+#if defined(HOST_ENDIAN_RAM) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MEM_SWIZZLE
+#endif
+
+#ifdef MEM_SWIZZLE
+#define MEM_ADDR16(a) ((a) ^ 2)
+#define MEM_ADDR8(a)  ((a) ^ 3)
+#define MEM_WORD(x)   (x)
+#define MEM_HALF(x)   (x)
+#else
+#define MEM_ADDR16(a) (a)
+#define MEM_ADDR8(a)  (a)
+#define MEM_WORD(x)   ntohl(x)
+#define MEM_HALF(x)   ntohs(x)
+#endif
+
+enum mem_type
+{
+	MEM_UNMAPPED = 0,
+	MEM_RAM,
+	MEM_FLASH,
+	MEM_FAKEFLASH,
+	MEM_MMIO,
+	MEM_TYPES
+};
+
+/*
+ * While stores are tracked, RAM pages are left out of mem_write until their
+ * first store. That store goes through the slow path, which saves the
+ * page as it was in prev, marks it dirty and maps it writable again.
+ *
+ * reverse.c starts over at every point of its history. The pages a delta
+ * snapshot needs, those stored to since the last snapshot, are kept apart
+ * in delta and only start over when a snapshot is saved or loaded.
+ */
+struct mem_dirty
+{
+	uint64_t bits[MEM_RAM_PAGES / 64];
+	uint64_t delta[MEM_RAM_PAGES / 64];
+	int8_t *prev;		/* RAM as of mem_dirty_reset(), dirty pages only */
+	bool delta_prev;	/* ... which is also RAM as of the last snapshot */
+};
+
+static inline bool mem_page_dirty(struct cpu_state *cpu, uint32_t page)
+{
+	return (cpu->dirty->bits[page >> 6] >> (page & 63)) & 1;
+}
+
+static inline bool mem_page_delta(struct cpu_state *cpu, uint32_t page)
+{
+	return (cpu->dirty->delta[page >> 6] >> (page & 63)) & 1;
+}
+
+/*
+ * Watchpoints on ranges of kseg0 addresses, kseg1 accesses are checked
+ * against the kseg0 view. A page holding part of a read watch is left out
+ * of mem_read and one holding part of a write watch out of mem_write, so
+ * only accesses to those pages reach the check in mem_read_slow() and
+ * mem_write_slow(). All other pages keep their direct path.
+ */
+#define WATCH_READ   0x01
+#define WATCH_WRITE  0x02
+#define WATCH_ACCESS (WATCH_READ | WATCH_WRITE)
+#define WATCH_COUNT  0x04	/* never stops, hits are only counted, for reverse.c */
+#define WATCH_MAX    16
+
+struct watchpoint
+{
+	uint32_t start;
+	uint32_t last;		/* inclusive, a range may end at 0xffffffff */
+	uint32_t type;
+};
+
+struct mem_watches
+{
+	uint32_t count;
+	struct watchpoint w[WATCH_MAX];
+	uint32_t hit;		/* the watched address the last hit accessed */
+	uint32_t hit_type;
+	uint32_t counted;	/* hits on WATCH_COUNT ranges */
+};
+
+static inline uint32_t mem_kseg0(uint32_t vaddr)
+{
+	return (vaddr >> 29) == 5 ? vaddr - 0x20000000 : vaddr;
+}
+
+void mem_init(struct cpu_state *cpu);
+void mem_dirty_reset(struct cpu_state *cpu, bool snapshot);
+bool mem_watch_add(struct cpu_state *cpu, uint32_t start, uint32_t size, uint32_t type);
+bool mem_watch_remove(struct cpu_state *cpu, uint32_t start, uint32_t size, uint32_t type);
+void mem_watch_list(struct cpu_state *cpu);
+void mem_convert(int8_t *image, uint32_t size);
+void mem_update_page(struct cpu_state *cpu, uint32_t vaddr);
+void mem_map_flash(struct cpu_state *cpu);
+uint32_t mem_read_slow(struct cpu_state *cpu, uint32_t vaddr, int32_t width);
+void mem_write_slow(struct cpu_state *cpu, uint32_t vaddr, uint32_t val, int32_t width);
+
+static inline int32_t load_word(struct cpu_state *cpu, uint32_t vaddr)
+{
+	int8_t *page = cpu->mem_read[vaddr >> MEM_PAGE_SHIFT];
+
+	if(page)
+		return MEM_WORD(*(int32_t *)(page + (vaddr & MEM_PAGE_MASK)));
+	return mem_read_slow(cpu, vaddr, 4);
+}
+
+static inline uint16_t load_short(struct cpu_state *cpu, uint32_t vaddr)
+{
+	int8_t *page = cpu->mem_read[vaddr >> MEM_PAGE_SHIFT];
+
+	if(page)
+		return MEM_HALF(*(int16_t *)(page + MEM_ADDR16(vaddr & MEM_PAGE_MASK)));
+	return mem_read_slow(cpu, vaddr, 2);
+}
+
+static inline uint8_t load_byte(struct cpu_state *cpu, uint32_t vaddr)
+{
+	int8_t *page = cpu->mem_read[vaddr >> MEM_PAGE_SHIFT];
+
+	if(page)
+		return *(page + MEM_ADDR8(vaddr & MEM_PAGE_MASK));
+	return mem_read_slow(cpu, vaddr, 1);
+}
+
+static inline void store_word(struct cpu_state *cpu, uint32_t vaddr, int32_t val)
+{
+	int8_t *page = cpu->mem_write[vaddr >> MEM_PAGE_SHIFT];
+
+	if(page)
+		*(int32_t *)(page + (vaddr & MEM_PAGE_MASK)) = MEM_WORD(val);
+	else
+		mem_write_slow(cpu, vaddr, val, 4);
+}
+
+static inline void store_short(struct cpu_state *cpu, uint32_t vaddr, int16_t val)
+{
+	int8_t *page = cpu->mem_write[vaddr >> MEM_PAGE_SHIFT];
+
+	if(page)
+		*(int16_t *)(page + MEM_ADDR16(vaddr & MEM_PAGE_MASK)) = MEM_HALF(val);
+	else
+		mem_write_slow(cpu, vaddr, (uint16_t)val, 2);
+}
+
+static inline void store_byte(struct cpu_state *cpu, uint32_t vaddr, int8_t val)
+{
+	int8_t *page = cpu->mem_write[vaddr >> MEM_PAGE_SHIFT];
+
+	if(page)
+		*(page + MEM_ADDR8(vaddr & MEM_PAGE_MASK)) = val;
+	else
+		mem_write_slow(cpu, vaddr, (uint8_t)val, 1);
+}
+
+#endif /* _MEM_H_ */
@@ -0,0 +1,412 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "opcode.h"
+#include "profile.h"
+#include "symbol.h"
+
+#define PROFILE_NAME_MAX (SYMBOL_NAME_MAX + 16)	/* name+offset */
+
+/*
+ * Every block run (every instruction while stepping) adds its instruction
+ * count to the block it started at and to the function running. Functions
+ * are the targets of jal, jalr and bal; a shadow stack of them is kept by
+ * following those calls and the jr $ra that return to one of the
+ * addresses they left. Each distinct stack is a node of a call tree,
+ * found from its caller's node through a hash table, so the folded stacks
+ * fall out of the tree at the end. Code reached without a call seen, the
+ * boot code and whatever ran before profiling started, is the root.
+ */
+struct prof_block
+{
+	uint32_t pc;
+	uint32_t runs;
+	uint64_t insns;
+};
+
+struct prof_node
+{
+	uint32_t func;
+	uint32_t parent;
+	uint64_t self;		/* instructions run in func itself */
+	uint64_t total;		/* ... and in its callees, see profile_dump() */
+};
+
+struct prof_frame
+{
+	uint32_t node;
+	uint32_t ret;		/* where jr $ra leaves it */
+};
+
+enum prof_pending
+{
+	PROF_NONE = 0,
+	PROF_CALL,
+	PROF_RETURN,
+};
+
+struct profiler
+{
+	char *folded;		/* written by profile_stop() */
+	uint64_t total;
+	struct prof_block *blocks;	/* hash on pc */
+	uint32_t nblocks;
+	uint32_t block_size;
+	struct prof_node *nodes;	/* nodes[0] is the root */
+	uint32_t nnodes;
+	uint32_t node_size;
+	uint32_t *children;	/* hash on parent and func of node indexes */
+	uint32_t child_size;
+	uint32_t node;		/* the stack running */
+	uint32_t depth;
+	struct prof_frame stack[PROFILE_DEPTH];
+	/* a call or return whose delay slot may not have run yet */
+	enum prof_pending pending;
+	uint32_t delay;
+	uint32_t ret;
+};
+
+/* exit() from anywhere still writes the profile */
+static struct cpu_state *profiled;
+
+static inline uint32_t prof_hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	return x;
+}
+
+static struct prof_block *prof_block(struct profiler *p, uint32_t pc)
+{
+	struct prof_block *old = p->blocks;
+	uint32_t i, size = p->block_size;
+
+	for(i = prof_hash(pc) & (p->block_size - 1); p->blocks[i].runs; i = (i + 1) & (p->block_size - 1))
+	{
+		if(p->blocks[i].pc == pc)
+			return &p->blocks[i];
+	}
+	if(2 * (p->nblocks + 1) > p->block_size)
+	{
+		p->block_size *= 2;
+		p->blocks = calloc(p->block_size, sizeof(struct prof_block));
+		p->nblocks = 0;
+		for(i = 0; i < size; i++)
+		{
+			if(old[i].runs)
+				*prof_block(p, old[i].pc) = old[i];
+		}
+		free(old);
+		return prof_block(p, pc);
+	}
+	p->nblocks++;
+	p->blocks[i].pc = pc;
+	return &p->blocks[i];
+}
+
+static uint32_t prof_child_slot(struct profiler *p, uint32_t parent, uint32_t func)
+{
+	uint32_t i, n;
+
+	for(i = prof_hash(func ^ prof_hash(parent)) & (p->child_size - 1); (n = p->children[i]); i = (i + 1) & (p->child_size - 1))
+	{
+		if(p->nodes[n].parent == parent && p->nodes[n].func == func)
+			break;
+	}
+	return i;
+}
+
+/* The node of func called from parent, made on its first call */
+static uint32_t prof_child(struct profiler *p, uint32_t parent, uint32_t func)
+{
+	uint32_t i = prof_child_slot(p, parent, func), n;
+
+	if(p->children[i])
+		return p->children[i];
+	if(p->nnodes == p->node_size)
+	{
+		p->node_size *= 2;
+		p->nodes = realloc(p->nodes, p->node_size * sizeof(struct prof_node));
+	}
+	n = p->nnodes++;
+	memset(&p->nodes[n], 0, sizeof(struct prof_node));
+	p->nodes[n].func = func;
+	p->nodes[n].parent = parent;
+	if(2 * p->nnodes > p->child_size)
+	{
+		free(p->children);
+		p->child_size *= 2;
+		p->children = calloc(p->child_size, sizeof(uint32_t));
+		for(i = 1; i < p->nnodes; i++)
+			p->children[prof_child_slot(p, p->nodes[i].parent, p->nodes[i].func)] = i;
+	}
+	else
+		p->children[i] = n;
+	return n;
+}
+
+/* Execution went on at pc after a call or return */
+static void prof_resolve(struct profiler *p, uint32_t pc)
+{
+	uint32_t i;
+
+	if(p->pending == PROF_CALL && pc != p->ret && p->depth < PROFILE_DEPTH)
+	{
+		p->node = prof_child(p, p->node, pc);
+		p->stack[p->depth].node = p->node;
+		p->stack[p->depth].ret = p->ret;
+		p->depth++;
+	}
+	else if(p->pending == PROF_RETURN)
+	{
+		/* frames a longjmp or an exception skipped go too */
+		for(i = p->depth; i-- > 0; )
+		{
+			if(p->stack[i].ret == pc)
+			{
+				p->depth = i;
+				p->node = i ? p->stack[i - 1].node : 0;
+				break;
+			}
+		}
+	}
+	p->pending = PROF_NONE;
+}
+
+static void profile_exit(void)
+{
+	if(profiled)
+		profile_stop(profiled);
+}
+
+/* Count from now on, writing the folded stacks to folded once stopped */
+bool profile_start(struct cpu_state *cpu, const char *folded)
+{
+	static bool registered;
+	struct profiler *p;
+
+	profile_stop(cpu);
+	p = calloc(1, sizeof(struct profiler));
+	p->folded = strdup(folded);
+	p->block_size = 4096;
+	p->blocks = calloc(p->block_size, sizeof(struct prof_block));
+	p->node_size = 1024;
+	p->nodes = calloc(p->node_size, sizeof(struct prof_node));
+	p->nnodes = 1;
+	p->child_size = 4096;
+	p->children = calloc(p->child_size, sizeof(uint32_t));
+	cpu->prof = p;
+	profiled = cpu;
+	if(!registered)
+		atexit(profile_exit);
+	registered = true;
+	return true;
+}
+
+void profile_stop(struct cpu_state *cpu)
+{
+	struct profiler *p = cpu->prof;
+
+	if(!p)
+		return;
+	profile_dump(cpu, p->folded);
+	free(p->folded);
+	free(p->blocks);
+	free(p->nodes);
+	free(p->children);
+	free(p);
+	cpu->prof = NULL;
+	if(profiled == cpu)
+		profiled = NULL;
+}
+
+void profile_count(struct cpu_state *cpu, uint32_t pc, uint32_t n)
+{
+	struct profiler *p = cpu->prof;
+	struct prof_block *b;
+
+	/* history being repeated was counted the first time round */
+	if(cpu->rerun || !n)
+		return;
+	if(p->pending && pc != p->delay)
+		prof_resolve(p, pc);
+	b = prof_block(p, pc);
+	b->runs++;
+	b->insns += n;
+	p->nodes[p->node].self += n;
+	p->total += n;
+}
+
+/* The branch at pc has run; its delay slot is counted next */
+void profile_branch(struct cpu_state *cpu, const struct insn *insn, uint32_t pc)
+{
+	struct profiler *p = cpu->prof;
+	uint32_t op = decode_opcode(insn->instruction);
+
+	if(cpu->rerun)
+		return;
+	if(op == INS_JAL || (op == 0 && decode_special_opcode(insn->instruction) == INS_JALR) ||
+	   (op == 1 && (insn->rt & 0x1c) == 0x10))
+		p->pending = PROF_CALL;
+	else if(op == 0 && decode_special_opcode(insn->instruction) == INS_JR && insn->rs == 31)
+		p->pending = PROF_RETURN;
+	else
+		return;
+	p->delay = pc + 4;
+	p->ret = pc + 8;
+}
+
+static const char *prof_name(struct cpu_state *cpu, uint32_t func, char *buf)
+{
+	if(!func)
+		return "[unknown]";
+	return symbol_format(cpu, func, buf, PROFILE_NAME_MAX);
+}
+
+static int prof_block_cmp(const void *a, const void *b)
+{
+	const struct prof_block *x = a, *y = b;
+
+	return x->insns < y->insns ? 1 : x->insns > y->insns ? -1 : 0;
+}
+
+struct prof_func
+{
+	uint32_t func;
+	uint64_t self;
+	uint64_t total;
+};
+
+static int prof_func_cmp(const void *a, const void *b)
+{
+	const struct prof_func *x = a, *y = b;
+
+	if(x->self != y->self)
+		return x->self < y->self ? 1 : -1;
+	return x->func < y->func ? -1 : x->func > y->func;
+}
+
+static int prof_func_addr_cmp(const void *a, const void *b)
+{
+	const struct prof_func *x = a, *y = b;
+
+	return x->func < y->func ? -1 : x->func > y->func;
+}
+
+/* Write the folded stacks of the tree below node, path being its caller's */
+static void prof_fold(struct cpu_state *cpu, struct profiler *p, FILE *f, const uint32_t *first, const uint32_t *next,
+		      uint32_t node, char *path, size_t len)
+{
+	char buf[PROFILE_NAME_MAX];
+	const char *name = prof_name(cpu, p->nodes[node].func, buf);
+	uint32_t i;
+
+	/* the root's callees start stacks of their own */
+	if(node)
+		len += sprintf(path + len, "%s%s", len ? ";" : "", name);
+	if(p->nodes[node].self)
+		fprintf(f, "%s %llu\n", node ? path : name, (unsigned long long)p->nodes[node].self);
+	for(i = first[node]; i; i = next[i])
+		prof_fold(cpu, p, f, first, next, i, path, len);
+}
+
+/*
+ * Print the hottest functions and blocks, and write every stack seen with
+ * the instructions run in it to folded, in the format flamegraph.pl reads.
+ */
+void profile_dump(struct cpu_state *cpu, const char *folded)
+{
+	struct profiler *p = cpu->prof;
+	struct prof_block *blocks;
+	struct prof_func *funcs;
+	uint32_t i, j, n, nfuncs;
+	uint32_t *first, *next;
+	char buf[PROFILE_NAME_MAX], *path;
+	FILE *out;
+
+	if(!p)
+	{
+		printf("profile off\n");
+		return;
+	}
+	if(!p->total)
+		return;
+
+	/* children come after their parents, add them up backwards */
+	for(i = 0; i < p->nnodes; i++)
+		p->nodes[i].total = p->nodes[i].self;
+	for(i = p->nnodes; i-- > 1; )
+		p->nodes[p->nodes[i].parent].total += p->nodes[i].total;
+
+	funcs = calloc(p->nnodes, sizeof(struct prof_func));
+	for(i = 0; i < p->nnodes; i++)
+	{
+		funcs[i].func = p->nodes[i].func;
+		funcs[i].self = p->nodes[i].self;
+		/* recursion is only counted at its outermost call */
+		for(n = p->nodes[i].parent; n && p->nodes[n].func != funcs[i].func; n = p->nodes[n].parent)
+			;
+		if(!i || !n)
+			funcs[i].total = p->nodes[i].total;
+	}
+	qsort(funcs, p->nnodes, sizeof(struct prof_func), prof_func_addr_cmp);
+	for(i = 0, nfuncs = 0; i < p->nnodes; i++)
+	{
+		if(nfuncs && funcs[nfuncs - 1].func == funcs[i].func)
+		{
+			funcs[nfuncs - 1].self += funcs[i].self;
+			funcs[nfuncs - 1].total += funcs[i].total;
+		}
+		else
+			funcs[nfuncs++] = funcs[i];
+	}
+	qsort(funcs, nfuncs, sizeof(struct prof_func), prof_func_cmp);
+	printf("profile: %llu instructions, %u functions, %u blocks\n",
+	       (unsigned long long)p->total, nfuncs, p->nblocks);
+	printf("  self%%  total%%        self  function\n");
+	for(i = 0; i < nfuncs && i < PROFILE_HOT; i++)
+		printf("%6.2f %7.2f %11llu  %s\n", 100.0 * funcs[i].self / p->total, 100.0 * funcs[i].total / p->total,
+		       (unsigned long long)funcs[i].self, prof_name(cpu, funcs[i].func, buf));
+	free(funcs);
+
+	blocks = malloc(p->nblocks * sizeof(struct prof_block));
+	for(i = j = 0; i < p->block_size; i++)
+	{
+		if(p->blocks[i].runs)
+			blocks[j++] = p->blocks[i];
+	}
+	qsort(blocks, p->nblocks, sizeof(struct prof_block), prof_block_cmp);
+	printf("  insn%%        runs  block\n");
+	for(i = 0; i < p->nblocks && i < PROFILE_HOT; i++)
+		printf("%6.2f %11u  %s\n", 100.0 * blocks[i].insns / p->total, blocks[i].runs,
+		       symbol_format(cpu, blocks[i].pc, buf, sizeof(buf)));
+	free(blocks);
+
+	if(!folded || !*folded)
+		return;
+	out = fopen(folded, "w");
+	if(!out)
+	{
+		printf("profile: cannot create %s\n", folded);
+		return;
+	}
+	first = calloc(p->nnodes, sizeof(uint32_t));
+	next = calloc(p->nnodes, sizeof(uint32_t));
+	for(i = p->nnodes; i-- > 1; )
+	{
+		next[i] = first[p->nodes[i].parent];
+		first[p->nodes[i].parent] = i;
+	}
+	path = malloc(PROFILE_DEPTH * sizeof(buf) + 1);
+	prof_fold(cpu, p, out, first, next, 0, path, 0);
+	free(path);
+	free(first);
+	free(next);
+	fclose(out);
+}
@@ -0,0 +1,13 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#define PROFILE_DEPTH 256	/* calls followed, deeper ones count in the caller */
+#define PROFILE_HOT   25	/* lines in each part of the hot list */
+
+bool profile_start(struct cpu_state *cpu, const char *folded);
+void profile_stop(struct cpu_state *cpu);
+void profile_dump(struct cpu_state *cpu, const char *folded);
+void profile_count(struct cpu_state *cpu, uint32_t pc, uint32_t n);
+void profile_branch(struct cpu_state *cpu, const struct insn *insn, uint32_t pc);
+
+#endif /* _PROFILE_H_ */
@@ -0,0 +1,238 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "scheduler.h"
+#include "record.h"
+#include "reverse.h"
+
+#define RECORD_DATA_MAX 4096	/* longest single input */
+
+struct recorder
+{
+	FILE *f;
+	bool replay;
+	uint64_t last;		/* clock of the previous entry */
+	/* replay: the next entry, valid while have is set */
+	bool have;
+	uint64_t when;
+	uint32_t pc;
+	uint32_t source;
+	uint32_t size;
+	uint8_t data[RECORD_DATA_MAX];
+};
+
+static void put_varint(FILE *f, uint64_t val)
+{
+	while(val >= 0x80)
+	{
+		fputc((val & 0x7f) | 0x80, f);
+		val >>= 7;
+	}
+	fputc(val, f);
+}
+
+static bool get_varint(FILE *f, uint64_t *val)
+{
+	uint32_t shift;
+	int32_t c;
+
+	*val = 0;
+	for(shift = 0; shift < 64; shift += 7)
+	{
+		c = fgetc(f);
+		if(c == EOF)
+			return false;
+		*val |= (uint64_t)(c & 0x7f) << shift;
+		if(!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static void record_entry(struct cpu_state *cpu, enum input_source source, const void *buf, size_t size)
+{
+	struct recorder *r = cpu->rec;
+	uint32_t pc = cpu->pc;
+	uint8_t le[4] = { pc, pc >> 8, pc >> 16, pc >> 24 };
+
+	put_varint(r->f, cpu->sched->now - r->last);
+	put_varint(r->f, source);
+	put_varint(r->f, size);
+	fwrite(le, 1, sizeof(le), r->f);
+	fwrite(buf, 1, size, r->f);
+	/* the log has to survive the crash it is meant to reproduce */
+	fflush(r->f);
+	r->last = cpu->sched->now;
+}
+
+/* Read ahead the entry replay delivers next */
+static void replay_next(struct recorder *r)
+{
+	uint64_t delta, source, size;
+	uint8_t le[4];
+
+	r->have = get_varint(r->f, &delta) && get_varint(r->f, &source) &&
+		get_varint(r->f, &size) && size <= RECORD_DATA_MAX &&
+		fread(le, 1, sizeof(le), r->f) == sizeof(le) &&
+		fread(r->data, 1, size, r->f) == size;
+	if(!r->have)
+		return;
+	r->when = r->last + delta;
+	r->last = r->when;
+	r->source = source;
+	r->size = size;
+	r->pc = le[0] | le[1] << 8 | le[2] << 16 | (uint32_t)le[3] << 24;
+}
+
+static bool record_open(struct cpu_state *cpu, const char *path, bool replay)
+{
+	struct record_header h;
+	struct recorder *r;
+	FILE *f;
+
+	record_stop(cpu);
+	f = fopen(path, replay ? "rb" : "wb");
+	if(!f)
+	{
+		printf("record: cannot open %s\n", path);
+		return false;
+	}
+	if(replay)
+	{
+		if(fread(&h, sizeof(h), 1, f) != 1 ||
+		   memcmp(h.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC)) != 0 ||
+		   h.version != RECORD_VERSION)
+		{
+			printf("record: %s is not an input log\n", path);
+			fclose(f);
+			return false;
+		}
+	}
+	else
+	{
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+		h.version = RECORD_VERSION;
+		fwrite(&h, sizeof(h), 1, f);
+	}
+
+	r = calloc(1, sizeof(*r));
+	r->f = f;
+	r->replay = replay;
+	r->last = cpu->sched->now;
+	if(replay)
+		replay_next(r);
+	cpu->rec = r;
+	return true;
+}
+
+/*
+ * Log every external input from now on. Replaying the log from the same
+ * starting state, a fresh boot or the same snapshot, runs the same.
+ */
+bool record_start(struct cpu_state *cpu, const char *path)
+{
+	return record_open(cpu, path, false);
+}
+
+/* Feed the inputs of a log back instead of reading them */
+bool replay_start(struct cpu_state *cpu, const char *path)
+{
+	return record_open(cpu, path, true);
+}
+
+void record_stop(struct cpu_state *cpu)
+{
+	if(!cpu->rec)
+		return;
+	fclose(cpu->rec->f);
+	free(cpu->rec);
+	cpu->rec = NULL;
+}
+
+/* Inputs after the end of the log or a divergence are read live */
+static void replay_end(struct cpu_state *cpu, const char *why)
+{
+	struct recorder *r = cpu->rec;
+
+	if(r->have)
+		printf("replay: %s at %llu pc 0x%08x, log has source %u at %llu pc 0x%08x\n", why,
+		       (unsigned long long)cpu->sched->now, cpu->pc, r->source,
+		       (unsigned long long)r->when, r->pc);
+	else
+		printf("replay: end of log at %llu\n", (unsigned long long)cpu->sched->now);
+	record_stop(cpu);
+}
+
+static ssize_t input(struct cpu_state *cpu, enum input_source source, int32_t fd, void *buf, size_t size, bool poll_only)
+{
+	struct recorder *r = cpu->rec;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	ssize_t n;
+
+	if(size > RECORD_DATA_MAX)
+		size = RECORD_DATA_MAX;
+	/* history being repeated gets what arrived the first time round */
+	if(cpu->rerun)
+		return reverse_input_again(cpu, source, buf, size);
+	if(r && r->replay)
+	{
+		if(r->have && r->when == cpu->sched->now && r->source == source)
+		{
+			if(r->size > size || r->pc != (uint32_t)cpu->pc)
+			{
+				replay_end(cpu, "diverged");
+			}
+			else
+			{
+				n = r->size;
+				memcpy(buf, r->data, n);
+				replay_next(r);
+				if(cpu->rev)
+					reverse_input(cpu, source, buf, n);
+				return n;
+			}
+		}
+		else if(r->have && r->when >= cpu->sched->now && poll_only)
+		{
+			/* nothing arrived from source at this point of the recording */
+			return 0;
+		}
+		else
+		{
+			replay_end(cpu, "diverged");
+		}
+	}
+
+	if(poll_only && (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN)))
+		return 0;
+	n = read(fd, buf, size);
+	if(cpu->rec && n > 0)
+		record_entry(cpu, source, buf, n);
+	if(cpu->rev && n > 0)
+		reverse_input(cpu, source, buf, n);
+	return n;
+}
+
+/*
+ * read() from fd, logging what was read or delivering it from the log.
+ * The caller may block waiting for it, so during replay the log must have
+ * the input right here.
+ */
+ssize_t input_read(struct cpu_state *cpu, enum input_source source, int32_t fd, void *buf, size_t size)
+{
+	return input(cpu, source, fd, buf, size, false);
+}
+
+/* As input_read(), but returns 0 rather than wait when nothing is pending */
+ssize_t input_poll(struct cpu_state *cpu, enum input_source source, int32_t fd, void *buf, size_t size)
+{
+	return input(cpu, source, fd, buf, size, true);
+}
@@ -0,0 +1,34 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#define RECORD_MAGIC   "TCMREC"
+#define RECORD_VERSION 1
+
+/* Where an external input came from */
+enum input_source
+{
+	INPUT_CLI = 1,		/* a debugger command line read by cli() */
+	INPUT_UART0_RX,
+	INPUT_UART1_RX,
+};
+
+/*
+ * A log is a struct record_header followed by one entry per input that
+ * delivered data: the scheduler clock since the previous entry, the
+ * source and the size as LEB128 varints, the pc as 4 little endian bytes
+ * and then the data. Reads that return nothing are not logged.
+ */
+struct record_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+};
+
+bool record_start(struct cpu_state *cpu, const char *path);
+bool replay_start(struct cpu_state *cpu, const char *path);
+void record_stop(struct cpu_state *cpu);
+ssize_t input_read(struct cpu_state *cpu, enum input_source source, int32_t fd, void *buf, size_t size);
+ssize_t input_poll(struct cpu_state *cpu, enum input_source source, int32_t fd, void *buf, size_t size);
+
+#endif /* _RECORD_H_ */
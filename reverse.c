@@ -0,0 +1,493 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "mem.h"
+#include "machine.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "reverse.h"
+
+/*
+ * Reverse execution goes back to the last point in time at or before the
+ * target and runs forward again from there; everything but external input
+ * is deterministic. Points are taken every interval cycles, whenever the
+ * CLI prompted (the way on may have changed) and on entry to run_until().
+ * Each holds the registers and device state, and the RAM pages that
+ * changed since the previous point as they were at it. The pages changed
+ * since the last point are the ones the store tracking of mem.h keeps.
+ * External input is not repeatable, so what record.c delivered is kept
+ * beside the points and handed out again when history is run again.
+ */
+struct reverse_point
+{
+	uint64_t now;
+	uint64_t skipped;
+	struct exec_mode mode;	/* how execution went on from here */
+	struct snapshot_cpu cpu;
+	struct machine mach;
+	uint32_t pages;
+	uint32_t *page;		/* RAM pages that differ from the previous point */
+	int8_t *data;		/* ... as they were at the previous point */
+};
+
+/* An input that delivered data, and when */
+struct reverse_input
+{
+	uint64_t now;
+	uint32_t source;
+	uint32_t size;
+	uint8_t *data;
+};
+
+struct reverse
+{
+	uint64_t interval;
+	uint64_t budget;
+	uint64_t used;		/* bytes held by the points */
+	bool busy;		/* going back, points must stay where they are */
+	struct exec_mode mode;	/* how execution goes on at the moment */
+	uint32_t count;
+	uint32_t size;
+	struct reverse_point **points;	/* oldest first */
+	uint32_t inputs;
+	uint32_t inputs_size;
+	struct reverse_input *input;	/* oldest first */
+};
+
+static uint64_t point_size(const struct reverse_point *p)
+{
+	return sizeof(*p) + (uint64_t)p->pages * (MEM_PAGE_SIZE + sizeof(uint32_t));
+}
+
+static void point_drop_pages(struct reverse *rv, struct reverse_point *p)
+{
+	rv->used -= (uint64_t)p->pages * (MEM_PAGE_SIZE + sizeof(uint32_t));
+	free(p->page);
+	free(p->data);
+	p->page = NULL;
+	p->data = NULL;
+	p->pages = 0;
+}
+
+static void point_free(struct reverse *rv, struct reverse_point *p)
+{
+	point_drop_pages(rv, p);
+	rv->used -= sizeof(*p);
+	free(p);
+}
+
+/* Forget the inputs from first on */
+static void input_drop(struct reverse *rv, uint32_t first)
+{
+	while(rv->inputs > first)
+	{
+		rv->inputs--;
+		rv->used -= sizeof(struct reverse_input) + rv->input[rv->inputs].size;
+		free(rv->input[rv->inputs].data);
+	}
+}
+
+/* The first input at when or later */
+static uint32_t input_find(struct reverse *rv, uint64_t when)
+{
+	uint32_t lo = 0, hi = rv->inputs, mid;
+
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if(rv->input[mid].now < when)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Going on from here reads new input, not what came after the first time */
+static void input_rewind(struct cpu_state *cpu)
+{
+	input_drop(cpu->rev, input_find(cpu->rev, cpu->sched->now + 1));
+}
+
+/* Forget the oldest points until the history fits the budget again */
+static void reverse_trim(struct reverse *rv)
+{
+	uint32_t old, i;
+
+	while(rv->used > rv->budget && rv->count > 1)
+	{
+		point_free(rv, rv->points[0]);
+		memmove(rv->points, rv->points + 1, --rv->count * sizeof(rv->points[0]));
+		/* nothing is older to go back to */
+		point_drop_pages(rv, rv->points[0]);
+	}
+	old = input_find(rv, rv->points[0]->now);
+	if(!old)
+		return;
+	for(i = 0; i < old; i++)
+	{
+		rv->used -= sizeof(struct reverse_input) + rv->input[i].size;
+		free(rv->input[i].data);
+	}
+	memmove(rv->input, rv->input + old, (rv->inputs - old) * sizeof(rv->input[0]));
+	rv->inputs -= old;
+}
+
+static void reverse_take(struct cpu_state *cpu, bool resume)
+{
+	struct reverse *rv = cpu->rev;
+	struct reverse_point *p = calloc(1, sizeof(*p));
+	uint32_t i;
+
+	if(cpu->dirty && rv->count)
+	{
+		p->page = malloc(MEM_RAM_PAGES * sizeof(uint32_t));
+		for(i = 0; i < MEM_RAM_PAGES; i++)
+		{
+			if(mem_page_dirty(cpu, i) &&
+			   !snapshot_page_equal(cpu->ram + (i << MEM_PAGE_SHIFT), cpu->dirty->prev + (i << MEM_PAGE_SHIFT)))
+				p->page[p->pages++] = i;
+		}
+		p->data = malloc((uint64_t)p->pages << MEM_PAGE_SHIFT);
+		for(i = 0; i < p->pages; i++)
+			memcpy(p->data + ((uint64_t)i << MEM_PAGE_SHIFT),
+			       cpu->dirty->prev + (p->page[i] << MEM_PAGE_SHIFT), MEM_PAGE_SIZE);
+	}
+	p->now = cpu->sched->now;
+	p->skipped = cpu->sched->skipped;
+	p->mode = rv->mode;
+	p->mode.resume = resume;
+	snapshot_cpu_save(cpu, &p->cpu);
+	p->mach = *cpu->mach;
+
+	if(rv->count == rv->size)
+	{
+		rv->size = rv->size ? rv->size * 2 : 64;
+		rv->points = realloc(rv->points, rv->size * sizeof(rv->points[0]));
+	}
+	rv->points[rv->count++] = p;
+	rv->used += point_size(p);
+
+	mem_dirty_reset(cpu, false);
+	if(!rv->busy)
+		reverse_trim(rv);
+}
+
+static void reverse_event(struct cpu_state *cpu);
+
+static void reverse_schedule(struct cpu_state *cpu)
+{
+	uint64_t now = cpu->sched->now;
+
+	sched_add(cpu, now - now % cpu->rev->interval + cpu->rev->interval, reverse_event);
+}
+
+/* A periodic point, once everything else due at the same time has fired */
+static void reverse_event(struct cpu_state *cpu)
+{
+	sched_run(cpu);
+	reverse_take(cpu, false);
+	reverse_schedule(cpu);
+}
+
+/* Go back to point k, forgetting the later ones */
+static void reverse_restore(struct cpu_state *cpu, uint32_t k)
+{
+	struct reverse *rv = cpu->rev;
+	struct reverse_point *p;
+	uint32_t i;
+
+	/*
+	 * RAM as of the last point, then as of each one before it down to k.
+	 * The next delta snapshot holds every page put back.
+	 */
+	for(i = 0; i < MEM_RAM_PAGES; i++)
+	{
+		if(mem_page_dirty(cpu, i))
+			memcpy(cpu->ram + (i << MEM_PAGE_SHIFT), cpu->dirty->prev + (i << MEM_PAGE_SHIFT), MEM_PAGE_SIZE);
+	}
+	while(rv->count > k + 1)
+	{
+		p = rv->points[--rv->count];
+		for(i = 0; i < p->pages; i++)
+		{
+			memcpy(cpu->ram + (p->page[i] << MEM_PAGE_SHIFT),
+			       p->data + ((uint64_t)i << MEM_PAGE_SHIFT), MEM_PAGE_SIZE);
+			cpu->dirty->delta[p->page[i] >> 6] |= 1ull << (p->page[i] & 63);
+		}
+		point_free(rv, p);
+	}
+
+	p = rv->points[k];
+	snapshot_cpu_restore(cpu, &p->cpu);
+	*cpu->mach = p->mach;
+	cpu->sched->now = p->now;
+	cpu->sched->skipped = p->skipped;
+	cpu->stop = STOP_NONE;
+	rv->mode = p->mode;
+	rv->mode.resume = false;
+	machine_resync(cpu);
+	reverse_schedule(cpu);
+	mem_dirty_reset(cpu, false);
+}
+
+/* The last point at or before when, or the oldest */
+static uint32_t reverse_find(struct reverse *rv, uint64_t when)
+{
+	uint32_t lo = 0, hi = rv->count - 1, mid;
+
+	while(lo < hi)
+	{
+		mid = (lo + hi + 1) / 2;
+		if(rv->points[mid]->now <= when)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/*
+ * Run forward from point k up to target, through the breakpoints on the
+ * way. A breakpoint at target is left fired.
+ */
+static void reverse_reach(struct cpu_state *cpu, uint32_t k, uint64_t target)
+{
+	struct exec_mode mode;
+	uint64_t unit;
+
+	reverse_restore(cpu, k);
+	mode = cpu->rev->mode;
+	mode.resume = cpu->rev->points[k]->mode.resume;
+	while(rerun_until(cpu, &mode, target, UINT64_MAX, &unit) == STOP_BREAKPOINT &&
+	      cpu->sched->now < target)
+		mode.resume = true;
+	input_rewind(cpu);
+}
+
+/*
+ * Keep a history of the machine from now on, with a point at least every
+ * interval cycles and no more than budget bytes of it.
+ */
+bool reverse_enable(struct cpu_state *cpu, uint64_t interval, uint64_t budget)
+{
+	if(!interval)
+	{
+		printf("reverse: the interval cannot be 0\n");
+		return false;
+	}
+	reverse_disable(cpu);
+	cpu->rev = calloc(1, sizeof(struct reverse));
+	cpu->rev->interval = interval;
+	cpu->rev->budget = budget;
+	reverse_schedule(cpu);
+	reverse_point(cpu);
+	return true;
+}
+
+void reverse_disable(struct cpu_state *cpu)
+{
+	if(!cpu->rev)
+		return;
+	reverse_forget(cpu);
+	sched_cancel(cpu, reverse_event);
+	free(cpu->rev->points);
+	free(cpu->rev->input);
+	free(cpu->rev);
+	cpu->rev = NULL;
+}
+
+/*
+ * A point from which execution may go on differently than before: after
+ * the CLI prompted, or where a snapshot was saved. Interrupts and
+ * callbacks at pc were already handled.
+ */
+void reverse_point(struct cpu_state *cpu)
+{
+	struct reverse *rv = cpu->rev;
+
+	if(!cpu->batch)
+	{
+		memset(&rv->mode, 0, sizeof(rv->mode));
+		rv->mode.stepping = !cpu->run || cpu->debug || cpu->trace;
+	}
+	reverse_take(cpu, true);
+}
+
+/* run_until() starts, with the stop address and the budget end it uses */
+void reverse_batch(struct cpu_state *cpu, uint32_t pc, uint64_t end, bool resume)
+{
+	struct reverse *rv = cpu->rev;
+
+	memset(&rv->mode, 0, sizeof(rv->mode));
+	rv->mode.batch = true;
+	rv->mode.stepping = cpu->trace != NULL;
+	rv->mode.pc = pc;
+	rv->mode.end = end;
+	reverse_take(cpu, resume);
+}
+
+/* The machine was replaced wholesale, e.g. by snapshot_load() */
+void reverse_forget(struct cpu_state *cpu)
+{
+	struct reverse *rv = cpu->rev;
+
+	while(rv->count)
+		point_free(rv, rv->points[--rv->count]);
+	input_drop(rv, 0);
+	reverse_schedule(cpu);
+}
+
+/* Go back n instructions, or to the start of the history */
+bool reverse_stepi(struct cpu_state *cpu, uint64_t n)
+{
+	struct reverse *rv = cpu->rev;
+	uint64_t now = cpu->sched->now;
+	uint64_t target = n < now ? now - n : 0;
+	bool ok = true;
+
+	if(target < rv->points[0]->now)
+	{
+		printf("reverse: history starts at %llu\n", (unsigned long long)rv->points[0]->now);
+		target = rv->points[0]->now;
+		ok = false;
+	}
+	rv->busy = true;
+	reverse_reach(cpu, reverse_find(rv, target), target);
+	rv->busy = false;
+	return ok;
+}
+
+/*
+ * Go back to the last breakpoint hit or, with a size, the last store to
+ * vaddr..vaddr + size - 1 in RAM. A store is stopped at before it runs.
+ * Every segment between two points is run again from its start looking
+ * for the last hit in it, newest segment first. Without a hit the
+ * history is gone through to its start.
+ */
+bool reverse_continue(struct cpu_state *cpu, uint32_t vaddr, uint32_t size)
+{
+	struct reverse *rv = cpu->rev;
+	uint64_t now = cpu->sched->now;
+	uint32_t offset = (vaddr & ~0x20000000) - RAM_START;
+	uint32_t type = WATCH_WRITE | WATCH_COUNT;
+	enum stop_reason stop, kind = STOP_NONE;
+	uint64_t end = now, unit, hit = 0;
+	struct exec_mode mode;
+	int32_t i;
+
+	if(size && (offset >= RAM_SIZE || size > RAM_SIZE - offset))
+	{
+		printf("reverse: 0x%08x is not in RAM\n", vaddr);
+		return false;
+	}
+	/* the stores are counted by the watchpoints of mem.h */
+	if(size && !mem_watch_add(cpu, vaddr, size, type))
+		return false;
+	rv->busy = true;
+	for(i = rv->count - 1; i >= 0 && kind == STOP_NONE; i--)
+	{
+		end = i == rv->count - 1 ? now : rv->points[i + 1]->now;
+		reverse_restore(cpu, i);
+		mode = rv->mode;
+		mode.resume = rv->points[i]->mode.resume;
+		while((stop = rerun_until(cpu, &mode, end, UINT64_MAX, &unit)) == STOP_BREAKPOINT ||
+		      stop == STOP_WATCH)
+		{
+			if(unit < now)
+			{
+				kind = stop;
+				hit = unit;
+			}
+			mode.resume = stop == STOP_BREAKPOINT;
+		}
+	}
+	if(kind == STOP_NONE)
+	{
+		if(size)
+			mem_watch_remove(cpu, vaddr, size, type);
+		input_rewind(cpu);
+		rv->busy = false;
+		printf("reverse: no earlier hit, at the start of the history\n");
+		return false;
+	}
+	i++;
+
+	/* blocks are run whole, so the store is somewhere in the one at hit */
+	if(kind == STOP_WATCH && !rv->points[i]->mode.stepping)
+	{
+		reverse_restore(cpu, i);
+		mode = rv->mode;
+		mode.resume = rv->points[i]->mode.resume;
+		while((stop = rerun_until(cpu, &mode, end, hit, &unit)) == STOP_BREAKPOINT ||
+		      (stop == STOP_WATCH && unit < hit))
+			mode.resume = stop == STOP_BREAKPOINT;
+		if(stop == STOP_WATCH)
+			hit = unit;
+	}
+	if(size)
+		mem_watch_remove(cpu, vaddr, size, type);
+	reverse_reach(cpu, i, hit);
+	rv->busy = false;
+	return true;
+}
+
+/* record.c delivered size bytes from source, keep them for running it again */
+void reverse_input(struct cpu_state *cpu, uint32_t source, const void *buf, size_t size)
+{
+	struct reverse *rv = cpu->rev;
+	struct reverse_input *in;
+
+	if(rv->inputs == rv->inputs_size)
+	{
+		rv->inputs_size = rv->inputs_size ? rv->inputs_size * 2 : 64;
+		rv->input = realloc(rv->input, rv->inputs_size * sizeof(rv->input[0]));
+	}
+	in = &rv->input[rv->inputs++];
+	in->now = cpu->sched->now;
+	in->source = source;
+	in->size = size;
+	in->data = malloc(size);
+	memcpy(in->data, buf, size);
+	rv->used += sizeof(struct reverse_input) + size;
+}
+
+/* What source delivered at this point the first time round, up to size bytes */
+ssize_t reverse_input_again(struct cpu_state *cpu, uint32_t source, void *buf, size_t size)
+{
+	struct reverse *rv = cpu->rev;
+	uint32_t i;
+
+	if(!rv)
+		return 0;
+	for(i = input_find(rv, cpu->sched->now); i < rv->inputs && rv->input[i].now == cpu->sched->now; i++)
+	{
+		if(rv->input[i].source != source)
+			continue;
+		if(size > rv->input[i].size)
+			size = rv->input[i].size;
+		memcpy(buf, rv->input[i].data, size);
+		return size;
+	}
+	return 0;
+}
+
+void reverse_info(struct cpu_state *cpu)
+{
+	struct reverse *rv = cpu->rev;
+
+	if(!rv)
+	{
+		printf("history off\n");
+		return;
+	}
+	printf("history of %llu cycles from %llu in %u points, %llu of %llu KiB\n",
+	       (unsigned long long)(cpu->sched->now - rv->points[0]->now),
+	       (unsigned long long)rv->points[0]->now, rv->count,
+	       (unsigned long long)(rv->used >> 10), (unsigned long long)(rv->budget >> 10));
+}
@@ -0,0 +1,18 @@
+#ifndef _REVERSE_H_
+#define _REVERSE_H_
+
+#define REVERSE_INTERVAL 10000000ull		/* cycles between periodic points */
+#define REVERSE_BUDGET   (256ull << 20)	/* bytes of history kept */
+
+bool reverse_enable(struct cpu_state *cpu, uint64_t interval, uint64_t budget);
+void reverse_disable(struct cpu_state *cpu);
+void reverse_point(struct cpu_state *cpu);
+void reverse_batch(struct cpu_state *cpu, uint32_t pc, uint64_t end, bool resume);
+void reverse_forget(struct cpu_state *cpu);
+bool reverse_stepi(struct cpu_state *cpu, uint64_t n);
+bool reverse_continue(struct cpu_state *cpu, uint32_t vaddr, uint32_t size);
+void reverse_input(struct cpu_state *cpu, uint32_t source, const void *buf, size_t size);
+ssize_t reverse_input_again(struct cpu_state *cpu, uint32_t source, void *buf, size_t size);
+void reverse_info(struct cpu_state *cpu);
+
+#endif /* _REVERSE_H_ */
@@ -0,0 +1,131 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "scheduler.h"
+
+void sched_init(struct cpu_state *cpu)
+{
+	cpu->sched = calloc(1, sizeof(struct scheduler));
+	cpu->sched->next = UINT64_MAX;
+}
+
+static void sched_swap(struct scheduler *s, uint32_t a, uint32_t b)
+{
+	struct event tmp = s->heap[a];
+
+	s->heap[a] = s->heap[b];
+	s->heap[b] = tmp;
+}
+
+static void sched_up(struct scheduler *s, uint32_t i)
+{
+	while(i > 0 && s->heap[i].when < s->heap[(i - 1) / 2].when)
+	{
+		sched_swap(s, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void sched_down(struct scheduler *s, uint32_t i)
+{
+	uint32_t min, child;
+
+	for(;;)
+	{
+		min = i;
+		child = 2 * i + 1;
+		if(child < s->count && s->heap[child].when < s->heap[min].when)
+			min = child;
+		if(child + 1 < s->count && s->heap[child + 1].when < s->heap[min].when)
+			min = child + 1;
+		if(min == i)
+			break;
+		sched_swap(s, i, min);
+		i = min;
+	}
+}
+
+static void sched_remove(struct scheduler *s, uint32_t i)
+{
+	s->heap[i] = s->heap[--s->count];
+	if(i < s->count)
+	{
+		sched_up(s, i);
+		sched_down(s, i);
+	}
+	s->next = s->count ? s->heap[0].when : UINT64_MAX;
+}
+
+void sched_cancel(struct cpu_state *cpu, event_fn fn)
+{
+	struct scheduler *s = cpu->sched;
+	uint32_t i;
+
+	for(i = 0; i < s->count; i++)
+	{
+		if(s->heap[i].fn == fn)
+		{
+			sched_remove(s, i);
+			return;
+		}
+	}
+}
+
+void sched_add(struct cpu_state *cpu, uint64_t when, event_fn fn)
+{
+	struct scheduler *s = cpu->sched;
+
+	sched_cancel(cpu, fn);
+	if(s->count == SCHED_MAX_EVENTS)
+	{
+		printf("Too many scheduled events\n");
+		exit(1);
+	}
+	s->heap[s->count].when = when;
+	s->heap[s->count].fn = fn;
+	sched_up(s, s->count++);
+	s->next = s->heap[0].when;
+}
+
+void sched_clear(struct cpu_state *cpu)
+{
+	cpu->sched->count = 0;
+	cpu->sched->next = UINT64_MAX;
+}
+
+/* Fire every event that is due; handlers may schedule further events */
+void sched_run(struct cpu_state *cpu)
+{
+	struct scheduler *s = cpu->sched;
+	event_fn fn;
+
+	while(s->count && s->heap[0].when <= s->now)
+	{
+		fn = s->heap[0].fn;
+		sched_remove(s, 0);
+		fn(cpu);
+	}
+}
+
+/*
+ * Move the clock straight to the next event, but not past limit. Returns
+ * the cycles skipped.
+ */
+uint64_t sched_skip(struct cpu_state *cpu, uint64_t limit)
+{
+	struct scheduler *s = cpu->sched;
+	uint64_t to = s->next < limit ? s->next : limit;
+	uint64_t skip;
+
+	if(to <= s->now)
+		return 0;
+	skip = to - s->now;
+	s->now = to;
+	s->skipped += skip;
+	return skip;
+}
@@ -0,0 +1,40 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#define SCHED_MAX_EVENTS 16
+
+typedef void (*event_fn)(struct cpu_state *cpu);
+
+struct event
+{
+	uint64_t when;
+	event_fn fn;
+};
+
+/*
+ * Future events kept in a min-heap on the virtual cycle clock. The clock
+ * advances by one for every instruction executed, alongside Count. Each
+ * handler has at most one pending event; adding it again moves it.
+ */
+struct scheduler
+{
+	uint64_t now;
+	uint64_t next;		/* when of heap[0], or UINT64_MAX */
+	uint32_t count;
+	uint64_t skipped;	/* cycles jumped over by sched_skip() */
+	struct event heap[SCHED_MAX_EVENTS];
+};
+
+void sched_init(struct cpu_state *cpu);
+void sched_add(struct cpu_state *cpu, uint64_t when, event_fn fn);
+void sched_cancel(struct cpu_state *cpu, event_fn fn);
+void sched_run(struct cpu_state *cpu);
+void sched_clear(struct cpu_state *cpu);
+uint64_t sched_skip(struct cpu_state *cpu, uint64_t limit);
+
+static inline bool sched_due(struct cpu_state *cpu)
+{
+	return cpu->sched->now >= cpu->sched->next;
+}
+
+#endif /* _SCHEDULER_H_ */
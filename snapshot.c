@@ -0,0 +1,416 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "emulator.h"
+#include "mem.h"
+#include "machine.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "reverse.h"
+
+#define SNAPSHOT_ALIGN 4096
+#define SNAPSHOT_DEPTH 64	/* most deltas loaded on top of each other */
+
+#ifdef MEM_SWIZZLE
+#define SNAPSHOT_FLAGS SNAPSHOT_SWIZZLED
+#else
+#define SNAPSHOT_FLAGS 0
+#endif
+
+static uint64_t snapshot_align(uint64_t offset)
+{
+	return (offset + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+static bool write_all(int32_t fd, const void *buf, size_t size, off_t offset)
+{
+	ssize_t n;
+
+	while(size)
+	{
+		n = pwrite(fd, buf, size, offset);
+		if(n <= 0)
+			return false;
+		buf = (const int8_t *)buf + n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static bool read_all(int32_t fd, void *buf, size_t size, off_t offset)
+{
+	ssize_t n;
+
+	while(size)
+	{
+		n = pread(fd, buf, size, offset);
+		if(n <= 0)
+			return false;
+		buf = (int8_t *)buf + n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+void snapshot_cpu_save(struct cpu_state *cpu, struct snapshot_cpu *s)
+{
+	memcpy(s->reg, cpu->reg, sizeof(s->reg));
+	s->HI = cpu->HI;
+	s->LO = cpu->LO;
+	s->pc = cpu->pc;
+	memcpy(s->prev_pc, cpu->prev_pc, sizeof(s->prev_pc));
+	s->delayed_jump = cpu->delayed_jump;
+	s->jump_pc = cpu->jump_pc;
+	s->eret = cpu->eret;
+	s->in_irq = cpu->in_irq;
+	memcpy(s->cop0, cpu->cop0, sizeof(s->cop0));
+}
+
+void snapshot_cpu_restore(struct cpu_state *cpu, const struct snapshot_cpu *s)
+{
+	memcpy(cpu->reg, s->reg, sizeof(s->reg));
+	cpu->HI = s->HI;
+	cpu->LO = s->LO;
+	cpu->pc = s->pc;
+	memcpy(cpu->prev_pc, s->prev_pc, sizeof(s->prev_pc));
+	cpu->delayed_jump = s->delayed_jump;
+	cpu->jump_pc = s->jump_pc;
+	cpu->eret = s->eret;
+	cpu->in_irq = s->in_irq;
+	memcpy(cpu->cop0, s->cop0, sizeof(s->cop0));
+}
+
+static void snapshot_header(struct cpu_state *cpu, struct snapshot_header *h, uint32_t flags)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+	h->version = SNAPSHOT_VERSION;
+	h->flags = SNAPSHOT_FLAGS | flags;
+	h->machine_size = sizeof(struct machine);
+	h->ram_size = RAM_SIZE;
+	h->flash_size = FLASH_SIZE;
+	h->now = cpu->sched->now;
+	h->skipped = cpu->sched->skipped;
+	snapshot_cpu_save(cpu, &h->cpu);
+}
+
+static void snapshot_restore(struct cpu_state *cpu, const struct snapshot_header *h)
+{
+	snapshot_cpu_restore(cpu, &h->cpu);
+	cpu->sched->now = h->now;
+	cpu->sched->skipped = h->skipped;
+}
+
+/*
+ * Later delta snapshots only hold the pages stored to from here on. The
+ * reverse history takes a point here too, before its pages start over.
+ */
+static void snapshot_checkpoint(struct cpu_state *cpu, const char *path)
+{
+	if(cpu->rev)
+		reverse_point(cpu);
+	mem_dirty_reset(cpu, true);
+	free(cpu->checkpoint);
+	cpu->checkpoint = strdup(path);
+}
+
+/*
+ * A snapshot is written under a temporary name and renamed over path once
+ * it is complete: RAM and flash may be mapped from the file it replaces,
+ * and truncating that under them would take them away.
+ */
+static int32_t snapshot_create(const char *path, char **tmp)
+{
+	int32_t fd;
+
+	*tmp = malloc(strlen(path) + sizeof(".tmp"));
+	sprintf(*tmp, "%s.tmp", path);
+	fd = open(*tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		printf("snapshot: cannot create %s\n", *tmp);
+		free(*tmp);
+	}
+	return fd;
+}
+
+static bool snapshot_commit(int32_t fd, char *tmp, const char *path, bool ok)
+{
+	if(close(fd) != 0 || (ok && rename(tmp, path) != 0))
+		ok = false;
+	if(!ok)
+	{
+		printf("snapshot: writing %s failed\n", path);
+		unlink(tmp);
+	}
+	free(tmp);
+	return ok;
+}
+
+/*
+ * Save the registers, the device state and the RAM and flash images. Events
+ * that are already due are fired first, which the next execute() would do
+ * before anything else anyway, so the pending ones can be rebuilt from the
+ * clock on load.
+ */
+bool snapshot_save(struct cpu_state *cpu, const char *path)
+{
+	struct snapshot_header h;
+	char *tmp;
+	int32_t fd;
+	bool ok;
+
+	if(sched_due(cpu))
+		sched_run(cpu);
+	snapshot_header(cpu, &h, 0);
+	h.ram_offset = snapshot_align(sizeof(h) + sizeof(struct machine));
+	h.flash_offset = h.ram_offset + RAM_SIZE;
+
+	fd = snapshot_create(path, &tmp);
+	if(fd < 0)
+		return false;
+	ok = write_all(fd, &h, sizeof(h), 0) &&
+		write_all(fd, cpu->mach, sizeof(struct machine), sizeof(h)) &&
+		write_all(fd, cpu->ram, RAM_SIZE, h.ram_offset) &&
+		write_all(fd, cpu->flash, FLASH_SIZE, h.flash_offset);
+	if(!snapshot_commit(fd, tmp, path, ok))
+		return false;
+	snapshot_checkpoint(cpu, path);
+	return true;
+}
+
+/* Pages that were stored to but hold what they held before are not saved */
+bool snapshot_page_equal(const int8_t *a, const int8_t *b)
+{
+#ifdef __SSE2__
+	__m128i diff = _mm_setzero_si128();
+	uint32_t i;
+
+	for(i = 0; i < MEM_PAGE_SIZE; i += 64)
+	{
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_load_si128((const __m128i *)(a + i)),
+						       _mm_load_si128((const __m128i *)(b + i))));
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_load_si128((const __m128i *)(a + i + 16)),
+						       _mm_load_si128((const __m128i *)(b + i + 16))));
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_load_si128((const __m128i *)(a + i + 32)),
+						       _mm_load_si128((const __m128i *)(b + i + 32))));
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_load_si128((const __m128i *)(a + i + 48)),
+						       _mm_load_si128((const __m128i *)(b + i + 48))));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xffff;
+#else
+	return memcmp(a, b, MEM_PAGE_SIZE) == 0;
+#endif
+}
+
+/*
+ * Save the state with only the RAM pages that changed since the last
+ * snapshot saved or loaded, which becomes the parent. A page is left out
+ * for holding what it held then only while prev still shows that.
+ */
+bool snapshot_save_delta(struct cpu_state *cpu, const char *path)
+{
+	struct snapshot_header h;
+	uint32_t *pages;
+	uint32_t i;
+	char *tmp, *real, *parent;
+	int32_t fd;
+	bool ok;
+
+	if(!cpu->checkpoint || strlen(cpu->checkpoint) >= SNAPSHOT_PATH)
+	{
+		printf("snapshot: no parent for delta %s\n", path);
+		return false;
+	}
+	/* replacing the parent would make the delta its own parent */
+	real = realpath(path, NULL);
+	parent = realpath(cpu->checkpoint, NULL);
+	ok = !real || !parent || strcmp(real, parent) != 0;
+	free(real);
+	free(parent);
+	if(!ok)
+	{
+		printf("snapshot: %s is the parent of the delta\n", path);
+		return false;
+	}
+	if(sched_due(cpu))
+		sched_run(cpu);
+	snapshot_header(cpu, &h, SNAPSHOT_DELTA);
+	strcpy(h.parent, cpu->checkpoint);
+
+	pages = malloc(MEM_RAM_PAGES * sizeof(uint32_t));
+	for(i = 0; i < MEM_RAM_PAGES; i++)
+	{
+		if(mem_page_delta(cpu, i) &&
+		   !(cpu->dirty->delta_prev && mem_page_dirty(cpu, i) &&
+		     snapshot_page_equal(cpu->ram + (i << MEM_PAGE_SHIFT), cpu->dirty->prev + (i << MEM_PAGE_SHIFT))))
+			pages[h.pages++] = i;
+	}
+	h.ram_offset = snapshot_align(sizeof(h) + sizeof(struct machine) + h.pages * sizeof(uint32_t));
+
+	fd = snapshot_create(path, &tmp);
+	if(fd < 0)
+	{
+		free(pages);
+		return false;
+	}
+	ok = write_all(fd, &h, sizeof(h), 0) &&
+		write_all(fd, cpu->mach, sizeof(struct machine), sizeof(h)) &&
+		write_all(fd, pages, h.pages * sizeof(uint32_t), sizeof(h) + sizeof(struct machine));
+	for(i = 0; ok && i < h.pages; i++)
+		ok = write_all(fd, cpu->ram + (pages[i] << MEM_PAGE_SHIFT), MEM_PAGE_SIZE,
+			       h.ram_offset + ((uint64_t)i << MEM_PAGE_SHIFT));
+	/* without pages the file would end before ram_offset */
+	ok = ok && ftruncate(fd, h.ram_offset + ((uint64_t)h.pages << MEM_PAGE_SHIFT)) == 0;
+	free(pages);
+	if(!snapshot_commit(fd, tmp, path, ok))
+		return false;
+	snapshot_checkpoint(cpu, path);
+	return true;
+}
+
+/* Convert an image saved by a build with the other RAM byte order */
+static void snapshot_swap(int8_t *image, uint32_t size)
+{
+	uint32_t i;
+
+	for(i = 0; i + 4 <= size; i += 4)
+		*(int32_t *)(image + i) = ntohl(*(int32_t *)(image + i));
+}
+
+/* Map an image copy-on-write over the buffer that held it */
+static bool snapshot_map(int8_t *image, uint32_t size, int32_t fd, uint64_t offset)
+{
+	return mmap(image, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) != MAP_FAILED;
+}
+
+static bool snapshot_load_chain(struct cpu_state *cpu, const char *path, uint32_t depth);
+
+/* Load the parent, then the pages stored in the delta over it */
+static bool snapshot_load_pages(struct cpu_state *cpu, const struct snapshot_header *h, int32_t fd, uint32_t depth)
+{
+	uint32_t *pages;
+	uint32_t i;
+	bool ok;
+
+	if(depth == SNAPSHOT_DEPTH)
+	{
+		printf("snapshot: more than %u deltas on top of each other, is one its own parent?\n", SNAPSHOT_DEPTH);
+		return false;
+	}
+	if(!snapshot_load_chain(cpu, h->parent, depth + 1))
+		return false;
+	pages = malloc(h->pages * sizeof(uint32_t) + 1);
+	ok = read_all(fd, pages, h->pages * sizeof(uint32_t), sizeof(*h) + sizeof(struct machine));
+	for(i = 0; ok && i < h->pages; i++)
+	{
+		ok = pages[i] < MEM_RAM_PAGES &&
+			read_all(fd, cpu->ram + (pages[i] << MEM_PAGE_SHIFT), MEM_PAGE_SIZE,
+				 h->ram_offset + ((uint64_t)i << MEM_PAGE_SHIFT));
+		if(ok && (h->flags & SNAPSHOT_SWIZZLED) != SNAPSHOT_FLAGS)
+			snapshot_swap(cpu->ram + (pages[i] << MEM_PAGE_SHIFT), MEM_PAGE_SIZE);
+	}
+	free(pages);
+	return ok;
+}
+
+/*
+ * Restore a snapshot into an initialized cpu. RAM and flash are mapped
+ * from the file rather than read, so only the pages the guest touches are
+ * ever loaded; the file must not be changed while the cpu runs. A delta
+ * snapshot loads its parents first. Registered callbacks and host side
+ * settings are kept.
+ */
+bool snapshot_load(struct cpu_state *cpu, const char *path)
+{
+	return snapshot_load_chain(cpu, path, 0);
+}
+
+/* ... depth deltas down from the one snapshot_load() was given */
+static bool snapshot_load_chain(struct cpu_state *cpu, const char *path, uint32_t depth)
+{
+	struct snapshot_header h;
+	struct stat st;
+	uint64_t end;
+	int32_t fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		printf("snapshot: cannot open %s\n", path);
+		return false;
+	}
+	if(!read_all(fd, &h, sizeof(h), 0) ||
+	   memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0 ||
+	   h.version != SNAPSHOT_VERSION ||
+	   h.machine_size != sizeof(struct machine) ||
+	   h.ram_size != RAM_SIZE || h.flash_size != FLASH_SIZE)
+	{
+		printf("snapshot: %s is not a snapshot of this emulator\n", path);
+		close(fd);
+		return false;
+	}
+	if(h.flags & SNAPSHOT_DELTA)
+		end = h.ram_offset + ((uint64_t)h.pages << MEM_PAGE_SHIFT);
+	else
+		end = h.flash_offset + FLASH_SIZE;
+	if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < end ||
+	   ((h.flags & SNAPSHOT_DELTA) && !memchr(h.parent, 0, sizeof(h.parent))))
+	{
+		printf("snapshot: %s is truncated\n", path);
+		close(fd);
+		return false;
+	}
+
+	if(h.flags & SNAPSHOT_DELTA)
+	{
+		if(!snapshot_load_pages(cpu, &h, fd, depth))
+		{
+			/* once, not for every delta in between */
+			if(!depth)
+				printf("snapshot: loading %s failed\n", path);
+			close(fd);
+			return false;
+		}
+	}
+	else if(!snapshot_map(cpu->ram, RAM_SIZE, fd, h.ram_offset) ||
+		!snapshot_map(cpu->flash, FLASH_SIZE, fd, h.flash_offset))
+	{
+		printf("snapshot: loading %s failed\n", path);
+		close(fd);
+		exit(1);
+	}
+	else if((h.flags & SNAPSHOT_SWIZZLED) != SNAPSHOT_FLAGS)
+	{
+		snapshot_swap(cpu->ram, RAM_SIZE);
+		snapshot_swap(cpu->flash, FLASH_SIZE);
+	}
+	if(!read_all(fd, cpu->mach, sizeof(struct machine), sizeof(h)))
+	{
+		printf("snapshot: loading %s failed\n", path);
+		close(fd);
+		exit(1);
+	}
+	close(fd);
+
+	snapshot_restore(cpu, &h);
+	machine_resync(cpu);
+	if(cpu->rev)
+		reverse_forget(cpu);
+	snapshot_checkpoint(cpu, path);
+	return true;
+}
@@ -0,0 +1,60 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#define SNAPSHOT_MAGIC   "TCMSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_PATH    256
+
+#define SNAPSHOT_SWIZZLED 0x01	/* images are in MEM_SWIZZLE order */
+#define SNAPSHOT_DELTA    0x02	/* RAM pages changed since parent only */
+
+/* The architectural part of cpu_state */
+struct snapshot_cpu
+{
+	int32_t reg[32];
+	int32_t HI;
+	int32_t LO;
+	int32_t pc;
+	int32_t prev_pc[3];
+	int32_t delayed_jump;
+	int32_t jump_pc;
+	int32_t eret;
+	int32_t in_irq;
+	int32_t cop0[32][10];
+};
+
+/*
+ * A snapshot file is this header, struct machine, then the RAM and flash
+ * images at page aligned offsets so they can be mapped straight back in.
+ * Images are kept in the byte order the saving build held them in.
+ *
+ * A delta snapshot has, after struct machine, the numbers of the RAM pages
+ * it holds and then those pages from ram_offset on. Everything else comes
+ * from the parent, which is loaded first; flash is never written by the
+ * guest so it is not stored again.
+ */
+struct snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t machine_size;
+	uint32_t ram_size;
+	uint32_t flash_size;
+	uint32_t pages;		/* delta: RAM pages stored */
+	uint64_t ram_offset;
+	uint64_t flash_offset;
+	uint64_t now;		/* scheduler clock */
+	uint64_t skipped;
+	struct snapshot_cpu cpu;
+	char parent[SNAPSHOT_PATH];	/* delta: as passed when it was saved */
+};
+
+bool snapshot_save(struct cpu_state *cpu, const char *path);
+bool snapshot_save_delta(struct cpu_state *cpu, const char *path);
+bool snapshot_load(struct cpu_state *cpu, const char *path);
+void snapshot_cpu_save(struct cpu_state *cpu, struct snapshot_cpu *s);
+void snapshot_cpu_restore(struct cpu_state *cpu, const struct snapshot_cpu *s);
+bool snapshot_page_equal(const int8_t *a, const int8_t *b);
+
+#endif /* _SNAPSHOT_H_ */
@@ -0,0 +1,405 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "emulator.h"
+#include "mem.h"
+#include "scheduler.h"
+#include "symbol.h"
+
+/* A callback wanted at a name, moved there once the name is known */
+struct symbol_hook
+{
+	char *name;
+	uint32_t addr;		/* where it is registered, 0 for nowhere yet */
+	void (*fn)(struct cpu_state *cpu);
+};
+
+/*
+ * Symbols are kept sorted by address for the pc lookups of the profiler
+ * and the instruction log, with an index sorted by name beside it. Both
+ * are sorted again on the first lookup after symbols were added.
+ */
+struct symtab
+{
+	uint32_t count;
+	uint32_t size;
+	struct symbol *sym;
+	uint32_t *by_name;
+	bool sorted;
+	uint32_t hooks;
+	struct symbol_hook *hook;
+	/* the table the last look found, believed once found twice */
+	uint32_t scan_at;
+	uint32_t scan_count;
+};
+
+static struct symtab *symtab(struct cpu_state *cpu)
+{
+	if(!cpu->syms)
+		cpu->syms = calloc(1, sizeof(struct symtab));
+	return cpu->syms;
+}
+
+static void symbol_add(struct symtab *st, uint32_t addr, char type, const char *name)
+{
+	if(st->count == st->size)
+	{
+		st->size = st->size ? st->size * 2 : 1024;
+		st->sym = realloc(st->sym, st->size * sizeof(struct symbol));
+	}
+	st->sym[st->count].addr = addr;
+	st->sym[st->count].type = type;
+	st->sym[st->count].name = strndup(name, SYMBOL_NAME_MAX - 1);
+	st->count++;
+	st->sorted = false;
+}
+
+/* At one address text goes before data, globals before locals */
+static int symbol_rank(char type)
+{
+	return (type == 'T' || type == 't' ? 0 : 2) + (type >= 'a');
+}
+
+static int symbol_addr_cmp(const void *a, const void *b)
+{
+	const struct symbol *x = a, *y = b;
+
+	if(x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	if(symbol_rank(x->type) != symbol_rank(y->type))
+		return symbol_rank(x->type) - symbol_rank(y->type);
+	return strcmp(x->name, y->name);
+}
+
+/* qsort() has no context, so the name index is sorted with the names beside it */
+struct symbol_name
+{
+	const char *name;
+	uint32_t index;
+};
+
+static int symbol_name_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct symbol_name *)a)->name, ((const struct symbol_name *)b)->name);
+}
+
+static void symbol_sort(struct symtab *st)
+{
+	struct symbol_name *names;
+	uint32_t i, n;
+
+	if(st->sorted)
+		return;
+	qsort(st->sym, st->count, sizeof(struct symbol), symbol_addr_cmp);
+	/* the same symbol from a file and from the image */
+	for(i = n = 0; i < st->count; i++)
+	{
+		if(n && st->sym[n - 1].addr == st->sym[i].addr && strcmp(st->sym[n - 1].name, st->sym[i].name) == 0)
+			free(st->sym[i].name);
+		else
+			st->sym[n++] = st->sym[i];
+	}
+	st->count = n;
+	names = malloc(st->count * sizeof(struct symbol_name) + 1);
+	for(i = 0; i < st->count; i++)
+	{
+		names[i].name = st->sym[i].name;
+		names[i].index = i;
+	}
+	qsort(names, st->count, sizeof(struct symbol_name), symbol_name_cmp);
+	st->by_name = realloc(st->by_name, st->count * sizeof(uint32_t));
+	for(i = 0; i < st->count; i++)
+		st->by_name[i] = names[i].index;
+	free(names);
+	st->sorted = true;
+}
+
+/* The symbol at or closest below addr, NULL below the first one */
+const struct symbol *symbol_at(struct cpu_state *cpu, uint32_t addr)
+{
+	struct symtab *st = cpu->syms;
+	uint32_t lo = 0, hi, mid;
+
+	if(!st || !st->count)
+		return NULL;
+	symbol_sort(st);
+	hi = st->count;
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if(st->sym[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(!lo)
+		return NULL;
+	for(lo--; lo && st->sym[lo - 1].addr == st->sym[lo].addr; lo--)
+		;
+	return &st->sym[lo];
+}
+
+bool symbol_addr(struct cpu_state *cpu, const char *name, uint32_t *addr)
+{
+	struct symtab *st = cpu->syms;
+	uint32_t lo = 0, hi, mid;
+	int c;
+
+	if(!st || !st->count)
+		return false;
+	symbol_sort(st);
+	hi = st->count;
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		c = strcmp(st->sym[st->by_name[mid]].name, name);
+		if(!c)
+		{
+			*addr = st->sym[st->by_name[mid]].addr;
+			return true;
+		}
+		if(c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+/* name, name+offset or just the address */
+const char *symbol_format(struct cpu_state *cpu, uint32_t addr, char *buf, size_t size)
+{
+	const struct symbol *s = symbol_at(cpu, addr);
+
+	if(!s)
+		snprintf(buf, size, "0x%08x", addr);
+	else if(s->addr == addr)
+		snprintf(buf, size, "%s", s->name);
+	else
+		snprintf(buf, size, "%s+0x%x", s->name, addr - s->addr);
+	return buf;
+}
+
+/* Move the hooks to the names that are known now */
+static void symbol_resolve(struct cpu_state *cpu)
+{
+	struct symtab *st = cpu->syms;
+	struct symbol_hook *h;
+	uint32_t i, addr;
+
+	for(i = 0; i < st->hooks; i++)
+	{
+		h = &st->hook[i];
+		if(!symbol_addr(cpu, h->name, &addr) || addr == h->addr)
+			continue;
+		if(h->addr)
+			unregister_callback(cpu, h->addr, h->fn);
+		register_callback(cpu, addr, h->fn);
+		h->addr = addr;
+	}
+}
+
+/*
+ * Call callback at the function called name, as soon as a symbol table
+ * has it; until then at fallback, unless that is 0.
+ */
+void register_callback_symbol(struct cpu_state *cpu, const char *name, uint32_t fallback, void(*callback)(struct cpu_state *))
+{
+	struct symtab *st = symtab(cpu);
+	struct symbol_hook *h;
+
+	st->hook = realloc(st->hook, (st->hooks + 1) * sizeof(struct symbol_hook));
+	h = &st->hook[st->hooks++];
+	h->name = strdup(name);
+	h->addr = 0;
+	h->fn = callback;
+	if(!symbol_addr(cpu, name, &h->addr) && fallback)
+		h->addr = fallback;
+	if(h->addr)
+		register_callback(cpu, h->addr, callback);
+	symbol_schedule(cpu);
+}
+
+/* Read "address [type] name" lines, as nm writes them */
+bool symbol_load(struct cpu_state *cpu, const char *path)
+{
+	struct symtab *st = symtab(cpu);
+	char line[SYMBOL_NAME_MAX + 32], type[SYMBOL_NAME_MAX], name[SYMBOL_NAME_MAX];
+	uint32_t addr, n = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if(!f)
+	{
+		printf("symbols: cannot open %s\n", path);
+		return false;
+	}
+	while(fgets(line, sizeof(line), f))
+	{
+		switch(sscanf(line, "%x %127s %127s", &addr, type, name))
+		{
+		case 3:
+			if(!type[1])
+			{
+				symbol_add(st, addr, type[0], name);
+				break;
+			}
+			/* fall through */
+		case 2:
+			symbol_add(st, addr, 'T', type);
+			break;
+		default:
+			continue;
+		}
+		n++;
+	}
+	fclose(f);
+	printf("symbols: %u from %s\n", n, path);
+	symbol_resolve(cpu);
+	return true;
+}
+
+/*
+ * vxWorks images built with a standalone symbol table carry it as an
+ * array of SYMBOL: a hash chain pointer (zero until the table is hashed
+ * at startup), a name pointer, the value, a 16 bit group (0 for the image
+ * itself) and a type byte whose low bit marks a global. Any run of
+ * entries that only point into RAM at names that look like names is taken
+ * to be one.
+ */
+static inline uint32_t ram_word(struct cpu_state *cpu, uint32_t off)
+{
+	return MEM_WORD(*(uint32_t *)(cpu->ram + off));
+}
+
+static inline bool in_ram(uint32_t vaddr)
+{
+	return vaddr - RAM_START < RAM_SIZE;
+}
+
+static char vx_type(uint32_t type)
+{
+	static const char types[] = { [0x2] = 'a', [0x4] = 't', [0x8] = 'd', [0x10] = 'b', [0x20] = 'c' };
+	char c;
+
+	if((type & 0x3e) != (type & ~1) || (type & 0x3e) >= sizeof(types) || !(c = types[type & 0x3e]))
+		return 0;
+	return type & 1 ? c - 'a' + 'A' : c;
+}
+
+/* The symbol table entry at RAM offset off, into name */
+static bool vx_entry(struct cpu_state *cpu, uint32_t off, char *name, uint32_t *addr, char *type)
+{
+	uint32_t next, str, info, i;
+
+	if(off + 16 > RAM_SIZE)
+		return false;
+	str = ram_word(cpu, off + 4);
+	if(!in_ram(str))
+		return false;
+	next = ram_word(cpu, off);
+	info = ram_word(cpu, off + 12);
+	*addr = ram_word(cpu, off + 8);
+	*type = vx_type((info >> 8) & 0xff);
+	if((next && !in_ram(next)) || info >> 16 || !*type || ((*type == 'T' || *type == 't') && !in_ram(*addr)))
+		return false;
+	str -= RAM_START;
+	for(i = 0; i < SYMBOL_NAME_MAX && str + i < RAM_SIZE; i++)
+	{
+		name[i] = cpu->ram[MEM_ADDR8(str + i)];
+		if(!name[i])
+			return i > 0;
+		if(name[i] <= ' ' || name[i] >= 0x7f)
+			return false;
+	}
+	return false;
+}
+
+/* The longest run of entries in RAM, its length and offset in *at */
+static uint32_t vx_find(struct cpu_state *cpu, uint32_t *at)
+{
+	char name[SYMBOL_NAME_MAX], type;
+	uint32_t off, n, best = 0, addr;
+
+	*at = 0;
+	for(off = 0; off < RAM_SIZE; off += 4)
+	{
+		for(n = 0; vx_entry(cpu, off + 16 * n, name, &addr, &type); n++)
+			;
+		if(n > best)
+		{
+			best = n;
+			*at = off;
+		}
+		if(n)
+			off += 16 * n - 4;
+	}
+	return best;
+}
+
+static uint32_t vx_import(struct cpu_state *cpu, uint32_t at, uint32_t count)
+{
+	struct symtab *st = symtab(cpu);
+	char name[SYMBOL_NAME_MAX], type;
+	uint32_t i, addr;
+
+	for(i = 0; i < count; i++)
+	{
+		vx_entry(cpu, at + 16 * i, name, &addr, &type);
+		symbol_add(st, addr, type, name);
+	}
+	symbol_resolve(cpu);
+	return count;
+}
+
+/* Look for the vxWorks symbol table in RAM now, the number found */
+uint32_t symbol_scan(struct cpu_state *cpu)
+{
+	uint32_t at, n = vx_find(cpu, &at);
+
+	if(n < SYMBOL_MIN_RUN)
+	{
+		printf("symbols: no vxWorks symbol table in RAM\n");
+		return 0;
+	}
+	printf("symbols: %u in the vxWorks symbol table at 0x%08x\n", n, RAM_START + at);
+	return vx_import(cpu, at, n);
+}
+
+/*
+ * While hooks wait for names and no symbols are loaded, look for the table
+ * every SYMBOL_POLL cycles. RAM is only trusted once the same table is
+ * found twice, so one still being decompressed is not taken.
+ */
+static void symbol_event(struct cpu_state *cpu)
+{
+	struct symtab *st = cpu->syms;
+	uint32_t at, n;
+
+	if(st->count)
+		return;
+	n = vx_find(cpu, &at);
+	if(n >= SYMBOL_MIN_RUN && n == st->scan_count && at == st->scan_at)
+	{
+		if(!cpu->rerun)
+			printf("symbols: %u in the vxWorks symbol table at 0x%08x\n", n, RAM_START + at);
+		vx_import(cpu, at, n);
+		return;
+	}
+	st->scan_at = at;
+	st->scan_count = n;
+	symbol_schedule(cpu);
+}
+
+void symbol_schedule(struct cpu_state *cpu)
+{
+	struct symtab *st = cpu->syms;
+	uint64_t now = cpu->sched->now;
+
+	if(st && st->hooks && !st->count)
+		sched_add(cpu, now - now % SYMBOL_POLL + SYMBOL_POLL, symbol_event);
+}
@@ -0,0 +1,24 @@
+#ifndef _SYMBOL_H_
+#define _SYMBOL_H_
+
+#define SYMBOL_NAME_MAX 128		/* longer names are cut */
+#define SYMBOL_MIN_RUN  64		/* entries a vxWorks table has at least */
+#define SYMBOL_POLL     100000000ull	/* cycles between looks for the table */
+
+/* One name, type as nm prints it: T text, D data, B bss, A absolute... */
+struct symbol
+{
+	uint32_t addr;
+	char type;
+	char *name;
+};
+
+bool symbol_load(struct cpu_state *cpu, const char *path);
+uint32_t symbol_scan(struct cpu_state *cpu);
+void symbol_schedule(struct cpu_state *cpu);
+const struct symbol *symbol_at(struct cpu_state *cpu, uint32_t addr);
+bool symbol_addr(struct cpu_state *cpu, const char *name, uint32_t *addr);
+const char *symbol_format(struct cpu_state *cpu, uint32_t addr, char *buf, size_t size);
+void register_callback_symbol(struct cpu_state *cpu, const char *name, uint32_t fallback, void(*callback)(struct cpu_state *));
+
+#endif /* _SYMBOL_H_ */
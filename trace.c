@@ -0,0 +1,281 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "emulator.h"
+#include "mem.h"
+#include "opcode.h"
+#include "trace.h"
+
+/*
+ * Records go from the emulator into a single producer, single consumer
+ * ring; a thread drains it into the compressed file. head is only written
+ * by the emulator and tail only by the thread, so neither side takes a
+ * lock. When the thread falls a whole ring behind the emulator waits for
+ * it rather than lose records.
+ */
+struct tracer
+{
+	struct trace_record *ring;
+	uint64_t head;		/* next record to fill */
+	uint64_t tail;		/* next record to drain */
+	bool done;
+	pthread_t thread;
+	gzFile out;
+	int32_t reg[34];	/* as of the last record, then HI and LO */
+	struct trace_record cur;	/* the instruction running */
+	uint8_t rt;
+	bool pending;
+};
+
+/* exit() from anywhere still ends the file properly */
+static struct cpu_state *traced;
+
+static void trace_regs(struct cpu_state *cpu, int32_t *reg)
+{
+	memcpy(reg, cpu->reg, sizeof(cpu->reg));
+	reg[TRACE_HI] = cpu->HI;
+	reg[TRACE_LO] = cpu->LO;
+}
+
+static void trace_push(struct tracer *t, const struct trace_record *r)
+{
+	uint64_t head = t->head;
+
+	while(head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) == TRACE_RING)
+		usleep(100);
+	t->ring[head & (TRACE_RING - 1)] = *r;
+	__atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void *trace_drain(void *arg)
+{
+	struct tracer *t = arg;
+	uint64_t head, tail = t->tail, n;
+	bool done;
+
+	for(;;)
+	{
+		/* done first: a head read after it has everything */
+		done = __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+		if(head == tail)
+		{
+			if(done)
+				break;
+			usleep(1000);
+			continue;
+		}
+		n = head - tail;
+		if(n > TRACE_RING - (tail & (TRACE_RING - 1)))
+			n = TRACE_RING - (tail & (TRACE_RING - 1));
+		gzwrite(t->out, &t->ring[tail & (TRACE_RING - 1)], n * sizeof(struct trace_record));
+		tail += n;
+		__atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* Record the registers that differ from what the trace last said */
+static void trace_sync(struct tracer *t, const int32_t *reg)
+{
+	struct trace_record r;
+	uint32_t i;
+
+	memset(&r, 0, sizeof(r));
+	r.flags = TRACE_SYNC;
+	for(i = 0; i < 34; i++)
+	{
+		if(reg[i] == t->reg[i])
+			continue;
+		r.reg = i;
+		r.value = reg[i];
+		t->reg[i] = reg[i];
+		trace_push(t, &r);
+	}
+}
+
+static void trace_exit(void)
+{
+	if(traced)
+		trace_stop(traced);
+}
+
+/*
+ * The writer thread does not survive fork(), and the file is the parent's
+ * to finish; a forkserver child goes on untraced.
+ */
+static void trace_forked(void)
+{
+	if(!traced)
+		return;
+	free(traced->trace->ring);
+	free(traced->trace);
+	traced->trace = NULL;
+	traced = NULL;
+}
+
+/* Write a record of every instruction run from now on to path */
+bool trace_start(struct cpu_state *cpu, const char *path)
+{
+	static bool registered;
+	struct trace_header h;
+	struct tracer *t;
+	gzFile out;
+
+	trace_stop(cpu);
+	out = gzopen(path, "wb1");
+	if(!out)
+	{
+		printf("trace: cannot create %s\n", path);
+		return false;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	h.version = TRACE_VERSION;
+	h.record_size = sizeof(struct trace_record);
+	memcpy(h.reg, cpu->reg, sizeof(h.reg));
+	h.HI = cpu->HI;
+	h.LO = cpu->LO;
+	gzwrite(out, &h, sizeof(h));
+
+	t = calloc(1, sizeof(struct tracer));
+	t->ring = malloc(TRACE_RING * sizeof(struct trace_record));
+	t->out = out;
+	trace_regs(cpu, t->reg);
+	if(pthread_create(&t->thread, NULL, trace_drain, t) != 0)
+	{
+		printf("trace: cannot start the writer thread\n");
+		gzclose(out);
+		free(t->ring);
+		free(t);
+		return false;
+	}
+	cpu->trace = t;
+	traced = cpu;
+	if(!registered)
+	{
+		atexit(trace_exit);
+		pthread_atfork(NULL, NULL, trace_forked);
+	}
+	registered = true;
+	return true;
+}
+
+void trace_stop(struct cpu_state *cpu)
+{
+	struct tracer *t = cpu->trace;
+
+	if(!t)
+		return;
+	__atomic_store_n(&t->done, true, __ATOMIC_RELEASE);
+	pthread_join(t->thread, NULL);
+	gzclose(t->out);
+	free(t->ring);
+	free(t);
+	cpu->trace = NULL;
+	if(traced == cpu)
+		traced = NULL;
+}
+
+/* step_insn() is about to run insn, at pc */
+void trace_insn(struct cpu_state *cpu, const struct insn *insn, uint32_t pc)
+{
+	struct tracer *t = cpu->trace;
+	struct trace_record *r = &t->cur;
+	int32_t reg[34];
+	uint32_t op;
+	int8_t *page;
+
+	/* history being repeated was traced the first time round */
+	if(cpu->rerun)
+		return;
+	trace_regs(cpu, reg);
+	if(memcmp(reg, t->reg, sizeof(reg)) != 0)
+		trace_sync(t, reg);
+
+	memset(r, 0, sizeof(*r));
+	r->pc = pc;
+	r->insn = insn->instruction;
+	r->reg = TRACE_NO_REG;
+	if(insn->flags & (INSN_LOAD | INSN_STORE))
+	{
+		r->addr = cpu->reg[insn->rs] + insn->im16;
+		if(insn->flags & INSN_STORE)
+		{
+			r->flags = TRACE_STORE;
+			r->data = cpu->reg[insn->rt];
+		}
+		else
+			r->flags = TRACE_LOAD;
+	}
+	t->rt = insn->rt;
+	op = decode_opcode(insn->instruction);
+	if((op == INS_LWL || op == INS_LWR) && (page = cpu->mem_read[r->addr >> MEM_PAGE_SHIFT]))
+	{
+		/* rt is only partly loaded, keep the word it is merged from */
+		r->data = MEM_WORD(*(int32_t *)(page + (r->addr & MEM_PAGE_MASK & ~3)));
+		t->rt = TRACE_NO_REG;
+	}
+	t->pending = true;
+}
+
+/* ... and has run it */
+void trace_commit(struct cpu_state *cpu)
+{
+	struct tracer *t = cpu->trace;
+	struct trace_record *r = &t->cur;
+	int32_t reg[34];
+	uint32_t i;
+
+	if(!t->pending)
+		return;
+	t->pending = false;
+	trace_regs(cpu, reg);
+	for(i = 1; i < 32 && r->reg == TRACE_NO_REG; i++)
+	{
+		if(reg[i] != t->reg[i])
+		{
+			r->reg = i;
+			r->value = reg[i];
+			t->reg[i] = reg[i];
+		}
+	}
+	if(r->flags & TRACE_LOAD)
+	{
+		if(t->rt != TRACE_NO_REG)
+			r->data = reg[t->rt];
+	}
+	else if(reg[TRACE_HI] != t->reg[TRACE_HI] && reg[TRACE_LO] != t->reg[TRACE_LO] &&
+		r->reg == TRACE_NO_REG)
+	{
+		/* mult and div set both */
+		r->flags = TRACE_HILO;
+		r->value = reg[TRACE_LO];
+		r->data = reg[TRACE_HI];
+		t->reg[TRACE_HI] = reg[TRACE_HI];
+		t->reg[TRACE_LO] = reg[TRACE_LO];
+	}
+	else if(r->reg == TRACE_NO_REG)
+	{
+		for(i = TRACE_HI; i <= TRACE_LO && r->reg == TRACE_NO_REG; i++)
+		{
+			if(reg[i] != t->reg[i])
+			{
+				r->reg = i;
+				r->value = reg[i];
+				t->reg[i] = reg[i];
+			}
+		}
+	}
+	trace_push(t, r);
+	/* anything else the instruction changed */
+	if(memcmp(reg, t->reg, sizeof(reg)) != 0)
+		trace_sync(t, reg);
+}
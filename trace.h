@@ -0,0 +1,51 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#define TRACE_MAGIC   "TCMTRC"
+#define TRACE_VERSION 1
+#define TRACE_RING    (1 << 20)	/* records buffered, a power of two */
+
+#define TRACE_LOAD   0x01	/* addr and data are those of a load */
+#define TRACE_STORE  0x02	/* ... of a store */
+#define TRACE_HILO   0x04	/* value is the new LO, data the new HI */
+#define TRACE_SYNC   0x08	/* not an instruction: reg changed between two */
+
+#define TRACE_NO_REG 0xff
+#define TRACE_HI     32		/* reg numbers beyond the GPRs */
+#define TRACE_LO     33
+
+/*
+ * A trace is a gzip file of a struct trace_header, with the registers as
+ * tracing started, and then one struct trace_record per instruction run,
+ * in host byte order. Registers changed other than by an instruction, by
+ * a callback say, get a TRACE_SYNC record before the next instruction, so
+ * the register file can be followed through the whole trace.
+ */
+struct trace_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	int32_t reg[32];
+	int32_t HI;
+	int32_t LO;
+};
+
+struct trace_record
+{
+	uint32_t pc;
+	uint32_t insn;
+	uint32_t value;		/* the new value of reg */
+	uint32_t addr;		/* load/store address */
+	uint32_t data;		/* value loaded (as in rt) or stored, the word lwl/lwr merge */
+	uint8_t reg;		/* register written, TRACE_NO_REG for none */
+	uint8_t flags;
+	uint16_t pad;
+};
+
+bool trace_start(struct cpu_state *cpu, const char *path);
+void trace_stop(struct cpu_state *cpu);
+void trace_insn(struct cpu_state *cpu, const struct insn *insn, uint32_t pc);
+void trace_commit(struct cpu_state *cpu);
+
+#endif /* _TRACE_H_ */
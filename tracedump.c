@@ -0,0 +1,124 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "emulator.h"
+#include "mem.h"
+#include "opcode.h"
+#include "trace.h"
+#include "symbol.h"
+
+/*
+ * Print a trace written by -t or the CLI's trace command the way drun
+ * would have: each record is put back on an idle machine, registers as
+ * they were before it, and instlog() run on it. The instruction and the
+ * memory a load read are planted in scratch pages mapped over theirs, so
+ * no device is read; the word swl/swr merge into is not in the trace and
+ * shows as zero. Functions are labelled from an nm style symbol file.
+ */
+static int8_t code[MEM_PAGE_SIZE];
+static int8_t data[MEM_PAGE_SIZE];
+
+static void apply(struct cpu_state *cpu, const struct trace_record *r)
+{
+	if(r->flags & TRACE_HILO)
+	{
+		cpu->LO = r->value;
+		cpu->HI = r->data;
+	}
+	else if(r->reg == TRACE_HI)
+		cpu->HI = r->value;
+	else if(r->reg == TRACE_LO)
+		cpu->LO = r->value;
+	else if(r->reg < 32)
+		cpu->reg[r->reg] = r->value;
+}
+
+static void show(struct cpu_state *cpu, const struct trace_record *r)
+{
+	uint32_t cp = r->pc >> MEM_PAGE_SHIFT, dp = r->addr >> MEM_PAGE_SHIFT;
+	int8_t *host = cpu->mem_host[cp], *read = cpu->mem_read[dp];
+	int8_t *page = dp == cp ? code : data;
+	uint32_t opcode = decode_opcode(r->insn);
+
+	cpu->mem_host[cp] = code;
+	*(int32_t *)(code + (r->pc & MEM_PAGE_MASK & ~3)) = MEM_WORD(r->insn);
+	if(r->flags & (TRACE_LOAD | TRACE_STORE))
+	{
+		cpu->mem_read[dp] = page;
+		if(opcode == INS_LW || opcode == INS_LWL || opcode == INS_LWR)
+			*(int32_t *)(page + (r->addr & MEM_PAGE_MASK & ~3)) = MEM_WORD(r->data);
+		else if(opcode == INS_LBU)
+			page[MEM_ADDR8(r->addr & MEM_PAGE_MASK)] = r->data;
+	}
+
+	/* mfc0 shows the register as read */
+	if((r->insn & 0xffe007f8) == 0x40000000)
+		cpu->cop0[(r->insn >> 11) & 0x1f][r->insn & 3] = r->value;
+
+	cpu->pc = r->pc;
+	instlog(cpu);
+
+	if(r->flags & (TRACE_LOAD | TRACE_STORE))
+	{
+		memset(page, 0, MEM_PAGE_SIZE);
+		cpu->mem_read[dp] = read;
+	}
+	memset(code, 0, MEM_PAGE_SIZE);
+	cpu->mem_host[cp] = host;
+}
+
+int32_t main(int32_t argc, char **argv)
+{
+	struct trace_header h;
+	struct trace_record r;
+	uint64_t n = 0;
+	gzFile in;
+
+	if(argc != 2 && argc != 3)
+	{
+		printf("usage: %s trace [symbols]\n", argv[0]);
+		return 1;
+	}
+	in = gzopen(argv[1], "rb");
+	if(!in)
+	{
+		printf("cannot open %s\n", argv[1]);
+		return 1;
+	}
+	if(gzread(in, &h, sizeof(h)) != sizeof(h) || memcmp(h.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+	   h.version != TRACE_VERSION || h.record_size != sizeof(r))
+	{
+		printf("%s is not a trace\n", argv[1]);
+		return 1;
+	}
+
+	initialize_emulator(&cpu, "/dev/null");
+	initialize_cpu(&cpu, FLASH_START);
+	if(argc == 3 && !symbol_load(&cpu, argv[2]))
+		return 1;
+	memcpy(cpu.reg, h.reg, sizeof(cpu.reg));
+	cpu.HI = h.HI;
+	cpu.LO = h.LO;
+	/* instlog() writes to stderr while debugging */
+	cpu.debug = true;
+	dup2(1, 2);
+
+	while(gzread(in, &r, sizeof(r)) == sizeof(r))
+	{
+		if(!(r.flags & TRACE_SYNC))
+		{
+			show(&cpu, &r);
+			n++;
+		}
+		apply(&cpu, &r);
+	}
+	gzclose(in);
+	fprintf(stderr, "%llu instructions\n", (unsigned long long)n);
+	return 0;
+}
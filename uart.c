@@ -0,0 +1,316 @@
+#define _GNU_SOURCE		/* posix_openpt(), ptsname() */
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+#include "machine.h"
+#include "record.h"
+#include "uart.h"
+
+/*
+ * The host end of uart0. Output goes from the emulator into a single
+ * producer, single consumer ring that a thread writes out at a newline,
+ * once the ring is half full and otherwise every UART_FLUSH_MS, so the
+ * emulator does not pay a write() per character. As in trace.c head is
+ * only written by the emulator and tail only by the thread. On the console
+ * a full ring makes the emulator wait; on a PTY nobody may be reading, so
+ * what does not fit is dropped instead.
+ *
+ * Input only comes from the PTY. emulator.c looks for it every
+ * UART_RX_POLL cycles with uart_read(), which never blocks and goes
+ * through input_poll() so it is recorded and replayed with the rest, and
+ * delivered again when reverse.c runs history again.
+ */
+struct uart
+{
+	uint8_t *tx;
+	uint64_t head;		/* next byte to fill */
+	uint64_t tail;		/* next byte to write */
+	bool kick;		/* write out now, not at the timeout */
+	bool done;
+	bool started;
+	bool running;
+	uint32_t forks;		/* the thread does not survive fork(), see uart_forked() */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int32_t pty;		/* the PTY master, -1 for the console */
+	int32_t slave;		/* held open so the master is never hung up */
+	uint64_t dropped;
+	struct uart *next;
+};
+
+/*
+ * All of them are flushed by exit(). Instances may run on threads of their
+ * own, so the list is only gone through under the lock, which fork() takes
+ * as well so the child does not inherit it held.
+ */
+static pthread_mutex_t uarts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct uart *uarts;
+static uint32_t forks;
+
+static void uart_fork_prepare(void)
+{
+	pthread_mutex_lock(&uarts_lock);
+}
+
+static void uart_fork_parent(void)
+{
+	pthread_mutex_unlock(&uarts_lock);
+}
+
+static void uart_forked(void)
+{
+	__atomic_store_n(&forks, forks + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&uarts_lock);
+}
+
+/* The writer threads started in this process, not one fork() left behind */
+static bool uart_ours(struct uart *u)
+{
+	return u->forks == __atomic_load_n(&forks, __ATOMIC_ACQUIRE);
+}
+
+static void uart_stop(struct uart *u)
+{
+	if(!u->running || !uart_ours(u))
+		return;
+	__atomic_store_n(&u->done, true, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&u->lock);
+	pthread_cond_signal(&u->wake);
+	pthread_mutex_unlock(&u->lock);
+	pthread_join(u->thread, NULL);
+	u->running = false;
+	if(u->dropped)
+		printf("uart0: %llu bytes nobody read were dropped\n", (unsigned long long)u->dropped);
+}
+
+static void uart_exit(void)
+{
+	struct uart *u;
+
+	pthread_mutex_lock(&uarts_lock);
+	for(u = uarts; u; u = u->next)
+		uart_stop(u);
+	pthread_mutex_unlock(&uarts_lock);
+}
+
+static struct uart *uart(struct cpu_state *cpu)
+{
+	static bool registered;
+	struct uart *u = cpu->uart;
+
+	if(u)
+		return u;
+	u = calloc(1, sizeof(struct uart));
+	u->tx = malloc(UART_TX_RING);
+	u->pty = -1;
+	u->slave = -1;
+	pthread_mutex_lock(&uarts_lock);
+	if(!registered)
+	{
+		atexit(uart_exit);
+		pthread_atfork(uart_fork_prepare, uart_fork_parent, uart_forked);
+		registered = true;
+	}
+	u->next = uarts;
+	uarts = u;
+	pthread_mutex_unlock(&uarts_lock);
+	cpu->uart = u;
+	return u;
+}
+
+/* Write out what is in the ring up to head, as far as the PTY takes it */
+static void uart_out(struct uart *u, uint64_t head)
+{
+	int32_t pty = __atomic_load_n(&u->pty, __ATOMIC_ACQUIRE);
+	uint64_t tail = u->tail;
+	ssize_t n;
+
+	if(tail == head)
+		return;
+	while(tail != head)
+	{
+		n = head - tail;
+		if(n > UART_TX_RING - (tail & (UART_TX_RING - 1)))
+			n = UART_TX_RING - (tail & (UART_TX_RING - 1));
+		if(pty < 0)
+			n = fwrite(&u->tx[tail & (UART_TX_RING - 1)], 1, n, stdout);
+		else
+			n = write(pty, &u->tx[tail & (UART_TX_RING - 1)], n);
+		if(n <= 0)
+			break;
+		tail += n;
+		__atomic_store_n(&u->tail, tail, __ATOMIC_RELEASE);
+	}
+	if(pty < 0)
+		fflush(stdout);
+}
+
+static void *uart_drain(void *arg)
+{
+	struct uart *u = arg;
+	struct timespec ts;
+	bool done;
+
+	for(;;)
+	{
+		/* done first: a head read after it has everything */
+		done = __atomic_load_n(&u->done, __ATOMIC_ACQUIRE);
+		uart_out(u, __atomic_load_n(&u->head, __ATOMIC_ACQUIRE));
+		if(done)
+			break;
+		pthread_mutex_lock(&u->lock);
+		if(!__atomic_load_n(&u->kick, __ATOMIC_ACQUIRE) && !__atomic_load_n(&u->done, __ATOMIC_ACQUIRE))
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += UART_FLUSH_MS * 1000000;
+			if(ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&u->wake, &u->lock, &ts);
+		}
+		__atomic_store_n(&u->kick, false, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&u->lock);
+	}
+	return NULL;
+}
+
+/* Have the thread write out now, one wakeup however often it is asked */
+static void uart_kick(struct uart *u)
+{
+	if(__atomic_exchange_n(&u->kick, true, __ATOMIC_ACQ_REL))
+		return;
+	pthread_mutex_lock(&u->lock);
+	pthread_cond_signal(&u->wake);
+	pthread_mutex_unlock(&u->lock);
+}
+
+static void uart_start(struct uart *u)
+{
+	/* after fork() what is left in the ring is the parent's to write */
+	if(u->started)
+		u->tail = u->head;
+	u->started = true;
+	u->forks = __atomic_load_n(&forks, __ATOMIC_ACQUIRE);
+	u->done = false;
+	u->kick = false;
+	pthread_mutex_init(&u->lock, NULL);
+	pthread_cond_init(&u->wake, NULL);
+	u->running = pthread_create(&u->thread, NULL, uart_drain, u) == 0;
+	if(!u->running)
+		printf("uart0: cannot start the writer thread, writing unbuffered\n");
+}
+
+/* Transmit one byte */
+void uart_write(struct cpu_state *cpu, uint8_t c)
+{
+	struct uart *u = uart(cpu);
+	uint64_t head = u->head;
+
+	if(!u->started || !uart_ours(u))
+		uart_start(u);
+	if(!u->running)
+	{
+		if(u->pty < 0)
+		{
+			putchar(c);
+			fflush(stdout);
+		}
+		else if(write(u->pty, &c, 1) != 1)
+			u->dropped++;
+		return;
+	}
+	while(head - __atomic_load_n(&u->tail, __ATOMIC_ACQUIRE) == UART_TX_RING)
+	{
+		if(u->pty >= 0)
+		{
+			u->dropped++;
+			return;
+		}
+		uart_kick(u);
+		usleep(100);
+	}
+	u->tx[head & (UART_TX_RING - 1)] = c;
+	__atomic_store_n(&u->head, head + 1, __ATOMIC_RELEASE);
+	if(c == '\n' || head + 1 - __atomic_load_n(&u->tail, __ATOMIC_ACQUIRE) >= UART_TX_RING / 2)
+		uart_kick(u);
+}
+
+/* Wait until the console has everything, before the CLI prompts */
+void uart_flush(struct cpu_state *cpu)
+{
+	struct uart *u = cpu->uart;
+
+	if(!u || !u->running || !uart_ours(u) || u->pty >= 0)
+		return;
+	uart_kick(u);
+	while(__atomic_load_n(&u->tail, __ATOMIC_ACQUIRE) != u->head)
+		usleep(100);
+}
+
+/*
+ * Move uart0 from the console to a new pseudo-terminal, for minicom or a
+ * script to talk to the guest's shell. Its name is printed.
+ */
+bool uart_pty(struct cpu_state *cpu)
+{
+	struct uart *u = uart(cpu);
+	struct termios t;
+	int32_t fd, slave = -1;
+
+	if(u->pty >= 0)
+	{
+		printf("uart0: already on %s\n", ptsname(u->pty));
+		return true;
+	}
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(fd < 0 || grantpt(fd) || unlockpt(fd) || (slave = open(ptsname(fd), O_RDWR | O_NOCTTY)) < 0)
+	{
+		printf("uart0: cannot open a PTY\n");
+		if(fd >= 0)
+			close(fd);
+		return false;
+	}
+	/* bytes go through as they are, without echo or line editing */
+	if(tcgetattr(slave, &t) == 0)
+	{
+		cfmakeraw(&t);
+		tcsetattr(slave, TCSANOW, &t);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	uart_flush(cpu);
+	u->slave = slave;
+	__atomic_store_n(&u->pty, fd, __ATOMIC_RELEASE);
+	printf("uart0: %s\n", ptsname(fd));
+	/* start looking for input */
+	machine_resync(cpu);
+	return true;
+}
+
+bool uart_input(struct cpu_state *cpu)
+{
+	return cpu->uart && cpu->uart->pty >= 0;
+}
+
+/* What arrived on the PTY, up to size bytes, 0 rather than wait */
+ssize_t uart_read(struct cpu_state *cpu, void *buf, size_t size)
+{
+	ssize_t n;
+
+	if(!uart_input(cpu) || !size)
+		return 0;
+	n = input_poll(cpu, INPUT_UART0_RX, cpu->uart->pty, buf, size);
+	return n > 0 ? n : 0;
+}
@@ -0,0 +1,14 @@
+#ifndef _UART_H_
+#define _UART_H_
+
+#define UART_TX_RING  65536		/* bytes of output not yet written, a power of two */
+#define UART_FLUSH_MS 20		/* longest a line without its newline waits */
+#define UART_RX_POLL  100000ull		/* cycles between looks for input on the PTY */
+
+bool uart_pty(struct cpu_state *cpu);
+bool uart_input(struct cpu_state *cpu);
+void uart_write(struct cpu_state *cpu, uint8_t c);
+void uart_flush(struct cpu_state *cpu);
+ssize_t uart_read(struct cpu_state *cpu, void *buf, size_t size);
+
+#endif /* _UART_H_ */